@@ -3,26 +3,68 @@
 
 #include <filesystem>
 #include <fstream>
+#include <sstream>
+#include <type_traits>
 
+#include "BloomFilter.hpp"
+#include "Database.hpp"
+#include "DirectFile.hpp"
+#include "KeySearch.hpp"
+#include "Latches.hpp"
+#include "MappedFile.hpp"
+#include "PackedFile.hpp"
+#include "PageStore.hpp"
 #include "utility.hpp"
 
 using std::fstream;
 
+/**
+ * @brief how node_file and value_file are accessed: through fstream, mmap
+ * (MappedFile) or io_uring with O_DIRECT (DirectFile)
+ * in a Database, FSTREAM reads and writes through the page cache with
+ * pread/pwrite instead (a DirectFile without O_DIRECT)
+ * MEMORY keeps the files in memory only (MappedFile without a file), so that
+ * the cost of the tree itself can be measured apart from I/O: nothing is
+ * written to disk or retrieved, and the tree is lost when destroyed
+ */
+enum class Storage { FSTREAM, MAPPED, DIRECT, MEMORY };
+
+/**
+ * @brief how keys are found: through the levels of the tree (TREE), or by
+ * their hashes through a directory of buckets (HASH), which usually reads
+ * one leaf per lookup, but has no order: lower_bound()/upper_bound() are not
+ * supported, and iterators go through the keys in no particular order
+ */
+enum class Index { TREE, HASH };
+
 /**
  * @brief functions for reading from/writing into files (flow: continuous I/O)
  */
-template <class T> inline void read_flow_(fstream &fs, T &x) {
+template <class T> inline void read_flow_(istream &fs, T &x) {
   fs.read((char *)&x, sizeof(x));
 }
+template <class T> inline void write_flow_(ostream &fs, T &x) {
+  fs.write((char *)&x, sizeof(x));
+}
+template <class T> inline void read_flow_(istream &fs, sjtu::vector<T> &vec) {
+  size_t n = 0;
+  read_flow_(fs, n);
+  vec.clear();
+  for (T x; n--;)
+    read_flow_(fs, x), vec.push_back(x);
+}
+template <class T> inline void write_flow_(ostream &fs, sjtu::vector<T> &vec) {
+  size_t n = vec.size();
+  write_flow_(fs, n);
+  for (size_t i = 0; i < n; i++)
+    write_flow_(fs, vec[i]);
+}
 template <class T, class... Args>
-inline void read_flow_(fstream &fs, T &x, Args &...args) {
+inline void read_flow_(istream &fs, T &x, Args &...args) {
   read_flow_(fs, x), read_flow_(fs, args...);
 }
-template <class T> inline void write_flow_(fstream &fs, T &x) {
-  fs.write((char *)&x, sizeof(x));
-}
 template <class T, class... Args>
-inline void write_flow_(fstream &fs, T &x, Args &...args) {
+inline void write_flow_(ostream &fs, T &x, Args &...args) {
   write_flow_(fs, x), write_flow_(fs, args...);
 }
 template <class T1> inline void read_(fstream &fs, T1 &x, int pos) {
@@ -37,12 +79,69 @@ template <class T1> inline void write_(fstream &fs, T1 &x, int pos) {
 /**
  * @brief B+ tree
  * Key and T must have fixed size
+ * in concurrent mode, any number of threads may read (find, lower_bound,
+ * upper_bound, get, iterators) while other threads modify the tree, except
+ * during clear() and vacuum(); see Latches
  */
 template <class Key, class T> class BPT {
 
-  using Data = pair<Key, int>;
-  static constexpr size_t szmax = std::max(4000 / (int)(sizeof(Data)) - 1, 4),
-                          szmin = szmax >> 1;
+protected:
+  /**
+   * @brief values no larger than INLINE_MAX are stored in leaves next to
+   * their keys, so that no value_file access is needed to read them
+   */
+  static constexpr size_t INLINE_MAX = 64;
+  static constexpr bool INLINE = sizeof(T) <= INLINE_MAX;
+
+  /**
+   * @brief the second half of a leaf entry of an inlined tree: the value
+   * itself (it converts from and to the position of a child, so that entries
+   * of either kind of node pass as Data)
+   */
+  struct InlineRef {
+    alignas(T) alignas(int) char buf[std::max(sizeof(T), sizeof(int))];
+    InlineRef(int pos = -1) { memcpy(buf, &pos, sizeof(pos)); }
+    static InlineRef of(const T &val) {
+      InlineRef ret;
+      memcpy(ret.buf, (const void *)&val, sizeof(T));
+      return ret;
+    }
+    operator int() const {
+      int pos;
+      memcpy(&pos, buf, sizeof(pos));
+      return pos;
+    }
+    const T &value() const { return *(const T *)buf; }
+  };
+  using Ref = std::conditional_t<INLINE, InlineRef, int>;
+  using Data = pair<Key, Ref>;
+  /**
+   * @brief value_file is divided into pages of PER_PAGE consecutive values of
+   * about PAGE bytes (a value of half a page or more is a page alone): the
+   * unit of compression if packed, and of caching in CachedBPT
+   */
+  static constexpr size_t PAGE = 4096;
+  static constexpr size_t PER_PAGE =
+      sizeof(T) * 2 > PAGE ? 1 : PAGE / sizeof(T);
+
+private:
+  // the most entries of a leaf and of an internal node: they differ only if
+  // INLINE, as the children of an internal node are still positions
+  static constexpr size_t szleaf =
+      std::max(4000 / (int)(sizeof(Key) + sizeof(Ref)) - 1, 4);
+  static constexpr size_t szinner =
+      std::max(4000 / (int)(sizeof(Key) + sizeof(int)) - 1, 4);
+  static constexpr size_t align_up(size_t n, size_t a) {
+    return (n + a - 1) / a * a;
+  }
+  // where refs start in a node, after szleaf + 1 or szinner + 1 keys
+  static constexpr size_t LEAF_REFS =
+      align_up((szleaf + 1) * sizeof(Key), alignof(Ref));
+  static constexpr size_t INNER_REFS =
+      align_up((szinner + 1) * sizeof(Key), alignof(int));
+  static constexpr size_t NODE_BYTES =
+      std::max(LEAF_REFS + (szleaf + 1) * sizeof(Ref),
+               INNER_REFS + (szinner + 1) * sizeof(int));
   friend class iterator;
 
 public:
@@ -59,77 +158,166 @@ public:
 protected:
   /**
    * @brief pair<key, pos> only stores pos for both a leaf and an internal
-    node to minimize the size of a node
+    node to minimize the size of a node (small values are stored inline
+    instead of pos in a leaf, see INLINE)
    * @param key max of subtree;
    * @param pos that of a child or a value
    */
   struct Node {
-    size_t size = 0;          // degree
-    int pos;                  // where the node is stored in node_file
-    int prev = -1, next = -1; // position of adjacent siblings in node_file
+    size_t size = 0; // degree
+    int pos;         // where the node is stored in node_file
     bool leaf;
-    Data data[szmax + 1];
+    // keys are stored apart from refs so that a search scans a dense array:
+    // the keys (max of each subtree, or the keys in a leaf), then vals() in
+    // a leaf (position of each value, or the value) or kids() in an internal
+    // node (position of each child), laid out as many as fit (see szmax())
+    alignas(Key) alignas(Ref) char buf[NODE_BYTES];
     explicit Node(int pos = -1, bool leaf = true) : pos(pos), leaf(leaf) {}
-    Data &operator[](size_t idx) { return data[idx]; }
-    const Data &operator[](size_t idx) const { return data[idx]; }
-    Key &max_key() { return data[size - 1].first; }
-    const Key &max_key() const { return data[size - 1].first; }
+    Key *keys() { return (Key *)buf; }
+    const Key *keys() const { return (const Key *)buf; }
+    Ref *vals() { return (Ref *)(buf + LEAF_REFS); }
+    const Ref *vals() const { return (const Ref *)(buf + LEAF_REFS); }
+    int *kids() { return (int *)(buf + INNER_REFS); }
+    const int *kids() const { return (const int *)(buf + INNER_REFS); }
+    size_t szmax() const { return leaf ? szleaf : szinner; }
+    size_t szmin() const { return szmax() >> 1; }
+    Data entry(size_t idx) const {
+      return Data(keys()[idx], leaf ? vals()[idx] : Ref(kids()[idx]));
+    }
+    void assign(size_t idx, const Data &x) {
+      keys()[idx] = x.first;
+      if (leaf)
+        vals()[idx] = x.second;
+      else
+        kids()[idx] = x.second;
+    }
+    Key &max_key() { return keys()[size - 1]; }
+    const Key &max_key() const { return keys()[size - 1]; }
     bool operator==(const Node &rhs) const { return pos == rhs.pos; }
     bool operator!=(const Node &rhs) const { return pos != rhs.pos; }
     operator int() const { return pos; }
 
     /**
-     * @brief find the index of  the first key >= or > x in data[]
+     * @brief find the index of  the first key >= or > x in keys()
      */
     size_t lower_bound(const Key &x) const {
-      int left = 0, right = size - 1, mid, ret = size;
-      while (left <= right) {
-        mid = (left + right) >> 1;
-        if (data[mid].first < x)
-          left = mid + 1;
-        else
-          ret = mid, right = mid - 1;
-      }
-      return ret;
+      return KeySearch<Key>::lower_bound(keys(), size, x);
     }
     size_t upper_bound(const Key &x) const {
-      int left = 0, right = size - 1, mid, ret = size;
-      while (left <= right) {
-        mid = (left + right) >> 1;
-        if (x < data[mid].first)
-          ret = mid, right = mid - 1;
-        else
-          left = mid + 1;
-      }
-      return ret;
+      return KeySearch<Key>::upper_bound(keys(), size, x);
     }
 
     /**
-     * @brief insert x at data[idx]
+     * @brief insert x at index idx
      */
     void insert(const Data &x, size_t idx) {
-      for (size_t i = size++; i > idx; i--) {
-        data[i] = data[i - 1];
+      Key *k = keys();
+      for (size_t i = size; i > idx; i--)
+        k[i] = k[i - 1];
+      if (leaf) {
+        Ref *r = vals();
+        for (size_t i = size; i > idx; i--)
+          r[i] = r[i - 1];
+      } else {
+        int *r = kids();
+        for (size_t i = size; i > idx; i--)
+          r[i] = r[i - 1];
       }
-      data[idx] = x;
+      ++size;
+      assign(idx, x);
     }
     /**
-     * @brief erase data[idx]
+     * @brief erase the entry at index idx
      */
     void erase(size_t idx) {
       --size;
-      for (size_t i = idx; i < size; i++) {
-        data[i] = data[i + 1];
+      Key *k = keys();
+      for (size_t i = idx; i < size; i++)
+        k[i] = k[i + 1];
+      if (leaf) {
+        Ref *r = vals();
+        for (size_t i = idx; i < size; i++)
+          r[i] = r[i + 1];
+      } else {
+        int *r = kids();
+        for (size_t i = idx; i < size; i++)
+          r[i] = r[i + 1];
       }
     }
 
   } root, null;
-  int beg_pos, end_pos; // position of the first/last leaf node
+  Node peek_buf; // scratch space for peek() during descents
 
-  fstream tree_file, node_file, value_file;
-  string tree_filename, node_filename, value_filename;
+  Storage storage;
+  bool mapped, direct; // storage is MAPPED/DIRECT (ref_file is an fstream
+                       // unless mapped or in a database)
+  bool memory;         // storage is MEMORY (which counts as mapped)
+  bool hashed;         // the index is HASH (see hash_find())
+  bool packed;         // value_file is a PackedFile (see the constructor)
+  Database *db; // holding the files as segments (named after them), if any
+  string tree_image; // the header, in place of tree_file if in memory
+  int tree_seg = -1, node_seg = -1, value_seg = -1, ref_seg = -1,
+      page_seg = -1;
+  fstream tree_file;
+  // the files of nodes, values and reference counts (see open_files());
+  // value_file is value_pages (with page_file) if packed
+  PageStore *node_file = nullptr, *value_file = nullptr, *ref_file = nullptr;
+  PackedFile *value_pages = nullptr;
+  string name; // as given to the constructor
+  string tree_filename, node_filename, value_filename, ref_filename,
+      page_filename, bloom_filename, snap_bloom_filename;
   sjtu::vector<int> node_pool,
       value_pool; // pools for recycling external storage
+  sjtu::vector<pair<int, int>> snaps; // (id, position of root) of snapshots
+  // (slot, checksum) of the image of the Bloom filter saved with each
+  // snapshot in snap_bloom_filename (see save_snap_bloom())
+  sjtu::vector<pair<size_t, size_t>> snap_blooms;
+  string snap_bloom_image; // snap_bloom_filename, if in memory
+  Latches *latches = nullptr; // concurrent mode only
+  BloomFilter<Key> *bloom = nullptr; // optional, see find()
+  std::atomic<int> root_pos;  // root.pos as published to concurrent readers
+
+  static size_t node_latch(int pos) { return (size_t)pos << 1; }
+  static size_t value_latch(int pos) { return (size_t)pos << 1 | 1; }
+  /**
+   * @brief latches what the current modification is about to change or free
+   * (concurrent mode), so that optimistic readers retry
+   */
+  void latch_node(int pos) {
+    if (latches && latches->writing())
+      latches->lock(node_latch(pos));
+  }
+  void latch_value(int pos) {
+    if (latches && latches->writing())
+      latches->lock(value_latch(pos));
+  }
+  /**
+   * @brief holds the lock of the fstreams in concurrent mode (see StreamFile)
+   */
+  std::unique_lock<std::mutex> io_lock() {
+    if (latches && !mapped && !direct)
+      return std::unique_lock<std::mutex>(latches->io);
+    return std::unique_lock<std::mutex>();
+  }
+  /**
+   * @brief scope of a modification: in concurrent mode, it serializes writers,
+   * and finally publishes the root and releases the latches
+   */
+  class Writing {
+    BPT *tr;
+
+  public:
+    explicit Writing(BPT *tr_) : tr(tr_) {
+      if (tr->latches)
+        tr->latches->begin_write();
+    }
+    ~Writing() {
+      if (tr->latches) {
+        tr->root_pos.store(tr->root.pos, std::memory_order_release);
+        tr->latches->end_write();
+      }
+    }
+  };
   /**
    * @brief find a new position in the file
    */
@@ -139,11 +327,8 @@ protected:
       node_pool.pop_back();
       return p;
     }
-    node_file.seekp(0, ios::end);
-    int pos = node_file.tellp();
-    write_(node_file, null,
-           pos); // make sure the new position is actually allocated
-    return pos;
+    auto lock = io_lock();
+    return node_file->append(sizeof(Node));
   }
   virtual int new_value() {
     if (!value_pool.empty()) {
@@ -151,21 +336,237 @@ protected:
       value_pool.pop_back();
       return p;
     }
-    value_file.seekp(0, ios::end);
-    int pos = value_file.tellp();
-    return pos;
+    auto lock = io_lock();
+    return value_file->append(sizeof(T));
+  }
+  virtual void delete_node(int pos) {
+    latch_node(pos);
+    node_pool.push_back(pos);
+  }
+  virtual void delete_value(int pos) {
+    latch_value(pos);
+    value_pool.push_back(pos);
   }
-  virtual void delete_node(int pos) { node_pool.push_back(pos); }
-  virtual void delete_value(int pos) { value_pool.push_back(pos); }
 
-  virtual void read(Node &x, int pos) { read_(node_file, x, pos); }
-  virtual void write(Node &x, int pos) { write_(node_file, x, pos); }
+  virtual void read(Node &x, int pos) {
+    auto lock = io_lock();
+    read_(*node_file, x, pos);
+  }
+  virtual void write(Node &x, int pos) {
+    latch_node(pos);
+    auto lock = io_lock();
+    write_(*node_file, x, pos);
+  }
+  /**
+   * @brief reads the nodes at pos[0, n) into xs, with one submission of the
+   * reads if direct
+   */
+  virtual void read_many(Node *xs, const int *pos, size_t n) {
+    if (n == 0)
+      return;
+    vector<void *> dst;
+    vector<size_t> off;
+    for (size_t i = 0; i < n; i++)
+      dst.push_back(&xs[i]), off.push_back(pos[i]);
+    auto lock = io_lock();
+    node_file->read_many(n, &dst[0], sizeof(Node), &off[0]);
+  }
   virtual void read(Node &x) { read(x, x.pos); }
   virtual void write(Node &x) { write(x, x.pos); }
-  virtual void read_value(T &x, int pos) { read_(value_file, x, pos); }
-  virtual void write_value(T &x, int pos) { write_(value_file, x, pos); }
-  virtual void read_value(const T &x, int pos) { read_(value_file, x, pos); }
-  virtual void write_value(const T &x, int pos) { write_(value_file, x, pos); }
+  virtual void read_value(T &x, int pos) {
+    auto lock = io_lock();
+    read_(*value_file, x, pos);
+  }
+  virtual void write_value(T &x, int pos) {
+    BPT::write_value((const T &)x, pos);
+  }
+  virtual void read_value(const T &x, int pos) {
+    auto lock = io_lock();
+    value_file->read((void *)&x, sizeof(T), pos);
+  }
+  virtual void write_value(const T &x, int pos) {
+    latch_value(pos);
+    auto lock = io_lock();
+    write_(*value_file, x, pos);
+  }
+  /**
+   * @brief reads for concurrent readers, which rely on the latches to detect
+   * torn copies, and must not modify any cache
+   */
+  virtual void read_shared(Node &x, int pos) { BPT::read(x, pos); }
+  virtual void read_value_shared(T &x, int pos) { BPT::read_value(x, pos); }
+  /**
+   * @brief reads the values at pos, pos + sizeof(T), ... into xs[0, n), as
+   * many of them as value_file holds (whole pages if packed)
+   * @return the number of values read
+   */
+  size_t read_values(T *xs, int pos, size_t n) {
+    auto lock = io_lock();
+    size_t len = value_file->size();
+    n = len > (size_t)pos ? min(n, (len - pos) / sizeof(T)) : 0;
+    if (n)
+      value_file->read((void *)xs, n * sizeof(T), pos);
+    return n;
+  }
+  /**
+   * @brief writes xs[0, n) at pos, pos + sizeof(T), ...
+   */
+  void write_values(const T *xs, int pos, size_t n) {
+    if (!n)
+      return;
+    auto lock = io_lock();
+    value_file->write((const void *)xs, n * sizeof(T), pos);
+  }
+  size_t node_file_size() {
+    auto lock = io_lock();
+    return node_file->size();
+  }
+  /**
+   * @brief reference counts of the nodes and values shared with snapshots,
+   * stored in ref_file as the number of references besides the first one
+   * (0 if not shared): the counts of the node and the value with index i are
+   * the two ints at 8i
+   */
+  static int node_rc(int pos) { return pos / sizeof(Node) * 8; }
+  static int value_rc(int pos) { return pos / sizeof(T) * 8 + 4; }
+  virtual int read_rc(int off) {
+    int cnt = 0; // beyond the end of ref_file
+    auto lock = io_lock();
+    if (off + sizeof(int) <= ref_file->size())
+      read_(*ref_file, cnt, off);
+    return cnt;
+  }
+  virtual void write_rc(int off, int cnt) {
+    auto lock = io_lock();
+    cover_rc(off);
+    write_(*ref_file, cnt, off);
+  }
+  /**
+   * @brief extends ref_file to hold the count at off
+   */
+  void cover_rc(int off) {
+    size_t len = ref_file->size();
+    if (off + sizeof(int) > len)
+      ref_file->append(off + sizeof(int) - len);
+  }
+  /**
+   * @brief returns a read-only pointer to the node at pos without copying it
+   * when possible (into the mapping if mapped, otherwise into buf)
+   * the pointer is valid until the next modification of the tree
+   */
+  virtual const Node *peek(int pos, Node &buf) {
+    if (const char *p = node_file->map(pos))
+      return (const Node *)p;
+    read(buf, pos);
+    return &buf;
+  }
+  static constexpr size_t READ_AHEAD = 8; // leaves read ahead by a scan
+  static constexpr size_t VALUE_GAP = 1 << 14; // value runs closer are merged
+  /**
+   * @brief called when an iterator moves on to leaf x (a sequential scan):
+   * hints that the values of x and the n leaves at leaves[] (the ones after
+   * x, found in its parent every READ_AHEAD leaves) are about to be read, so
+   * that they are read in asynchronously. fstreams take no hints
+   */
+  virtual void read_ahead(const Node &x, const int *leaves, size_t n) {
+    if (!mapped && !direct)
+      return;
+    for (size_t l = 0, r; mapped && l < n; l = r) { // adjacent leaves at once
+      for (r = l + 1; r < n && leaves[r] == leaves[r - 1] + (int)sizeof(Node);
+           r++)
+        ;
+      node_file->will_need(leaves[l], (r - l) * sizeof(Node));
+    }
+    if constexpr (!INLINE) {
+      if (packed)
+        return; // pages are decoded on demand
+      int pos[szleaf + 1];
+      for (size_t i = 0; i < x.size; i++) { // insertion sort: nearly sorted
+        size_t j = i;
+        for (; j && pos[j - 1] > x.vals()[i]; j--)
+          pos[j] = pos[j - 1];
+        pos[j] = x.vals()[i];
+      }
+      for (size_t l = 0, r; l < x.size; l = r) {
+        for (r = l + 1;
+             r < x.size && size_t(pos[r] - pos[r - 1]) <= VALUE_GAP; r++)
+          ;
+        value_file->will_need(pos[l], pos[r - 1] - pos[l] + sizeof(T));
+      }
+    }
+  }
+  /**
+   * @brief read-only access to the node at pos for an iterator, valid until
+   * unpin(): a copy here, the cached node itself in CachedBPT (concurrent
+   * readers always hold copies)
+   * ! iterators must not outlive clear(), vacuum() or the tree
+   */
+  virtual const Node *pin(int pos) {
+    Node *x = new Node;
+    read(*x, pos);
+    return x;
+  }
+  /**
+   * @brief pins the pinned node x once more (in concurrent mode, x may be
+   * any node, which is copied)
+   */
+  virtual const Node *repin(const Node *x) { return new Node(*x); }
+  virtual void unpin(const Node *x) { delete x; }
+  /**
+   * @brief writes the header and makes the files durable
+   * @param sync_db = false: a database is left to be synced by the caller
+   * (once for all its trees)
+   */
+  void sync_files(bool sync_db = true) {
+    if (memory)
+      return;
+    auto lock = io_lock();
+    save_bloom();
+    write_header();
+    if (db) {
+      node_file->wait();
+      if (sync_db)
+        db->sync();
+      return;
+    }
+    tree_file.flush();
+    fsync_path(tree_filename);
+    node_file->sync(), value_file->sync(), ref_file->sync();
+  }
+  /**
+   * @brief the header of tree_file: root, the pools of free
+   * positions (left empty if !pools), the snapshots and their Bloom filters,
+   * the number of keys
+   * added to the Bloom filter (which tells whether its file is up to date) and
+   * the state of value_file if packed
+   */
+  string header(bool pools = true) const {
+    string s;
+    auto put = [&](const auto &x) { s.append((const char *)&x, sizeof(x)); };
+    auto put_vec = [&](const auto &vec, size_t n) {
+      put(n);
+      for (size_t i = 0; i < n; i++)
+        put(vec[i]);
+    };
+    put(root.pos);
+    put_vec(node_pool, pools ? node_pool.size() : 0);
+    put_vec(value_pool, pools ? value_pool.size() : 0);
+    put_vec(snaps, snaps.size());
+    put_vec(snap_blooms, snap_blooms.size());
+    put(bloom ? bloom->seq : size_t(0));
+    if (packed)
+      s += value_pages->state(pools);
+    return s;
+  }
+  /**
+   * @brief sets an inlined value in leaf x and writes x back
+   */
+  void write_inline(Node &x, size_t idx, const T &val) {
+    x.vals()[idx] = InlineRef::of(val);
+    write(x);
+    if (x == root)
+      root = x;
+  }
 
 private:
   /**
@@ -175,6 +576,386 @@ private:
     fs.open(name, ios::out);
     fs.close();
   }
+  /**
+   * @return a file of the tree, opened according to the storage mode: segment
+   * seg of the database if any, else the file name (neither if in memory)
+   * @param record size of the records in the file (see DirectFile)
+   * @param cached = true: through the page cache even if direct
+   */
+  PageStore *new_store(const string &name, int seg, size_t record, bool trunc,
+                       bool cached) {
+    if (memory) {
+      MappedFile *f = new MappedFile;
+      f->open();
+      return f;
+    }
+    if (mapped) {
+      MappedFile *f = new MappedFile;
+      db ? f->open(*db, seg, trunc) : f->open(name, trunc);
+      return f;
+    }
+    if (direct) {
+      DirectFile *f = new DirectFile;
+      if (db)
+        f->open(*db, seg, record, trunc,
+                cached || storage == Storage::FSTREAM);
+      else
+        f->open(name, record, trunc, cached);
+      return f;
+    }
+    StreamFile *f = new StreamFile;
+    f->open(name, trunc);
+    return f;
+  }
+  /**
+   * @brief opens node_file, value_file and ref_file (the counts are read
+   * one by one, so ref_file keeps the page cache)
+   */
+  void open_files(ios::openmode mode) {
+    bool trunc = mode & ios::trunc;
+    if (memory && node_file && !trunc)
+      return; // the files of a tree in memory last as long as the tree
+    close_files();
+    node_file = new_store(node_filename, node_seg, sizeof(Node), trunc, false);
+    ref_file = new_store(ref_filename, ref_seg, sizeof(int), trunc, true);
+    open_values(trunc);
+  }
+  /**
+   * @brief opens value_file: packed into pages (see PackedFile), which are
+   * mapped whatever the storage mode, or accessed like node_file
+   */
+  void open_values(bool trunc) {
+    size_t page = PER_PAGE * sizeof(T);
+    if (!packed)
+      // slabs of values are not page-aligned, so O_DIRECT would make every
+      // write-back read its pages first: values keep the page cache
+      value_file = new_store(value_filename, value_seg, sizeof(T), trunc, true);
+    else if (memory)
+      value_pages->open(page);
+    else if (db)
+      value_pages->open(page, *db, value_seg, page_seg, trunc);
+    else
+      value_pages->open(page, value_filename, page_filename, trunc);
+    if (packed)
+      value_file = value_pages;
+  }
+  void close_files() {
+    if (!node_file)
+      return;
+    node_file->close(), value_file->close(), ref_file->close();
+    if (value_file != value_pages)
+      delete value_file;
+    delete node_file, delete ref_file;
+    node_file = value_file = ref_file = nullptr;
+  }
+  /**
+   * @brief opens the tree: reads the header (see header()) from tree_file,
+   * or creates an empty tree
+   */
+  void open(bool retrieve) {
+    auto mode = ios::in | ios::out | ios::binary;
+    if (!retrieve)
+      mode |= ios::trunc;
+    size_t bloom_seq = 0;
+    root = Node();
+    node_pool.clear(), value_pool.clear(), snaps.clear(), snap_blooms.clear();
+    if (db) {
+      tree_seg = db->segment(tree_filename);
+      node_seg = db->segment(node_filename);
+      value_seg = db->segment(value_filename);
+      ref_seg = db->segment(ref_filename);
+      if (packed)
+        page_seg = db->segment(page_filename);
+      if (!retrieve)
+        db->truncate(tree_seg);
+      std::istringstream fs(db->load(tree_filename));
+      read_header(fs, bloom_seq);
+    } else if (memory) {
+      if (!retrieve)
+        tree_image.clear();
+      std::istringstream fs(tree_image);
+      read_header(fs, bloom_seq);
+    } else {
+      tree_file.open(tree_filename, mode);
+      if (!tree_file) { // a new tree: its other files are emptied too
+        create_file(tree_file, tree_filename);
+        mode |= ios::trunc;
+        tree_file.open(tree_filename, mode);
+      } else if (retrieve) {
+        tree_file.seekg(0);
+        read_header(tree_file, bloom_seq);
+        tree_file.clear(); // an empty header sets failbit
+      }
+    }
+    open_files(mode);
+    if (root.pos == -1) {
+      new_root();
+    } else if (retrieve) {
+      // bypasses any cache, which may hold nodes of the old files (vacuum)
+      BPT::read(root, root.pos);
+    }
+    root_pos.store(root.pos, std::memory_order_release);
+    if (bloom && !(retrieve && load_bloom(bloom_seq)))
+      rebuild_bloom(true);
+  }
+  /**
+   * @brief writes the root of an empty tree (an empty leaf, or a directory
+   * of one empty slot if hashed)
+   */
+  void new_root() {
+    if (!hashed) {
+      root = Node(new_node());
+      return write(root);
+    }
+    Node x(new_node(), false);
+    x.size = 1, x.kids()[0] = -1;
+    write(x);
+    root = Node(new_node(), false);
+    root.size = 1, root.kids()[0] = x.pos;
+    write(root);
+  }
+  /**
+   * @brief reads the header written by header() (an empty one leaves the
+   * tree empty)
+   */
+  void read_header(istream &fs, size_t &bloom_seq) {
+    read_flow_(fs, root.pos, node_pool, value_pool);
+    read_flow_(fs, snaps);
+    read_flow_(fs, snap_blooms);
+    read_flow_(fs, bloom_seq);
+    if (packed)
+      value_pages->restore(fs);
+  }
+  bool load_bloom(size_t seq) {
+    if (memory)
+      return false; // rebuilt instead
+    if (db)
+      return bloom->restore(db->load(bloom_filename), seq);
+    return bloom->load(bloom_filename, seq);
+  }
+  void save_bloom() {
+    if (memory)
+      return;
+    if (bloom && db)
+      db->store(bloom_filename, bloom->image());
+    else if (bloom)
+      bloom->save(bloom_filename);
+  }
+  /**
+   * @brief reads (or writes) n bytes at pos of snap_bloom_filename; bytes
+   * after its end are read as zeros
+   */
+  void snap_bloom_io(bool writing, char *p, size_t n, size_t pos) {
+    if (memory) {
+      if (snap_bloom_image.size() < pos + n)
+        snap_bloom_image.resize(pos + n);
+      writing ? memcpy(&snap_bloom_image[pos], p, n)
+              : memcpy(p, &snap_bloom_image[pos], n);
+    } else if (db) {
+      int id = db->segment(snap_bloom_filename);
+      if (writing && db->size(id) < pos + n)
+        db->resize(id, pos + n);
+      if (writing)
+        db->write(id, p, n, pos);
+      else if (db->size(id) >= pos + n)
+        db->read(id, p, n, pos);
+    } else {
+      if (!std::filesystem::exists(snap_bloom_filename)) {
+        if (!writing)
+          return;
+        fstream fs;
+        create_file(fs, snap_bloom_filename);
+      }
+      fstream fs(snap_bloom_filename, ios::in | ios::out | ios::binary);
+      if (writing)
+        fs.seekp(pos), fs.write(p, n);
+      else
+        fs.seekg(pos), fs.read(p, n);
+      if (writing && !fs)
+        throw "Error in BPT: cannot save the Bloom filter of a snapshot";
+    }
+  }
+  /**
+   * @brief saves the image of the Bloom filter for the snapshot being taken,
+   * in the first slot of snap_bloom_filename no other snapshot uses; with its
+   * checksum kept in the header, the image needs not be durable: a lost or
+   * torn one is detected by load_snap_bloom()
+   */
+  void save_snap_bloom() {
+    size_t slot = 0;
+    for (size_t i = 0; i < snap_blooms.size();)
+      snap_blooms[i].first == slot ? (slot++, i = 0) : i++;
+    string img = bloom->image();
+    snap_bloom_io(true, img.data(), img.size(), slot * img.size());
+    size_t sum = WAL::checksum(img.data(), img.size());
+    snap_blooms.push_back(pair<size_t, size_t>(slot, sum));
+  }
+  /**
+   * @brief adds the keys of the image saved with snapshot i to the Bloom
+   * filter, which then holds all the keys of the snapshot
+   * @return false if the image is lost (the keys must be added from the tree)
+   */
+  bool load_snap_bloom(size_t i) {
+    if (i >= snap_blooms.size()) // taken without a filter
+      return false;
+    string img(bloom->image_size(), '\0');
+    snap_bloom_io(false, img.data(), img.size(),
+                  snap_blooms[i].first * img.size());
+    return WAL::checksum(img.data(), img.size()) == snap_blooms[i].second &&
+           bloom->merge(img);
+  }
+  /**
+   * @brief calls f(x) for each leaf x under the node at pos (or each bucket
+   * of the directory with root at pos if hashed), in order
+   * @param from_files = true: nodes are read from the files, bypassing any
+   * cache
+   */
+  template <class Func> void for_leaves(int pos, bool from_files, Func f) {
+    Node x;
+    if (hashed)
+      return for_buckets(pos, [&](int b) {
+        from_files ? BPT::read(x, b) : read(x, b);
+        f(x);
+      }, from_files);
+    from_files ? BPT::read(x, pos) : read(x, pos);
+    if (x.leaf)
+      return f(x);
+    for (size_t i = 0; i < x.size; i++)
+      for_leaves(x.kids()[i], from_files, f);
+  }
+  /**
+   * @brief adds the keys of the live tree to the Bloom filter
+   * @param from_files = true: the filter is emptied first, and the leaves are
+   * read from the files, bypassing any cache (which may hold nodes of the old
+   * files after vacuum)
+   */
+  void rebuild_bloom(bool from_files) {
+    if (from_files)
+      bloom->clear();
+    for_leaves(root, from_files, [&](const Node &x) {
+      for (size_t i = 0; i < x.size; i++)
+        bloom->add(x.keys()[i]);
+    });
+  }
+  void write_header() {
+    string h = header();
+    if (memory)
+      return tree_image.swap(h);
+    if (db)
+      return db->write(tree_seg, h.data(), h.size(), 0);
+    tree_file.seekp(0);
+    tree_file.write(h.data(), h.size());
+  }
+  /**
+   * @brief writes the header and closes the files
+   */
+  void close() {
+    save_bloom();
+    write_header();
+    tree_file.close();
+    close_files();
+  }
+
+  /**
+   * @return whether child i of internal node u is a reference of its own: a
+   * page of a hash directory lists a bucket in each of its slots, and an
+   * empty slot as -1 (see dir_at())
+   */
+  static bool own_child(const Node &u, size_t i) {
+    int pos = u.kids()[i];
+    return pos != -1 && (!i || pos != u.kids()[i - 1]);
+  }
+  /**
+   * @brief adds a reference to each child (or value) of u, which is copied
+   */
+  void share_children(const Node &u) {
+    if (u.leaf && INLINE)
+      return;
+    for (size_t i = 0; i < u.size; i++) {
+      if (!u.leaf && !own_child(u, i))
+        continue;
+      int off = u.leaf ? value_rc(u.vals()[i]) : node_rc(u.kids()[i]);
+      write_rc(off, read_rc(off) + 1);
+    }
+  }
+  /**
+   * @brief drops a reference to the node at pos; the last one deletes it and
+   * drops its references to its children (or values)
+   */
+  void release_node(int pos) {
+    int off = node_rc(pos), cnt = snaps.empty() ? 0 : read_rc(off);
+    if (cnt)
+      return write_rc(off, cnt - 1);
+    Node u;
+    read(u, pos);
+    for (size_t i = 0; i < u.size; i++) {
+      if (!u.leaf) {
+        if (own_child(u, i))
+          release_node(u.kids()[i]);
+      } else if constexpr (!INLINE) {
+        release_value(u.vals()[i]);
+      }
+    }
+    delete_node(pos);
+  }
+  void release_value(int pos) {
+    int off = value_rc(pos), cnt = snaps.empty() ? 0 : read_rc(off);
+    cnt ? write_rc(off, cnt - 1) : delete_value(pos);
+  }
+  /**
+   * @brief makes the node at pos private to the live tree: a node shared with
+   * snapshots is copied (nodes hold no sibling links, so nothing else refers
+   * to it but its parent, which the caller updates)
+   * @return position of the private node
+   */
+  int unshare(int pos) {
+    int off = node_rc(pos), cnt = read_rc(off);
+    if (!cnt)
+      return pos;
+    write_rc(off, cnt - 1);
+    Node u;
+    read(u, pos);
+    share_children(u);
+    u.pos = new_node();
+    write(u);
+    return u;
+  }
+  /**
+   * @brief unshares the nodes on the path from root to the leaf of key, and
+   * their siblings on both sides if merge() may modify them (siblings = true)
+   * called before a modification while snapshots exist (copy-on-write)
+   */
+  void unshare_path(const Key &key, bool siblings) {
+    if (snaps.empty())
+      return;
+    root.pos = unshare(root);
+    Node u = root;
+    while (!u.leaf) {
+      size_t idx = u.lower_bound(key);
+      if (idx == u.size)
+        --idx;
+      size_t l = siblings && idx ? idx - 1 : idx,
+             r = siblings && idx + 1 < u.size ? idx + 1 : idx;
+      bool copied = false;
+      for (size_t i = l; i <= r; i++) {
+        int pos = unshare(u.kids()[i]);
+        if (pos != u.kids()[i])
+          u.kids()[i] = pos, copied = true;
+      }
+      if (copied) {
+        write(u);
+        if (u == root)
+          root = u;
+      }
+      read(u, u.kids()[idx]);
+    }
+  }
+  size_t find_snapshot(int id) const {
+    for (size_t i = 0; i < snaps.size(); i++)
+      if (snaps[i].first == id)
+        return i;
+    return snaps.size();
+  }
 
   /**
    * @brief splits an oversized node
@@ -183,12 +964,9 @@ private:
   void split(Node &u, Node &p, size_t idx_u) {
     Node v(new_node(), u.leaf);
     v.size = u.size >> 1, u.size -= v.size;
-    v.next = u.next, v.prev = u, u.next = v;
-    if (u == end_pos)
-      end_pos = v; // update end_pos
     // copy half of u to v
     for (size_t i = 0; i < v.size; i++) {
-      v[i] = u[i + u.size];
+      v.assign(i, u.entry(i + u.size));
     }
     write(u), write(v); // allocate space for v
     if (u == root) {
@@ -196,19 +974,12 @@ private:
           Node(new_node(),
                false); // must not modify root here, because u refers to root
       temp.size = 2;
-      temp[0] = Data(u.max_key(), u);
-      temp[1] = Data(v.max_key(), v);
+      temp.assign(0, Data(u.max_key(), u));
+      temp.assign(1, Data(v.max_key(), v));
       root = temp;
       write(root);
     } else {
-      if (v.next != -1) {
-        Node nxt;
-        read(nxt, v.next);
-        nxt.prev = v;
-        write(nxt);
-        // write v.next.prev=v
-      }
-      p[idx_u].first = u.max_key(); // update the indexing key for u
+      p.keys()[idx_u] = u.max_key(); // update the indexing key for u
       p.insert(Data(v.max_key(), v), idx_u + 1);
     }
   }
@@ -218,15 +989,16 @@ private:
    * @param key,val to be inserted
    * @param u current node
    * @param p parent node of u
-   * @param idx_u index of u in p.data[]
+   * @param idx_u index of u in p
    */
-  void BP_insert(const Key &key, int val, Node &u, Node &p, size_t idx_u = 0) {
+  void BP_insert(const Key &key, const Ref &val, Node &u, Node &p,
+                 size_t idx_u = 0) {
     size_t idx_s = u.lower_bound(key); // index of s (son of u)
-    if (idx_s < u.size && u[idx_s].first == key) {
+    if (idx_s < u.size && u.keys()[idx_s] == key) {
       throw "Error in insert(): element already exists";
     }
     if (idx_s == u.size && p != null) {
-      p[idx_u].first = key;
+      p.keys()[idx_u] = key;
     }
     if (u.leaf) {
       u.insert(Data(key, val), idx_s);
@@ -234,10 +1006,10 @@ private:
       if (idx_s == u.size)
         --idx_s;
       Node s;
-      read(s, u[idx_s].second);
+      read(s, u.kids()[idx_s]);
       BP_insert(key, val, s, u, idx_s);
     }
-    if (u.size > szmax) {
+    if (u.size > u.szmax()) {
       split(u, p, idx_u);
     } else {
       write(u);
@@ -250,37 +1022,27 @@ private:
    * descriptions of other parameters: see BP_erase()
    */
   void merge(Node &u, Node &v, Node &p, size_t idx_u) {
-    if (u.size <= szmin && v.size <= szmin) { // merge u and v
-      if (v == end_pos)
-        end_pos = u; // update end_pos
+    if (u.size <= u.szmin() && v.size <= v.szmin()) { // merge u and v
       // copy v to u
       for (size_t i = 0; i < v.size; i++) {
-        u[u.size + i] = v[i];
+        u.assign(u.size + i, v.entry(i));
       }
       u.size += v.size;
-      u.next = v.next;
-      if (u.next != -1) {
-        Node nxt;
-        read(nxt, u.next);
-        nxt.prev = u;
-        write(nxt);
-        // write u.next.prev=u
-      }
       write(u), delete_node(v);
       if (p == root && p.size == 2) { // delete root
         delete_node(root);
         root = u;
       } else {
-        p[idx_u].first = u.max_key(); // update the indexing key for u
+        p.keys()[idx_u] = u.max_key(); // update the indexing key for u
         p.erase(idx_u + 1);
       }
-    } else { // lend a child if either u or v has size > szmin
-      if (u.size > szmin) {
-        v.insert(u[u.size - 1], 0), u.erase(u.size - 1);
-      } else /*if (v.size > szmin)*/ {
-        u.insert(v[0], u.size), v.erase(0);
+    } else { // lend a child if either u or v has size > szmin()
+      if (u.size > u.szmin()) {
+        v.insert(u.entry(u.size - 1), 0), u.erase(u.size - 1);
+      } else /*if (v.size > v.szmin())*/ {
+        u.insert(v.entry(0), u.size), v.erase(0);
       }
-      p[idx_u].first = u.max_key();
+      p.keys()[idx_u] = u.max_key();
       // update the indexing key for u (v is not affected)
       write(u), write(v);
     }
@@ -291,28 +1053,30 @@ private:
    * @param key to be erased
    * @param u current node
    * @param p parent node of u
-   * @param idx_u index of u in p.data[]
+   * @param idx_u index of u in p
    */
   void BP_erase(const Key &key, Node &u, Node &p, size_t idx_u = 0) {
     size_t idx_s = u.lower_bound(key); // index of s (son of u)
-    if (idx_s == u.size || (u.leaf && u[idx_s].first != key)) {
+    if (idx_s == u.size || (u.leaf && u.keys()[idx_s] != key)) {
       throw "Error in erase(): element does not exist";
     }
     if (u.leaf) {
+      if constexpr (!INLINE)
+        release_value(u.vals()[idx_s]);
       u.erase(idx_s);
     } else {
       Node s;
-      read(s, u[idx_s].second);
+      read(s, u.kids()[idx_s]);
       BP_erase(key, s, u, idx_s);
     }
-    p[idx_u].first = u.max_key();
-    if (u != root && u.size < szmin) {
-      Node v;
-      if (idx_u > 0) { // v must be a brother of u
-        read(v, u.prev);
+    p.keys()[idx_u] = u.max_key();
+    if (u != root && u.size < u.szmin()) {
+      Node v; // a brother of u
+      if (idx_u > 0) {
+        read(v, p.kids()[idx_u - 1]);
         merge(v, u, p, idx_u - 1);
       } else {
-        read(v, u.next);
+        read(v, p.kids()[idx_u + 1]);
         merge(u, v, p, idx_u);
       }
     } else {
@@ -320,53 +1084,673 @@ private:
     }
   }
 
+  /**
+   * @brief stores a value for a new entry
+   * @return the second half of the entry (value itself or its position)
+   */
+  Ref new_ref(const T &value) {
+    if constexpr (INLINE) {
+      return InlineRef::of(value);
+    } else {
+      int pos = new_value();
+      write_value(value, pos);
+      return pos;
+    }
+  }
+  /**
+   * @brief spreads ents evenly over u and as few new nodes as possible, which
+   * follow u in order
+   * @param out receives (max key, pos) of u and the new nodes
+   */
+  void spread(Node &u, const vector<Data> &ents, vector<Data> &out) {
+    size_t n = ents.size(), m = (n + u.szmax() - 1) / u.szmax(), k = 0;
+    for (size_t i = 0; i < m; i++) {
+      Node v(i ? new_node() : -1, u.leaf);
+      Node &x = i ? v : u;
+      x.size = n / m + (i < n % m);
+      for (size_t j = 0; j < x.size; j++)
+        x.assign(j, ents[k++]);
+      write(x);
+      out.push_back(Data(x.max_key(), x));
+    }
+  }
+  /**
+   * @brief inserts ents[l, r) (in ascending order of keys) into the subtree
+   * of u, with only one descent into each affected child
+   * @param out receives (max key, pos) of the nodes u turns into
+   */
+  void BP_insert_sorted(const vector<Data> &ents, size_t l, size_t r, Node &u,
+                        vector<Data> &out) {
+    vector<Data> merged;
+    size_t i = 0;
+    if (u.leaf) {
+      for (size_t j = l; j < r; j++) {
+        while (i < u.size && u.keys()[i] < ents[j].first)
+          merged.push_back(u.entry(i++));
+        if (i < u.size && u.keys()[i] == ents[j].first)
+          throw "Error in insert_sorted(): element already exists";
+        merged.push_back(ents[j]);
+      }
+    } else {
+      for (size_t j = l; i < u.size; i++) {
+        // keys beyond the max of u go to the last child
+        size_t k = j;
+        while (k < r && (i + 1 == u.size || !(u.keys()[i] < ents[k].first)))
+          k++;
+        if (k == j) {
+          merged.push_back(u.entry(i));
+          continue;
+        }
+        Node s;
+        read(s, u.kids()[i]);
+        BP_insert_sorted(ents, j, k, s, merged);
+        j = k;
+      }
+    }
+    while (i < u.size)
+      merged.push_back(u.entry(i++));
+    spread(u, merged, out);
+  }
+  /**
+   * @brief builds new levels above the nodes in out until there is one root
+   */
+  void grow(vector<Data> &out) {
+    while (out.size() > 1) {
+      root = Node(new_node(), false);
+      vector<Data> up;
+      spread(root, out, up);
+      out = up;
+    }
+  }
+
+  /**
+   * @brief builds an empty tree bottom-up from entries pushed in ascending
+   * order of keys: leaves are filled left to right and written as soon as
+   * they are complete, so only one entry per leaf is kept in memory
+   */
+  class Loader {
+    BPT *tr;
+    Node prev, cur;  // the last two leaves, prev is held back for rebalancing
+    vector<Data> up; // (max key, pos) of the leaves before cur
+
+  public:
+    explicit Loader(BPT *tr_) : tr(tr_) {
+      tr->release_node(tr->root); // the empty root leaf
+      cur.pos = tr->new_node();
+    }
+    void push(const Data &x) {
+      if (cur.size == cur.szmax()) {
+        Node nxt(tr->new_node());
+        if (prev != tr->null)
+          tr->write(prev);
+        up.push_back(Data(cur.max_key(), cur));
+        prev = cur, cur = nxt;
+      }
+      cur.assign(cur.size++, x);
+    }
+    void finish() {
+      if (prev != tr->null && cur.size < cur.szmin()) { // lend entries to cur
+        size_t k = (prev.size + cur.size) / 2 - cur.size;
+        for (size_t i = cur.size; i-- > 0;)
+          cur.assign(i + k, cur.entry(i));
+        for (size_t i = 0; i < k; i++)
+          cur.assign(i, prev.entry(prev.size - k + i));
+        cur.size += k, prev.size -= k;
+        up[up.size() - 1].first = prev.max_key();
+      }
+      if (prev != tr->null)
+        tr->write(prev);
+      tr->write(cur);
+      if (up.empty()) {
+        tr->root = cur;
+      } else {
+        up.push_back(Data(cur.max_key(), cur));
+        tr->grow(up);
+      }
+    }
+  };
+
+  /**
+   * @brief hash index (see Index): the keys are split among buckets (leaves)
+   * by their hashes, through a directory of 2^d slots (extendible hashing).
+   * slot g refers to the bucket of the keys whose hashes start with the d
+   * bits of g, or is -1 if there is none; a bucket covers an aligned block of
+   * slots, and holds its keys in order. the directory is split into pages of
+   * the same number of slots (internal nodes), which root lists
+   * buckets are never empty, and are scanned in the order of the directory
+   * (see next_buckets()). a bucket never spans two pages, so that the pages
+   * can be shared with snapshots like the nodes of a tree: a page holds one
+   * reference to each bucket in it (see own_child()), and a snapshot only
+   * adds a reference to the root
+   */
+  static constexpr size_t floor2(size_t n) {
+    return n & (n - 1) ? floor2(n & (n - 1)) : n;
+  }
+  static constexpr size_t DIR_SLOTS = floor2(szinner); // per page at most
+  static size_t hash(const Key &key) { return BloomHash<Key>::of(key); }
+  /**
+   * @return the slot of hash h in a directory of n slots
+   */
+  static size_t slot_of(size_t h, size_t n) {
+    return n == 1 ? 0 : h >> (sizeof(size_t) * 8 - __builtin_ctzll(n));
+  }
+  size_t page_size() { return peek(root.kids()[0], peek_buf)->size; }
+  size_t dir_size() { return root.size * page_size(); }
+  /**
+   * @return position of the bucket at slot g, -1 if there is none
+   */
+  int dir_at(size_t g) {
+    size_t s = page_size();
+    return peek(root.kids()[g / s], peek_buf)->kids()[g % s];
+  }
+  /**
+   * @brief points slots [g, g + n) to the bucket at pos (-1: none)
+   */
+  void dir_fill(size_t g, size_t n, int pos) {
+    size_t s = page_size();
+    Node x;
+    for (size_t i = g; i < g + n; write(x)) {
+      read(x, own_page(i / s));
+      for (size_t end = std::min(g + n, (i / s + 1) * s); i < end; i++)
+        x.kids()[i % s] = pos;
+    }
+  }
+  /**
+   * @brief finds the block [g, g + n) of slots of the bucket at pos (or of
+   * no bucket if pos = -1) that holds slot g: the largest aligned one
+   * holding nothing else, within one page
+   */
+  void dir_block(size_t &g, size_t &n, int pos) {
+    size_t s = page_size();
+    for (n = 1; n < s; n <<= 1) {
+      size_t a = g & ~(2 * n - 1);
+      bool same = true;
+      for (size_t i = a; i < a + 2 * n && same; i++)
+        same = (i >= g && i < g + n) || dir_at(i) == pos;
+      if (!same)
+        break;
+      g = a;
+    }
+  }
+  /**
+   * @brief makes page j of the directory, and the root, private to the live
+   * table (see unshare())
+   * @return position of the page
+   */
+  int own_page(size_t j) {
+    if (snaps.empty())
+      return root.kids()[j];
+    root.pos = unshare(root);
+    int pos = unshare(root.kids()[j]);
+    if (pos != root.kids()[j]) {
+      root.kids()[j] = pos;
+      write(root);
+    }
+    return pos;
+  }
+  /**
+   * @brief doubles the directory: slot g becomes slots 2g and 2g + 1
+   */
+  void grow_dir() {
+    Node x;
+    read(x, own_page(0));
+    if (x.size < DIR_SLOTS) { // a single page
+      for (size_t i = x.size; i--;)
+        x.kids()[2 * i] = x.kids()[2 * i + 1] = x.kids()[i];
+      x.size *= 2;
+      return write(x);
+    }
+    if (root.size * 2 > DIR_SLOTS)
+      throw "Error in insert(): hash directory is full";
+    // every page is rewritten, and a bucket filling one would span two
+    // afterwards: it is halved first
+    for (size_t j = 0; j < root.size; j++) {
+      own_page(j);
+      size_t g = j * DIR_SLOTS, n;
+      int pos = dir_at(g);
+      if (pos == -1)
+        continue;
+      dir_block(g, n, pos);
+      if (n < DIR_SLOTS)
+        continue;
+      Node u;
+      read(u, pos);
+      own_bucket(u, g);
+      halve_bucket(u, g, n);
+      write(u);
+    }
+    size_t half = DIR_SLOTS / 2;
+    for (size_t j = root.size; j--;) { // page j becomes pages 2j and 2j + 1
+      read(x, root.kids()[j]);
+      Node lo(x.pos, false), hi(new_node(), false);
+      lo.size = hi.size = DIR_SLOTS;
+      for (size_t i = 0; i < DIR_SLOTS; i++) {
+        Node &y = i < half ? lo : hi;
+        y.kids()[2 * (i % half)] = y.kids()[2 * (i % half) + 1] = x.kids()[i];
+      }
+      write(lo), write(hi);
+      root.kids()[2 * j] = lo.pos, root.kids()[2 * j + 1] = hi.pos;
+    }
+    root.size *= 2;
+    write(root);
+  }
+  /**
+   * @brief calls f(pos) for each bucket of the directory with root at pos,
+   * in order (see for_leaves() for from_files)
+   */
+  template <class Func>
+  void for_buckets(int pos, Func f, bool from_files = false) {
+    Node r, x;
+    from_files ? BPT::read(r, pos) : read(r, pos);
+    int last = -1;
+    for (size_t j = 0; j < r.size; j++) {
+      from_files ? BPT::read(x, r.kids()[j]) : read(x, r.kids()[j]);
+      for (size_t i = 0; i < x.size; i++) {
+        int b = x.kids()[i];
+        if (b != -1 && b != last)
+          f(last = b);
+      }
+    }
+  }
+  /**
+   * @brief the slot of key, and the position of its bucket (-1 if none)
+   */
+  size_t hash_slot(const Key &key, int &pos) {
+    size_t s = page_size(), g = slot_of(hash(key), root.size * s);
+    pos = peek(root.kids()[g / s], peek_buf)->kids()[g % s];
+    return g;
+  }
+  /**
+   * @brief reads the bucket of key into u
+   * @return index of key in u, u.size if it is not there (u.pos = -1 if
+   * there is no bucket)
+   */
+  size_t hash_locate(const Key &key, size_t &g, Node &u) {
+    int pos;
+    g = hash_slot(key, pos);
+    if (pos == -1) {
+      u.pos = -1, u.size = 0;
+      return 0;
+    }
+    read(u, pos);
+    size_t idx = u.lower_bound(key);
+    return idx < u.size && u.keys()[idx] == key ? idx : u.size;
+  }
+  /**
+   * @brief makes bucket u at slot g private to the live table (see unshare())
+   */
+  void own_bucket(Node &u, size_t g) {
+    if (snaps.empty())
+      return;
+    own_page(g / page_size()); // else u may be shared through its page
+    int pos = unshare(u);
+    if (pos == u.pos)
+      return;
+    size_t n;
+    dir_block(g, n, u.pos);
+    dir_fill(g, n, pos);
+    read(u, pos);
+  }
+  /**
+   * @brief finds the buckets after (or before, if !forward) bucket x in the
+   * order of the directory, or from the first (or last) one if x = nullptr
+   * @return how many were put into out, n at most
+   */
+  size_t next_buckets(const Node *x, bool forward, int *out, size_t n) {
+    size_t total = dir_size(), m = 0, i = forward ? 0 : total - 1;
+    int last = -1;
+    if (x) {
+      i = slot_of(hash(x->keys()[0]), total), last = x->pos;
+      forward ? i++ : i--;
+    }
+    for (; m < n && i < total; forward ? i++ : i--) { // i-- wraps past 0
+      int pos = dir_at(i);
+      if (pos != -1 && pos != last)
+        out[m++] = last = pos; // the slots of a bucket are adjacent
+    }
+    return m;
+  }
+  /**
+   * @brief splits bucket u with the block [g, g + n) of slots into its two
+   * halves by the next bit of the hashes of its keys; a half without keys
+   * gets no bucket, and g becomes the block of u (which is not written)
+   */
+  void halve_bucket(Node &u, size_t &g, size_t n) {
+    size_t half = n >> 1, total = dir_size(), k = 0;
+    Node v(-1, true);
+    for (size_t i = 0; i < u.size; i++) {
+      if (slot_of(hash(u.keys()[i]), total) < g + half)
+        u.assign(k++, u.entry(i));
+      else
+        v.assign(v.size++, u.entry(i));
+    }
+    u.size = k;
+    if (!v.size) {
+      dir_fill(g + half, half, -1);
+    } else if (!u.size) { // u takes the upper half
+      for (size_t i = 0; i < v.size; i++)
+        u.assign(i, v.entry(i));
+      u.size = v.size;
+      dir_fill(g, half, -1);
+      g += half;
+    } else {
+      v.pos = new_node();
+      dir_fill(g + half, half, v);
+      write(v);
+    }
+  }
+  /**
+   * @brief splits the overfull bucket u at slot g until no part is overfull
+   * (see halve_bucket()); the directory is doubled when u covers one slot
+   */
+  void split_bucket(Node &u, size_t g) {
+    while (u.size > u.szmax()) {
+      size_t n;
+      dir_block(g, n, u.pos);
+      if (n == 1) {
+        grow_dir();
+        g *= 2;
+        continue;
+      }
+      halve_bucket(u, g, n);
+    }
+    write(u);
+  }
+  /**
+   * @brief merges bucket u at slot g with its buddy (the other half of the
+   * aligned block twice as large, within the page) if that is a bucket of
+   * the same size with few keys, or extends u over it if there is none
+   */
+  void merge_bucket(Node &u, size_t g) {
+    size_t n;
+    dir_block(g, n, u.pos);
+    if (n == page_size() || u.size > u.szmin())
+      return write(u);
+    size_t b = g ^ n, c = b, m;
+    int pos = dir_at(b);
+    dir_block(c, m, pos);
+    if (pos == -1 ? m < n : m != n)
+      return write(u);
+    if (pos != -1) {
+      Node v;
+      read(v, pos);
+      if (u.size + v.size > u.szmin())
+        return write(u);
+      own_bucket(v, b);
+      size_t i = u.size, j = v.size;
+      for (size_t k = i + j; k--;) { // merges the two sorted halves
+        if (j && (!i || u.keys()[i - 1] < v.keys()[j - 1]))
+          u.assign(k, v.entry(--j));
+        else
+          u.assign(k, u.entry(--i));
+      }
+      u.size += v.size;
+      delete_node(v);
+    }
+    dir_fill(b, n, u);
+    write(u);
+  }
+
+  int hash_insert(const Key &key, const T &value) {
+    size_t g;
+    Node u;
+    if (hash_locate(key, g, u) < u.size)
+      throw "Error in insert(): element already exists";
+    if (u.pos == -1) { // a new bucket for the block of empty slots
+      u.pos = new_node(), u.leaf = true;
+      size_t n;
+      dir_block(g, n, -1);
+      dir_fill(g, n, u);
+    } else {
+      own_bucket(u, g);
+    }
+    Ref ref = new_ref(value);
+    u.insert(Data(key, ref), u.lower_bound(key));
+    split_bucket(u, g);
+    if constexpr (INLINE)
+      return -1;
+    else
+      return ref;
+  }
+  void hash_erase(const Key &key) {
+    size_t g;
+    Node u;
+    size_t idx = hash_locate(key, g, u);
+    if (idx == u.size)
+      throw "Error in erase(): element does not exist";
+    own_bucket(u, g);
+    if constexpr (!INLINE)
+      release_value(u.vals()[idx]);
+    u.erase(idx);
+    if (u.size)
+      return merge_bucket(u, g);
+    size_t n;
+    dir_block(g, n, u);
+    dir_fill(g, n, -1);
+    delete_node(u);
+  }
+  void hash_set(const Key &key, const T &value) {
+    size_t g;
+    Node u;
+    size_t idx = hash_locate(key, g, u);
+    if (idx == u.size)
+      throw "Error in set(): element does not exist";
+    own_bucket(u, g);
+    if constexpr (INLINE) {
+      write_inline(u, idx, value);
+    } else if (!snaps.empty() && read_rc(value_rc(u.vals()[idx]))) {
+      release_value(u.vals()[idx]); // the value is shared: copy-on-write
+      u.vals()[idx] = new_ref(value);
+      write(u);
+    } else {
+      write_value(value, u.vals()[idx]);
+    }
+  }
+  /**
+   * @brief finds the leaves after leaf x, or from the first one if x =
+   * nullptr: leaves are not linked (a leaf may be shared with snapshots), so
+   * the path to the next one is found again from the root, and the ones
+   * after it are its siblings in the same parent
+   * @return how many were put into out, n at most
+   */
+  size_t next_leaves(const Node *x, int *out, size_t n) {
+    if (hashed)
+      return next_buckets(x, true, out, n);
+    if (root.leaf) {
+      out[0] = root.pos;
+      return !x;
+    }
+    size_t m = 0;
+    for (const Node *u = &root; !u->leaf;) {
+      size_t idx = x ? u->upper_bound(x->max_key()) : 0;
+      if (idx == u->size)
+        return 0; // x is the last leaf (u is the root)
+      for (m = 0; m < n && idx + m < u->size; m++)
+        out[m] = u->kids()[idx + m];
+      u = peek(out[0], peek_buf);
+    }
+    return m;
+  }
+  /**
+   * @return position of the leaf before leaf x, or of the last one if x =
+   * nullptr (-1 if there is none): the rightmost leaf of the subtree left of
+   * the path to x
+   */
+  int prev_leaf(const Node *x) {
+    int pos;
+    if (hashed)
+      return next_buckets(x, false, &pos, 1) ? pos : -1;
+    pos = x ? -1 : root.pos;
+    for (const Node *u = &root; x && !u->leaf;) {
+      size_t idx = std::min(u->lower_bound(x->keys()[0]), u->size - 1);
+      if (idx)
+        pos = u->kids()[idx - 1];
+      if (u->kids()[idx] == x->pos)
+        break;
+      u = peek(u->kids()[idx], peek_buf);
+    }
+    if (pos == -1)
+      return -1;
+    const Node *u = pos == root.pos ? &root : peek(pos, peek_buf);
+    while (!u->leaf)
+      u = peek(u->kids()[u->size - 1], peek_buf);
+    return u->pos;
+  }
+
 public:
   class iterator {
     friend class BPT;
     BPT *tr = nullptr;
-    Node node;
+    const Node *node = nullptr; // pinned (see pin()), nullptr for end()
     size_t idx = 0;
-    iterator(BPT *tr_, Node node_, size_t idx_)
-        : tr(tr_), node(node_), idx(idx_) {
-      if (idx == node.size)
-        node = tr->null, idx = 0; // this = end()
+    size_t ver = 0;  // version of node when it was copied (concurrent mode)
+    size_t hops = 0; // leaves entered by move_next(): a sequential scan
+    /**
+     * @param node_ pinned for the iterator, which unpins it
+     */
+    iterator(BPT *tr_, const Node *node_, size_t idx_, size_t ver_ = 0)
+        : tr(tr_), node(node_), idx(idx_), ver(ver_) {
+      if (node && idx == node->size)
+        reset(nullptr, 0); // this = end()
+    }
+    /**
+     * @brief moves to the pinned node x, unpinning the current one
+     */
+    void reset(const Node *x, size_t idx_) {
+      if (node)
+        tr->unpin(node);
+      node = x, idx = idx_;
     }
+    int pos() const { return node ? node->pos : -1; }
 
+    /**
+     * @brief in concurrent mode, the next (or previous) leaf is found by key
+     * with a descent from the root (see seek())
+     */
+    void olc_move_prev() {
+      if (!node)
+        *this = tr->seek(Key(), LAST);
+      else if (idx)
+        --idx;
+      else
+        *this = tr->seek(Key(node->keys()[0]), BEFORE);
+    }
+    void olc_move_next() {
+      if (++idx < node->size)
+        return;
+      *this = tr->seek(Key(node->keys()[idx - 1]), UPPER);
+    }
     void move_prev() {
-      if (node == tr->null) { // this == end()
-        tr->read(node, tr->end_pos);
-        idx = node.size - 1;
-      } else if (idx-- == 0) {
-        tr->read(node, node.prev);
-        idx = 0;
+      if (tr->latches)
+        return olc_move_prev();
+      if (node && idx) {
+        --idx;
+        return;
       }
+      int pos = tr->prev_leaf(node); // the last leaf if this == end()
+      const Node *x = pos != -1 ? tr->pin(pos) : nullptr;
+      reset(x, x ? x->size - 1 : 0);
     }
     void move_next() {
-      if (++idx == node.size) {
-        if (node.next != -1)
-          tr->read(node, node.next);
-        else
-          node = tr->null; // this = end()
-        idx = 0;
-      }
+      if (tr->latches)
+        return olc_move_next();
+      if (++idx < node->size)
+        return;
+      int next[READ_AHEAD + 1]; // the leaves after node
+      size_t want = hops++ % READ_AHEAD ? 1 : READ_AHEAD + 1,
+             n = tr->next_leaves(node, next, want);
+      reset(n ? tr->pin(next[0]) : nullptr, 0);
+      if (node)
+        tr->read_ahead(*node, next + 1, n - 1);
     }
 
   public:
     iterator() {}
+    iterator(const iterator &rhs)
+        : tr(rhs.tr), node(rhs.node ? rhs.tr->repin(rhs.node) : nullptr),
+          idx(rhs.idx), ver(rhs.ver), hops(rhs.hops) {}
+    iterator(iterator &&rhs) noexcept
+        : tr(rhs.tr), node(rhs.node), idx(rhs.idx), ver(rhs.ver),
+          hops(rhs.hops) {
+      rhs.node = nullptr;
+    }
+    iterator &operator=(iterator rhs) {
+      std::swap(tr, rhs.tr), std::swap(node, rhs.node);
+      std::swap(idx, rhs.idx), std::swap(ver, rhs.ver);
+      std::swap(hops, rhs.hops);
+      return *this;
+    }
+    ~iterator() { reset(nullptr, 0); }
+
+    /**
+     * @brief in concurrent mode, the value is read only while node is
+     * unchanged (retrying the read alone while a writer rewrites the value),
+     * otherwise the key is found again
+     * @return false if a writer erased the element since node was copied
+     * (concurrent mode only), and val is then unspecified
+     */
+    bool try_value(T &val) const {
+      if constexpr (INLINE) {
+        val = node->vals()[idx].value();
+        return true;
+      }
+      if (!tr->latches) {
+        tr->read_value(val, node->vals()[idx]);
+        return true;
+      }
+      for (iterator it = *this; it; it = tr->find(Key(it.key()))) {
+        int pos = it.node->vals()[it.idx];
+        for (;;) {
+          size_t v = tr->latches->read_lock(value_latch(pos));
+          if (!tr->latches->check(node_latch(*it.node), it.ver))
+            break; // pos may be stale
+          tr->read_value_shared(val, pos);
+          if (tr->latches->check(value_latch(pos), v))
+            return true;
+        }
+      }
+      return false;
+    }
+    /**
+     * @warning in concurrent mode, throws if a writer erased the element
+     * since node was copied: use try_value() there
+     */
     T value() const {
       T val;
-      tr->read_value(val, node[idx].second);
+      if (!try_value(val))
+        throw "Error in value(): element does not exist";
       return val;
     }
     /**
      * @brief set the value
      */
-    void set(const T &val) const { tr->write_value(val, node[idx].second); }
+    void set(const T &val) {
+      // copy-on-write may move the leaf or the value, and a concurrent writer
+      // may have changed the leaf since it was copied
+      if (tr->latches || !tr->snaps.empty()) {
+        Key k = key();
+        tr->set(k, val);
+        *this = tr->find(k);
+        return;
+      }
+      if constexpr (INLINE) {
+        Node x = *node;
+        tr->write_inline(x, idx, val);
+        reset(tr->pin(x.pos), idx); // a copy of node is stale
+      } else {
+        tr->write_value(val, node->vals()[idx]);
+      }
+    }
     /**
      * @brief returns a handle for quick access through set/get_by_handle
+     * (-1 for inlined values, which have no handle)
      */
-    int handle() const { return node[idx].second; }
-    const Key &key() const { return node[idx].first; }
+    int handle() const {
+      if constexpr (INLINE)
+        return -1;
+      return node->vals()[idx];
+    }
+    const Key &key() const { return node->keys()[idx]; }
     value_type operator*() const { return {key(), value()}; }
     /**
      * @brief ++iter
@@ -399,72 +1783,221 @@ public:
       return ret;
     }
     bool operator==(const iterator &rhs) const {
-      return tr == rhs.tr && node == rhs.node && idx == rhs.idx;
+      return tr == rhs.tr && pos() == rhs.pos() && idx == rhs.idx;
     }
     bool operator!=(const iterator &rhs) const { return !(*this == rhs); }
     //! differs from STL
-    operator bool() const { return node.pos != -1; }
+    operator bool() const { return node; }
   }; // class iterator
 
+private:
+  // BEFORE: the last key < key
+  enum Seek { FIND, LOWER, UPPER, BEFORE, FIRST, LAST };
+  /**
+   * @brief copies the node at pos for a concurrent reader
+   * @return false if a writer got in the way
+   */
+  bool load(Node &x, int pos, size_t &ver) {
+    ver = latches->read_lock(node_latch(pos));
+    read_shared(x, pos);
+    return latches->check(node_latch(pos), ver);
+  }
+  /**
+   * @brief descent of a concurrent reader (optimistic lock coupling): each
+   * node is copied and validated, and its parent is validated again after
+   * that, so the copies along the path are consistent; restarts from the
+   * root when a writer got in the way
+   * BEFORE: if the leaf of key holds no smaller key, the last key of the
+   * subtree left of the path (the key in the parent of that subtree) is
+   * found with a second descent
+   */
+  iterator seek(const Key &key, Seek mode) {
+    Node buf[2];
+    while (1) {
+      Node *u = buf, *v = buf + 1;
+      size_t ver_u, ver_v, idx = 0;
+      Key bound;
+      bool bounded = false; // bound is set (BEFORE)
+      int pos = root_pos.load(std::memory_order_acquire);
+      bool valid = load(*u, pos, ver_u) &&
+                   root_pos.load(std::memory_order_acquire) == pos;
+      while (valid) {
+        if (mode == FIRST || mode == LAST)
+          idx = mode == LAST && u->size ? u->size - 1 : 0;
+        else
+          idx = mode == UPPER ? u->upper_bound(key) : u->lower_bound(key);
+        if (u->leaf)
+          break;
+        if (idx == u->size) // u is the root
+          return mode == BEFORE ? seek(Key(u->max_key()), LOWER) : end();
+        if (mode == BEFORE && idx)
+          bound = u->keys()[idx - 1], bounded = true;
+        valid = load(*v, u->kids()[idx], ver_v) &&
+                latches->check(node_latch(*u), ver_u);
+        std::swap(u, v), ver_u = ver_v;
+      }
+      if (!valid)
+        continue;
+      if (mode == FIND && (idx == u->size || u->keys()[idx] != key))
+        return end();
+      if (mode == BEFORE && !idx)
+        return bounded ? seek(bound, LOWER) : end();
+      return iterator(this, repin(u), mode == BEFORE ? idx - 1 : idx, ver_u);
+    }
+  }
+
+  /**
+   * @brief find() by the hash of key: usually the directory is cached, and
+   * only the bucket is read
+   */
+  iterator hash_find(const Key &key) {
+    int pos;
+    hash_slot(key, pos);
+    if (pos == -1)
+      return end();
+    const Node *u = peek(pos, peek_buf);
+    size_t idx = u->lower_bound(key);
+    if (idx == u->size || u->keys()[idx] != key)
+      return end();
+    return iterator(this, pin(pos), idx);
+  }
+
+public:
   iterator begin() {
-    Node p;
-    read(p, beg_pos);
-    return {this, p, 0};
+    if (latches)
+      return seek(Key(), FIRST);
+    int pos;
+    if (!next_leaves(nullptr, &pos, 1))
+      return end(); // an empty hashed tree has no bucket
+    return {this, pin(pos), 0};
   }
-  iterator end() { return {this, null, 0}; }
+  iterator end() { return {this, nullptr, 0}; }
   iterator cbegin() { return begin(); }
   iterator cend() { return end(); }
 
   /**
    * @brief Construct a new BPT object
    * @param retrieve = false: ignore old data (for debugging)
+   * @param storage_ how to access node/value files (see Storage), which are
+   * segments of the Database of the process if there is one
+   * @param concurrent = true: readers may run in parallel with a writer
+   * @param bloom_bits > 0: keep a Bloom filter of about that many bits, so
+   * that looking up a missing key usually reads no node
+   * @param index how keys are found (see Index); HASH is not concurrent
+   * @param packed_ = true: keep the pages of value_file compressed (see
+   * PackedFile), for values that are mostly padding; not concurrent, and a
+   * tree must always be opened the same way
    */
-  explicit BPT(string filename, bool retrieve = true) {
-    std::filesystem::create_directory("./bin");
+  explicit BPT(string filename, bool retrieve = true,
+               Storage storage_ = Storage::MAPPED, bool concurrent = false,
+               size_t bloom_bits = 0, Index index = Index::TREE,
+               bool packed_ = false)
+      : storage(storage_),
+        mapped(storage == Storage::MAPPED || storage == Storage::MEMORY),
+        direct(storage == Storage::DIRECT ||
+               (storage == Storage::FSTREAM && Database::get())),
+        memory(storage == Storage::MEMORY), hashed(index == Index::HASH),
+        packed(packed_), db(memory ? nullptr : Database::get()),
+        name(filename),
+        latches(concurrent ? new Latches : nullptr),
+        bloom(bloom_bits ? new BloomFilter<Key>(bloom_bits) : nullptr) {
+    if (packed)
+      value_pages = new PackedFile;
+    if (hashed && concurrent)
+      throw "Error in BPT: a hash index is not concurrent";
+    if (packed && concurrent)
+      throw "Error in BPT: packed values are not concurrent";
+    if (!memory)
+      std::filesystem::create_directory("./bin");
     filename = "./bin/BPT_" + filename; //!!
     tree_filename = filename + "_tree.bin",
     node_filename = filename + "_node.bin",
-    value_filename = filename + "_value.bin";
-    auto mode = ios::in | ios::out | ios::binary;
-    if (!retrieve)
-      mode |= ios::trunc;
-    tree_file.open(tree_filename, mode);
-    if (!tree_file) {
-      create_file(tree_file, tree_filename);
-      create_file(node_file, node_filename);
-      create_file(value_file, value_filename);
-      tree_file.open(tree_filename, mode);
-    } else if (retrieve) {
-      tree_file.seekg(0);
-      read_flow_(tree_file, root.pos, beg_pos, end_pos);
-    }
-    node_file.open(node_filename, mode);
-    value_file.open(value_filename, mode);
-    if (root.pos == -1) {
-      beg_pos = end_pos = root.pos = new_node();
-      write(root);
-    } else if (retrieve) {
-      read(root);
-    }
+    value_filename = filename + "_value.bin",
+    ref_filename = filename + "_ref.bin";
+    page_filename = filename + "_page.bin";
+    bloom_filename = filename + "_bloom.bin";
+    snap_bloom_filename = filename + "_snap_bloom.bin";
+    open(retrieve);
   }
 
   virtual ~BPT() {
-    tree_file.seekp(0);
-    write_flow_(tree_file, root.pos, beg_pos, end_pos);
-    tree_file.close();
-    node_file.close();
-    value_file.close();
+    close();
+    delete latches;
+    delete bloom;
+    delete value_pages;
   }
   virtual void clear() {
+    Writing w(this);
     auto mode = ios::in | ios::out | ios::binary | ios::trunc;
     tree_file.close();
-    node_file.close();
-    value_file.close();
-    tree_file.open(tree_filename, mode);
-    node_file.open(node_filename, mode);
-    value_file.open(value_filename, mode);
-    beg_pos = end_pos = root.pos = new_node();
-    write(root);
+    close_files();
+    if (db)
+      db->truncate(tree_seg);
+    else if (!memory)
+      tree_file.open(tree_filename, mode);
+    open_files(mode);
+    node_pool.clear(), value_pool.clear(), snaps.clear(), snap_blooms.clear();
+    new_root();
+    if (bloom)
+      bloom->clear(), bloom->seq++; // a filter saved before is stale
+  }
+  /**
+   * @brief rewrites the tree into compact files, with leaves and values in
+   * key order and no free space
+   * ! values are moved: handles obtained before are invalidated
+   * ! not supported while snapshots exist
+   */
+  virtual void vacuum() {
+    Writing w(this);
+    if (!snaps.empty())
+      throw "Error in vacuum(): snapshots exist";
+    string files[5];
+    {
+      BPT tmp(name + ".vacuum", false, storage, false, 0,
+              hashed ? Index::HASH : Index::TREE, packed);
+      if (hashed) { // values are appended in the order of the buckets
+        for (auto it = begin(); it; ++it)
+          tmp.hash_insert(it.key(), it.value());
+      } else {
+        Loader loader(&tmp);
+        for (auto it = begin(); it; ++it)
+          loader.push(Data(it.key(), tmp.new_ref(it.value())));
+        loader.finish();
+      }
+      files[0] = tmp.tree_filename, files[1] = tmp.node_filename,
+      files[2] = tmp.value_filename, files[3] = tmp.ref_filename;
+      files[4] = tmp.page_filename;
+      if (memory) { // nothing to rename: the files of tmp are taken over
+        tmp.write_header(), tree_image.swap(tmp.tree_image);
+        std::swap(node_file, tmp.node_file);
+        std::swap(value_file, tmp.value_file);
+        std::swap(ref_file, tmp.ref_file);
+        std::swap(value_pages, tmp.value_pages);
+        snap_bloom_image.clear();
+      }
+    } // tmp writes its header and closes its files
+    if (!memory)
+      close(); // a tree in memory holds the files of tmp already
+    if (db) {
+      db->replace(db->segment(files[0]), tree_seg);
+      db->replace(db->segment(files[1]), node_seg);
+      db->replace(db->segment(files[2]), value_seg);
+      db->replace(db->segment(files[3]), ref_seg);
+      if (packed)
+        db->replace(db->segment(files[4]), page_seg);
+      db->truncate(db->segment(bloom_filename));
+      db->truncate(db->segment(snap_bloom_filename));
+    } else if (!memory) {
+      std::filesystem::rename(files[0], tree_filename);
+      std::filesystem::rename(files[1], node_filename);
+      std::filesystem::rename(files[2], value_filename);
+      std::filesystem::rename(files[3], ref_filename);
+      if (packed)
+        std::filesystem::rename(files[4], page_filename);
+      std::filesystem::remove(bloom_filename); // rebuilt without erased keys
+      std::filesystem::remove(snap_bloom_filename);
+    }
+    open(true);
   }
 
   /**
@@ -472,15 +2005,21 @@ public:
    * @return iterator pointing to key, end() if not found
    */
   iterator find(const Key &key) {
-    Node u = root;
+    if (bloom && !bloom->contains(key))
+      return end();
+    if (hashed)
+      return hash_find(key);
+    if (latches)
+      return seek(key, FIND);
+    const Node *u = &root;
     while (1) {
-      size_t idx = u.lower_bound(key);
-      if (idx >= u.size || (u.leaf && u[idx].first != key))
+      size_t idx = u->lower_bound(key);
+      if (idx >= u->size || (u->leaf && u->keys()[idx] != key))
         return end();
-      else if (u.leaf) {
-        return iterator(this, u, idx);
+      else if (u->leaf) {
+        return iterator(this, pin(u->pos), idx);
       }
-      read(u, u[idx].second);
+      u = peek(u->kids()[idx], peek_buf);
     }
   }
   /**
@@ -506,32 +2045,48 @@ public:
    * @brief checks if element exists
    */
   bool count(const Key &key) { return find(key); }
+  /**
+   * @return false if no key k with k.first == first exists, without reading
+   * any node (the Bloom filter may answer true anyway, and always does if
+   * there is none)
+   */
+  template <class First> bool may_contain_prefix(const First &first) const {
+    return !bloom || bloom->contains_prefix(first);
+  }
   /**
    * @brief finds lower bound of key
    * @return iterator pointing to the lower bound of key, end() if not found
    */
   iterator lower_bound(const Key &key) {
-    Node u = root;
+    if (hashed)
+      throw "Error in lower_bound(): a hash index has no order";
+    if (latches)
+      return seek(key, LOWER);
+    const Node *u = &root;
     while (1) {
-      size_t idx = u.lower_bound(key);
-      if (u.leaf) {
-        return iterator(this, u, idx);
-      } else if (idx == u.size) {
+      size_t idx = u->lower_bound(key);
+      if (u->leaf) {
+        return iterator(this, pin(u->pos), idx);
+      } else if (idx == u->size) {
         return end(); // u==root must hold
       }
-      read(u, u[idx].second);
+      u = peek(u->kids()[idx], peek_buf);
     }
   }
   iterator upper_bound(const Key &key) {
-    Node u = root;
+    if (hashed)
+      throw "Error in upper_bound(): a hash index has no order";
+    if (latches)
+      return seek(key, UPPER);
+    const Node *u = &root;
     while (1) {
-      size_t idx = u.upper_bound(key);
-      if (u.leaf) {
-        return iterator(this, u, idx);
-      } else if (idx == u.size) {
+      size_t idx = u->upper_bound(key);
+      if (u->leaf) {
+        return iterator(this, pin(u->pos), idx);
+      } else if (idx == u->size) {
         return end(); // u==root must hold
       }
-      read(u, u[idx].second);
+      u = peek(u->kids()[idx], peek_buf);
     }
   }
 
@@ -539,16 +2094,32 @@ public:
    * @brief sets the value of an existing element
    */
   void set(const Key &key, const T &value) {
-    Node u = root;
+    Writing w(this);
+    if (hashed)
+      return hash_set(key, value);
+    unshare_path(key, false);
+    const Node *u = &root;
     while (1) {
-      size_t idx = u.lower_bound(key);
-      if (idx >= u.size || (u.leaf && u[idx].first != key))
+      size_t idx = u->lower_bound(key);
+      if (idx >= u->size || (u->leaf && u->keys()[idx] != key))
         throw "Error in set(): element does not exist";
-      if (u.leaf) {
-        write_value(value, u[idx].second);
+      if (u->leaf) {
+        if constexpr (INLINE) {
+          Node x = *u;
+          write_inline(x, idx, value);
+        } else if (!snaps.empty() && read_rc(value_rc(u->vals()[idx]))) {
+          Node x = *u; // the value is shared: copy-on-write
+          release_value(x.vals()[idx]);
+          x.vals()[idx] = new_ref(value);
+          write(x);
+          if (x == root)
+            root = x;
+        } else {
+          write_value(value, u->vals()[idx]);
+        }
         return;
       }
-      read(u, u[idx].second);
+      u = peek(u->kids()[idx], peek_buf);
     }
   }
   void set(const value_type &x) { return set(x.first, x.second); }
@@ -557,30 +2128,169 @@ public:
    * @brief get/set value through the handle of an iterator
    */
   T get_by_handle(int handle) {
+    static_assert(!INLINE, "inlined values have no handle");
     T val;
-    read_value(val, handle);
-    return val;
+    if (!latches) {
+      read_value(val, handle);
+      return val;
+    }
+    while (1) {
+      size_t v = latches->read_lock(value_latch(handle));
+      read_value_shared(val, handle);
+      if (latches->check(value_latch(handle), v))
+        return val;
+    }
+  }
+  void set_by_handle(int handle, const T &val) {
+    static_assert(!INLINE, "inlined values have no handle");
+    Writing w(this);
+    if (!snaps.empty() && read_rc(value_rc(handle)))
+      throw "Error in set_by_handle(): value is shared with a snapshot";
+    write_value(val, handle);
   }
-  void set_by_handle(int handle, const T &val) { write_value(val, handle); }
 
   /**
    * @brief inserts a new element. throws error if element already exists
    * @return handle to the new node
    */
   int insert(const Key &key, const T &value) {
+    Writing w(this);
+    if (bloom)
+      bloom->add(key);
+    if (hashed)
+      return hash_insert(key, value);
+    unshare_path(key, false);
+    if constexpr (INLINE) {
+      BP_insert(key, InlineRef::of(value), root, null);
+      return -1;
+    }
     int val_pos = new_value();
     BP_insert(key, val_pos, root, null);
     write_value(value, val_pos);
     return val_pos;
   }
   int insert(const value_type &x) { return insert(x.first, x.second); }
+  /**
+   * @brief inserts elements in ascending order of keys, descending into each
+   * affected subtree once and splitting nodes bottom-up, instead of calling
+   * insert() for every element. throws error if an element already exists
+   * (the elements before it may have been inserted)
+   * while snapshots exist, or if hashed, elements are inserted one by one
+   * (copy-on-write)
+   */
+  void insert_sorted(const vector<pair<Key, T>> &vec) {
+    Writing w(this);
+    if (vec.empty())
+      return;
+    if (!snaps.empty() || hashed) {
+      for (size_t i = 0; i < vec.size(); i++)
+        insert(vec[i].first, vec[i].second);
+      return;
+    }
+    if (empty())
+      return bulk_load(vec);
+    vector<Data> ents, out;
+    for (size_t i = 0; i < vec.size(); i++) {
+      if (bloom)
+        bloom->add(vec[i].first);
+      ents.push_back(Data(vec[i].first, new_ref(vec[i].second)));
+    }
+    BP_insert_sorted(ents, 0, ents.size(), root, out);
+    grow(out);
+  }
+  /**
+   * @brief builds an empty tree from elements in ascending order of keys
+   */
+  void bulk_load(const vector<pair<Key, T>> &vec) {
+    Writing w(this);
+    if (!empty())
+      throw "Error in bulk_load(): tree is not empty";
+    if (hashed) {
+      for (size_t i = 0; i < vec.size(); i++)
+        insert(vec[i].first, vec[i].second);
+      return;
+    }
+    Loader loader(this);
+    for (size_t i = 0; i < vec.size(); i++) {
+      if (bloom)
+        bloom->add(vec[i].first);
+      loader.push(Data(vec[i].first, new_ref(vec[i].second)));
+    }
+    loader.finish();
+  }
 
   /**
    * @brief erases a new element. throws error if element does not exist
    */
-  void erase(const Key &key) { BP_erase(key, root, null); }
+  void erase(const Key &key) {
+    Writing w(this);
+    if (hashed)
+      return hash_erase(key);
+    unshare_path(key, true);
+    BP_erase(key, root, null);
+  }
+
+  bool empty() {
+    int pos;
+    return hashed ? !next_buckets(nullptr, true, &pos, 1) : !root.size;
+  }
 
-  bool empty() const { return !root.size; }
+  /**
+   * @brief copy-on-write snapshots: a snapshot shares all nodes and values
+   * with the live tree until either side modifies them, so creating one only
+   * adds a reference to the root (of the directory, if hashed) and saves the
+   * Bloom filter, if any
+   * throws error if snapshot id already exists
+   */
+  void snapshot(int id) {
+    Writing w(this);
+    if (has_snapshot(id))
+      throw "Error in snapshot(): snapshot already exists";
+    if (bloom)
+      save_snap_bloom();
+    write_rc(node_rc(root), read_rc(node_rc(root)) + 1);
+    snaps.push_back(pair<int, int>(id, root.pos));
+  }
+  /**
+   * @brief switches the live tree to snapshot id, which is kept; the nodes
+   * and values only the live tree referred to are freed
+   * ! handles obtained before are invalidated
+   */
+  void restore(int id) {
+    Writing w(this);
+    size_t i = find_snapshot(id);
+    if (i == snaps.size())
+      throw "Error in restore(): snapshot does not exist";
+    int pos = snaps[i].second;
+    write_rc(node_rc(pos), read_rc(node_rc(pos)) + 1);
+    release_node(root);
+    read(root, pos);
+    if (bloom && !load_snap_bloom(i))
+      rebuild_bloom(false); // the snapshot may hold keys erased since
+  }
+  /**
+   * @brief deletes snapshot id, freeing what only it referred to
+   */
+  void drop_snapshot(int id) {
+    Writing w(this);
+    size_t i = find_snapshot(id);
+    if (i == snaps.size())
+      throw "Error in drop_snapshot(): snapshot does not exist";
+    release_node(snaps[i].second);
+    snaps.erase(i);
+    if (i < snap_blooms.size())
+      snap_blooms.erase(i);
+  }
+  bool has_snapshot(int id) const { return find_snapshot(id) < snaps.size(); }
+  /**
+   * @return the largest snapshot id, 0 if there is none
+   */
+  int max_snapshot() const {
+    int ret = 0;
+    for (size_t i = 0; i < snaps.size(); i++)
+      ret = std::max(ret, snaps[i].first);
+    return ret;
+  }
 }; // Class BPT
 
 #endif
@@ -0,0 +1,186 @@
+#ifndef _SJTU_BLOOM_FILTER_HPP_
+#define _SJTU_BLOOM_FILTER_HPP_
+
+#include <atomic>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <type_traits>
+
+#include "MappedFile.hpp"
+#include "utility.hpp"
+
+/**
+ * @brief hash of a key for BloomFilter: integers and (nested) pairs are mixed
+ * by value (a pair may have padding bytes), other keys go through std::hash
+ */
+template <class T> struct BloomHash {
+  /**
+   * @brief finalizer of splitmix64
+   */
+  static size_t mix(size_t x) {
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+  }
+  static size_t of(const T &x) {
+    if constexpr (std::is_integral<T>::value)
+      return mix((size_t)x);
+    else
+      return mix(std::hash<T>()(x));
+  }
+};
+template <class A, class B> struct BloomHash<pair<A, B>> {
+  static size_t of(const pair<A, B> &x) {
+    return BloomHash<size_t>::mix(BloomHash<A>::of(x.first) * 31 +
+                                  BloomHash<B>::of(x.second));
+  }
+};
+
+template <class T> struct is_pair_key : std::false_type {};
+template <class A, class B> struct is_pair_key<pair<A, B>> : std::true_type {};
+
+/**
+ * @brief Bloom filter over the keys of a tree: contains() is false only for
+ * keys never added; keys cannot be removed, so the owner rebuilds the filter
+ * from time to time. for pair keys, the first component is added as well, so
+ * that a range of keys sharing it can be ruled out (see contains_prefix())
+ * one thread adds keys while others may test them (the bits are atomic)
+ */
+template <class Key> class BloomFilter {
+  static constexpr int K = 4; // bits per key
+  static constexpr size_t PREFIX = 0x9e3779b97f4a7c15ULL; // salt of prefixes
+
+  size_t nbits;
+  std::atomic<size_t> *words;
+
+  static constexpr size_t WORD = sizeof(size_t) * 8;
+  size_t words_num() const { return nbits / WORD; }
+  /**
+   * @brief the K bits of a hash, by double hashing
+   */
+  template <class Func> void bits(size_t h, Func func) const {
+    size_t h2 = (h >> 32 | h << 32) | 1;
+    for (int i = 0; i < K; i++, h += h2)
+      func(h & (nbits - 1));
+  }
+  void set(size_t h) {
+    bits(h, [&](size_t b) {
+      auto &w = words[b / WORD]; // only one thread sets bits
+      w.store(w.load(std::memory_order_relaxed) | size_t(1) << b % WORD,
+              std::memory_order_relaxed);
+    });
+  }
+  bool test(size_t h) const {
+    bool ret = true;
+    bits(h, [&](size_t b) {
+      ret &= words[b / WORD].load(std::memory_order_relaxed) >> b % WORD & 1;
+    });
+    return ret;
+  }
+
+public:
+  size_t seq = 0; // number of keys added, recorded with the filter
+
+  /**
+   * @param bits rounded up to a power of 2
+   */
+  explicit BloomFilter(size_t bits) : nbits(WORD) {
+    while (nbits < bits)
+      nbits <<= 1;
+    words = new std::atomic<size_t>[words_num()];
+    clear();
+  }
+  BloomFilter(const BloomFilter &) = delete;
+  BloomFilter &operator=(const BloomFilter &) = delete;
+  ~BloomFilter() { delete[] words; }
+
+  void add(const Key &key) {
+    set(BloomHash<Key>::of(key));
+    if constexpr (is_pair_key<Key>::value)
+      set(BloomHash<decltype(key.first)>::of(key.first) ^ PREFIX);
+    seq++;
+  }
+  /**
+   * @return false if key was never added
+   */
+  bool contains(const Key &key) const { return test(BloomHash<Key>::of(key)); }
+  /**
+   * @return false if no key with first component first was ever added
+   */
+  template <class First> bool contains_prefix(const First &first) const {
+    static_assert(is_pair_key<Key>::value, "keys are not pairs");
+    return test(BloomHash<First>::of(first) ^ PREFIX);
+  }
+  void clear() {
+    for (size_t i = 0; i < words_num(); i++)
+      words[i].store(0, std::memory_order_relaxed);
+  }
+
+  size_t image_size() const { return (2 + words_num()) * sizeof(size_t); }
+  /**
+   * @return the filter as saved: its size, seq and bits
+   */
+  string image() const {
+    string s(image_size(), '\0');
+    size_t *p = (size_t *)s.data();
+    p[0] = nbits, p[1] = seq;
+    for (size_t i = 0; i < words_num(); i++)
+      p[i + 2] = words[i].load(std::memory_order_relaxed);
+    return s;
+  }
+  /**
+   * @brief reads the filter from an image()
+   * @return false if it is not of this size, or its seq differs from seq_
+   * (keys were added after it was saved): the filter must be rebuilt
+   */
+  bool restore(const string &img, size_t seq_) {
+    const size_t *p = (const size_t *)img.data();
+    if (img.size() != image_size() || p[0] != nbits || p[1] != seq_)
+      return false;
+    for (size_t i = 0; i < words_num(); i++)
+      words[i].store(p[i + 2], std::memory_order_relaxed);
+    seq = p[1];
+    return true;
+  }
+  /**
+   * @brief adds the keys of the filter saved as img (an image() of a filter
+   * of this size) to this one
+   * @return false if img is not of this size
+   */
+  bool merge(const string &img) {
+    const size_t *p = (const size_t *)img.data();
+    if (img.size() != image_size() || p[0] != nbits)
+      return false;
+    for (size_t i = 0; i < words_num(); i++)
+      words[i].fetch_or(p[i + 2], std::memory_order_relaxed);
+    seq += p[1] + 1; // keys were added: a filter saved before is stale
+    return true;
+  }
+  /**
+   * @brief writes the filter into a new file that replaces name, so that a
+   * crash leaves either the old filter or the new one
+   */
+  void save(const string &name) const {
+    string tmp = name + ".tmp", img = image();
+    {
+      std::ofstream fs(tmp, ios::binary | ios::trunc);
+      fs.write(img.data(), img.size());
+      if (!fs)
+        throw "Error in BloomFilter: save() failed";
+    }
+    fsync_path(tmp);
+    std::filesystem::rename(tmp, name);
+  }
+  /**
+   * @brief reads the filter saved in name (see restore())
+   */
+  bool load(const string &name, size_t seq_) {
+    std::ifstream fs(name, ios::binary);
+    std::stringstream ss;
+    ss << fs.rdbuf();
+    return restore(ss.str(), seq_);
+  }
+};
+
+#endif
@@ -0,0 +1,388 @@
+#ifndef _SJTU_BUFFER_POOL_HPP_
+#define _SJTU_BUFFER_POOL_HPP_
+
+#include <chrono>
+#include <condition_variable>
+#include <shared_mutex>
+#include <thread>
+
+#include "Hashmap.hpp"
+#include "ReplacementPolicy.hpp"
+#include "utility.hpp"
+
+/**
+ * @brief cache of nodes (and slabs of values) shared by all the CachedBPTs of
+ * a process, indexed by (file, position) within a budget of bytes: frames are
+ * evicted by Policy (see ReplacementPolicy.hpp) whichever tree they belong
+ * to, so frames move to the hot trees
+ * inner (non-leaf) nodes are replaced apart from leaves, and are only evicted
+ * when no leaf can be, or when they take more than INNER_SHARE of the budget
+ * with a background writer, evicted dirty frames are queued and written back
+ * by another thread in (file, position) order, so an eviction does not wait
+ * for the write; until then the queue stands in for the file (see pending())
+ * pinned frames (held by iterators) are never evicted, and the pool overflows
+ * if it cannot evict anything else
+ * the trees sharing a pool must be modified by one thread at a time;
+ * concurrent readers (see BPT) only look frames up through peek()
+ */
+template <class Policy = TwoQPolicy> class BufferPool {
+public:
+  class Client;
+  /**
+   * @brief a cached node or slab, extended by the tree that owns it
+   */
+  struct Frame : PoolHook {
+    Client *owner;
+    int pos;      // position in the file of the owner
+    size_t bytes; // charged against the budget
+    bool inner;   // an inner node
+    int pins = 0; // references held outside the pool, which keep the frame
+    Frame(Client *owner_, int pos_, size_t bytes_, bool inner_ = false)
+        : owner(owner_), pos(pos_), bytes(bytes_), inner(inner_) {}
+    virtual ~Frame() {}
+  };
+  class Client {
+  public:
+    enum Eviction { KEEP, DONE, DEFER };
+    virtual ~Client() {}
+    /**
+     * @brief prepares a frame to be evicted
+     * @param wait = false: keep the frames that cannot be written back without
+     * waiting (for the WAL)
+     * @return KEEP: the frame must stay for now; DONE: it is clean or written
+     * back; DEFER: it is dirty, and is to be written by the background writer
+     * through write_out()
+     */
+    virtual Eviction write_back(Frame *f, bool wait) = 0;
+    /**
+     * @brief writes a deferred frame into its file, on the background writer
+     */
+    virtual void write_out(const Frame *f) = 0;
+    /**
+     * @brief called after write_out() on the frames of a batch that belong to
+     * this client, whose writes must be complete on return
+     */
+    virtual void write_out_done() {}
+  };
+
+  static constexpr size_t DEFAULT_CAPACITY = 1 << 26; // 64 MB
+  static constexpr double INNER_SHARE = 0.5;
+  static constexpr size_t BATCH = 64; // queued frames that wake the writer
+  static constexpr auto INTERVAL = std::chrono::milliseconds(20);
+
+private:
+  static inline BufferPool *current = nullptr;
+
+  Hashmap<size_t, Frame *> frames; // index only, the order is kept by policies
+  Policy leaves, inners;
+  size_t capacity, used = 0, inner_bytes = 0;
+  bool global;
+  int files = 0;      // ids handed out by attach()
+  int concurrent = 0; // attached files with concurrent readers
+  std::shared_mutex latch; // taken when there are concurrent readers
+
+  // background writer: frames are queued, then moved in flight by batches
+  std::thread writer;
+  std::mutex wb_lock; // guards the fields below
+  std::condition_variable wb_wake, wb_done;
+  Hashmap<size_t, Frame *> queue, flight;
+  size_t queued_bytes = 0; // in the queue and in flight, beyond the budget
+  int draining = 0;        // threads waiting in drain()
+  bool stopping = false;
+
+  static size_t key(int file, int pos) {
+    return (size_t)file << 32 | (unsigned)pos;
+  }
+  static int file_of(size_t key) { return key >> 32; }
+  Policy &policy(Frame *f) { return f->inner ? inners : leaves; }
+  /**
+   * @brief removes f from the index and from the budget
+   */
+  void unlink(Frame *f) {
+    frames.erase(frames.find(f->key));
+    used -= f->bytes;
+    if (f->inner)
+      inner_bytes -= f->bytes;
+  }
+  /**
+   * @brief evicts a frame chosen by the policies, that its owner lets go,
+   * preferably one whose eviction does not wait
+   * @return false if there is none (the pool overflows for now)
+   */
+  bool evict() {
+    for (int wait = 0; wait < 2; wait++) {
+      auto res = Client::KEEP;
+      auto write_back = [&](PoolHook *x) {
+        Frame *f = static_cast<Frame *>(x);
+        if (f->pins)
+          return false;
+        return (res = f->owner->write_back(f, wait)) != Client::KEEP;
+      };
+      PoolHook *x = nullptr;
+      bool crowded = inner_bytes > capacity * INNER_SHARE;
+      if (crowded)
+        x = inners.victim(write_back);
+      if (!x)
+        x = leaves.victim(write_back);
+      if (!x && !crowded)
+        x = inners.victim(write_back);
+      if (!x)
+        continue;
+      Frame *f = static_cast<Frame *>(x);
+      {
+        // concurrent readers find a deferred frame in the index or the queue
+        auto lock = exclusive();
+        unlink(f);
+        if (res == Client::DEFER)
+          defer(f); // the writer owns it from now on
+      }
+      if (res == Client::DEFER)
+        throttle();
+      else
+        delete f;
+      return true;
+    }
+    return false;
+  }
+  /**
+   * @brief queues an evicted dirty frame for the background writer
+   */
+  void defer(Frame *f) {
+    std::lock_guard<std::mutex> lock(wb_lock);
+    auto it = queue.find(f->key);
+    if (it != queue.end()) { // superseded
+      queued_bytes -= it->second->bytes;
+      delete it->second;
+      queue.erase(it);
+    }
+    queue.insert(f->key, f);
+    queued_bytes += f->bytes;
+    if (queue.size() >= BATCH)
+      wb_wake.notify_one();
+  }
+  /**
+   * @brief waits while the queue takes more than 1/8 of the budget
+   */
+  void throttle() {
+    std::unique_lock<std::mutex> lock(wb_lock);
+    if (queued_bytes > capacity / 8) {
+      draining++, wb_wake.notify_one();
+      wb_done.wait(lock, [&]() { return queued_bytes <= capacity / 8; });
+      draining--;
+    }
+  }
+  /**
+   * @brief body of the background writer
+   */
+  void write_loop() {
+    std::unique_lock<std::mutex> lock(wb_lock);
+    while (true) {
+      wb_wake.wait_for(lock, INTERVAL, [&]() {
+        return stopping ||
+               (!queue.empty() && (draining || queue.size() >= BATCH));
+      });
+      if (queue.empty()) {
+        if (stopping)
+          return;
+        continue;
+      }
+      sjtu::vector<Frame *> batch;
+      for (auto it = queue.begin(); it != queue.end(); ++it) {
+        batch.push_back(it->second);
+        flight.insert(it->first, it->second);
+      }
+      queue.clear();
+      lock.unlock();
+      sort(batch, 0, (int)batch.size() - 1,
+           [](Frame *a, Frame *b) { return a->key < b->key; });
+      for (size_t i = 0; i < batch.size(); i++) {
+        batch[i]->owner->write_out(batch[i]);
+        if (i + 1 == batch.size() || batch[i + 1]->owner != batch[i]->owner)
+          batch[i]->owner->write_out_done(); // sorted: grouped by owner
+      }
+      lock.lock();
+      for (size_t i = 0; i < batch.size(); i++) {
+        flight.erase(flight.find(batch[i]->key));
+        queued_bytes -= batch[i]->bytes;
+        delete batch[i];
+      }
+      wb_done.notify_all();
+    }
+  }
+
+public:
+  /**
+   * @param global = true: the pool of the process, found by the trees
+   * constructed after it through get(); otherwise private to one tree
+   * @param background = true: start a background writer
+   */
+  explicit BufferPool(size_t capacity_ = DEFAULT_CAPACITY, bool global_ = true,
+                      bool background = false)
+      : capacity(capacity_), global(global_) {
+    if (background)
+      writer = std::thread([this]() { write_loop(); });
+    if (global)
+      current = this;
+  }
+  BufferPool(const BufferPool &) = delete;
+  BufferPool &operator=(const BufferPool &) = delete;
+  /**
+   * @brief the trees detach first, writing their frames back
+   */
+  ~BufferPool() {
+    if (writer.joinable()) {
+      {
+        std::lock_guard<std::mutex> lock(wb_lock);
+        stopping = true;
+      }
+      wb_wake.notify_one();
+      writer.join();
+    }
+    for (auto it = frames.begin(); it != frames.end(); ++it)
+      delete it->second;
+    if (global)
+      current = nullptr;
+  }
+  /**
+   * @return the pool of the process, nullptr if there is none
+   */
+  static BufferPool *get() { return current; }
+
+  /**
+   * @return id of a new file in the pool
+   */
+  int attach(bool concurrent_readers) {
+    concurrent += concurrent_readers;
+    return files++;
+  }
+  void detach(int file, bool concurrent_readers) {
+    drop(file);
+    concurrent -= concurrent_readers;
+  }
+
+  std::unique_lock<std::shared_mutex> exclusive() {
+    if (concurrent)
+      return std::unique_lock<std::shared_mutex>(latch);
+    return std::unique_lock<std::shared_mutex>();
+  }
+  std::shared_lock<std::shared_mutex> shared() {
+    return std::shared_lock<std::shared_mutex>(latch);
+  }
+
+  /**
+   * @brief finds a frame and reports the hit to the policy
+   * @param hit = false: leave the policy alone (e.g. while it is choosing a
+   * victim)
+   * @return nullptr if not found
+   */
+  Frame *find(int file, int pos, bool hit = true) {
+    Frame *const *f = frames.peek(key(file, pos));
+    if (!f)
+      return nullptr;
+    if (hit)
+      policy(*f).access(*f);
+    return *f;
+  }
+  /**
+   * @brief finds a frame for a concurrent reader, which holds shared()
+   * while it uses the frame
+   */
+  const Frame *peek(int file, int pos) const {
+    Frame *const *f = frames.peek(key(file, pos));
+    return f ? *f : nullptr;
+  }
+  /**
+   * @brief inserts a new frame (allocated by new, owned by the pool from now
+   * on), evicting others to stay within the budget
+   */
+  void insert(int file, Frame *f) {
+    while (used + f->bytes > capacity && evict())
+      ;
+    f->key = key(file, f->pos);
+    policy(f).insert(f);
+    if (f->inner)
+      inner_bytes += f->bytes;
+    auto lock = exclusive();
+    frames.insert(f->key, f);
+    used += f->bytes;
+  }
+  /**
+   * @brief moves f between the leaves and the inner nodes (when a position is
+   * reused for a node of the other kind)
+   */
+  void set_inner(Frame *f, bool inner) {
+    if (f->inner == inner)
+      return;
+    policy(f).erase(f);
+    if (inner)
+      inner_bytes += f->bytes;
+    else
+      inner_bytes -= f->bytes;
+    f->inner = inner;
+    policy(f).insert(f);
+  }
+  /**
+   * @return id of the file of a frame
+   */
+  static int file_of(const Frame *f) { return file_of(f->key); }
+  bool has_writer() const { return writer.joinable(); }
+  /**
+   * @brief looks up the frames queued for the background writer: if the one of
+   * (file, pos) is not written yet, calls func on it (under a lock, so func
+   * must copy what it needs) and returns true
+   */
+  template <class Func> bool pending(int file, int pos, Func func) {
+    if (!has_writer())
+      return false;
+    std::lock_guard<std::mutex> lock(wb_lock);
+    Frame *const *f = queue.peek(key(file, pos));
+    if (!f)
+      f = flight.peek(key(file, pos));
+    if (!f)
+      return false;
+    func((const Frame *)*f);
+    return true;
+  }
+  /**
+   * @brief waits until the queued frames are written, before the files are
+   * written or synced in another way
+   */
+  void drain() {
+    if (!has_writer())
+      return;
+    std::unique_lock<std::mutex> lock(wb_lock);
+    draining++, wb_wake.notify_one();
+    wb_done.wait(lock, [&]() { return queue.empty() && flight.empty(); });
+    draining--;
+  }
+  /**
+   * @brief calls func on every frame of file
+   */
+  template <class Func> void for_each(int file, Func func) {
+    for (auto it = frames.begin(); it != frames.end(); ++it)
+      if (file_of(it->first) == file)
+        func(it->second);
+  }
+  /**
+   * @brief discards every frame of file without writing it back
+   */
+  void drop(int file) {
+    auto lock = exclusive();
+    for (auto it = frames.begin(); it != frames.end();) {
+      auto nxt = it;
+      ++nxt;
+      if (file_of(it->first) == file) {
+        Frame *f = it->second;
+        policy(f).erase(f);
+        unlink(f);
+        delete f;
+      }
+      it = nxt;
+    }
+  }
+  size_t size() const { return frames.size(); }
+  size_t bytes() const { return used; }
+  size_t budget() const { return capacity; }
+};
+
+#endif
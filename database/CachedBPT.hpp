@@ -1,73 +1,692 @@
 #ifndef _SJTU_CACHED_BPLUSTREE_HPP_
 #define _SJTU_CACHED_BPLUSTREE_HPP_
 
+#include <shared_mutex>
+
 #include "BPT.hpp"
+#include "BufferPool.hpp"
 #include "Hashmap.hpp"
+#include "WAL.hpp"
 
 /**
- * @brief B+ tree with LRU cache
+ * @brief B+ tree cached in a buffer pool: the pool of the process with the
+ * same replacement Policy if one exists when it is constructed (see
+ * BufferPool), otherwise a private one of MEM_CAP bytes
+ * values are cached too, in slabs: the pages of value_file (see BPT::PAGE),
+ * decoded if packed
+ * if a WAL exists when it is constructed, the changes of every command are
+ * logged, and held back from the files until the log covering them is durable
+ * the positions of the cached nodes and slabs are saved in a manifest at
+ * checkpoints and on destruction, and prefetched when the tree is opened again
+ * (see warm_up())
+ * in concurrent mode, readers look up the pool without reordering it (a hit
+ * does not refresh the frame) and do not cache what they miss; the writer
+ * locks the pool exclusively only to insert, erase or overwrite frames
  */
-template <class Key, class T, size_t MEM_CAP = 1 << 18>
-class CachedBPT : public BPT<Key, T> {
+template <class Key, class T, size_t MEM_CAP = 1 << 18,
+          class Policy = TwoQPolicy>
+class CachedBPT : public BPT<Key, T>,
+                  private WAL::Client,
+                  private BufferPool<Policy>::Client {
 private:
-  using Node = typename CachedBPT<Key, T>::Node;
-  static constexpr size_t LRU_CAP = MEM_CAP / sizeof(Node);
-  // adjust LRU_CAP according to sizeof(node)
+  using Node = typename BPT<Key, T>::Node;
+  using Pool = BufferPool<Policy>;
+
+  /**
+   * @brief cmd: the command that last modified the data, 0 if unmodified
+   */
+  struct Entry : Pool::Frame {
+    Node node;
+    size_t cmd;
+    Entry(CachedBPT *tr, int pos, const Node &x, size_t cmd_)
+        : Pool::Frame(tr, pos, sizeof(Entry), !x.leaf), node(x), cmd(cmd_) {}
+  };
+  static constexpr size_t PER_SLAB = BPT<Key, T>::PER_PAGE;
+  /**
+   * @brief values of value_file from pos on, n of them read from the file
+   * (a slab may run past the end of the file)
+   * if packed with a WAL, a slab is packed when the commands modifying it are
+   * committed, and the blob logged then is the one written back (see pack())
+   */
+  struct Slab : Pool::Frame {
+    T vals[PER_SLAB];
+    size_t n = 0;
+    bool dirty = false;
+    size_t cmd = 0; // packed: the command that last modified it
+    PackedFile::Blob blob;
+    Slab(CachedBPT *tr, int pos) : Pool::Frame(tr, pos, sizeof(Slab)) {}
+  };
+  template <class V> struct Held {
+    V val;
+    size_t cmd;
+  };
+  Pool *pool, *own_pool = nullptr;
+  int pool_id, slab_id; // ids of nodes and values in the pool
+  string warm_filename; // manifest of the cached positions
 
-  using Cache = Hashmap<int, Node, LRU_CAP>;
-  Cache cache;
+  WAL *wal;
+  // ids of the files in the log
+  int tree_id, node_id, value_id, ref_id, page_id = -1;
+  sjtu::vector<int> touched; // nodes modified by the current command
+  sjtu::vector<int> touched_slabs; // slabs modified by it (packed only)
+  bool changed = false;      // whether the current command modified the tree
+  // value and reference count writes held back (WAL only)
+  Hashmap<int, Held<T>> values;
+  Hashmap<int, Held<int>> rcs;
+  std::shared_mutex held_lock; // guards values (concurrent mode only)
+
+  std::unique_lock<std::shared_mutex> exclusive() {
+    if (this->latches)
+      return std::unique_lock<std::shared_mutex>(held_lock);
+    return std::unique_lock<std::shared_mutex>();
+  }
 
+  size_t cur_cmd() const { return wal ? wal->current_cmd() : 1; }
+  /**
+   * @brief logs that the current command writes n bytes at pos of one of the
+   * files (a segment of the database, whose file the log then refers to)
+   */
+  void log(int file, int seg, int pos, const void *p, size_t n) {
+    auto db = this->db;
+    if (!db)
+      return wal->log(file, pos, p, n);
+    if (pos + n > db->size(seg))
+      db->resize(seg, pos + n); // the header grows
+    db->extents(seg, pos, n, [&](size_t off, size_t done, size_t len) {
+      wal->log(file, off, (const char *)p + done, len);
+    });
+  }
+
+  /**
+   * @return the cached node at pos, nullptr if it is not cached
+   */
+  Entry *frame(int pos) {
+    return static_cast<Entry *>(pool->find(pool_id, pos));
+  }
   /**
-   * @brief writes the data of an iterator into the disk
+   * @brief writes a cached node into the disk if it is dirty
    */
-  void flush(typename Cache::iterator it) {
-    BPT<Key, T>::write(it->second, it->first);
+  void flush(Entry *e) {
+    if (e->cmd)
+      BPT<Key, T>::write(e->node, e->pos);
+    e->cmd = 0;
   }
   /**
-   * @brief flushes and clears the cache
+   * @brief position of the slab holding the value at pos (a padded value of a
+   * direct file is alone, whatever its position)
+   */
+  static int slab_of(int pos) {
+    return PER_SLAB == 1 ? pos : pos - pos % (PER_SLAB * sizeof(T));
+  }
+  /**
+   * @return the slab holding the value at pos, read on a cache miss
+   */
+  Slab *slab(int pos) {
+    int base = slab_of(pos);
+    if (auto s = static_cast<Slab *>(pool->find(slab_id, base)))
+      return s;
+    Slab *s = new Slab(this, base);
+    if (!pool->pending(slab_id, base, [&](const typename Pool::Frame *f) {
+          auto q = static_cast<const Slab *>(f);
+          for (size_t i = 0; i < q->n; i++)
+            s->vals[i] = q->vals[i];
+          s->n = q->n;
+        }))
+      s->n = this->read_values(s->vals, base, PER_SLAB);
+    pool->insert(slab_id, s);
+    return s;
+  }
+  /**
+   * @brief the value at pos in slab s, reading the values appended to the file
+   * since s was read (the pool is held exclusively by the caller)
+   */
+  T &slot(Slab *s, int pos) {
+    size_t i = (pos - s->pos) / sizeof(T);
+    if (i >= s->n) {
+      this->read_values(s->vals + s->n, s->pos + s->n * sizeof(T),
+                        i + 1 - s->n);
+      s->n = i + 1;
+    }
+    return s->vals[i];
+  }
+  /**
+   * @brief writes a value into its slab, which is read on a cache miss
+   */
+  void cache_value(const T &x, int pos) {
+    Slab *s = slab(pos);
+    auto lock = pool->exclusive();
+    slot(s, pos) = x, s->dirty = true;
+    if (!this->packed || !wal)
+      return;
+    if (s->cmd != cur_cmd())
+      touched_slabs.push_back(s->pos);
+    s->cmd = cur_cmd(), changed = true;
+  }
+  /**
+   * @brief writes a value into its slab if cached, otherwise into the file:
+   * called when the log is synced, possibly while the pool chooses a victim,
+   * so the pool is neither filled nor reordered
+   */
+  void write_through(const T &x, int pos) {
+    int base = slab_of(pos);
+    if (auto s = static_cast<Slab *>(pool->find(slab_id, base, false))) {
+      auto lock = pool->exclusive();
+      slot(s, pos) = x, s->dirty = true;
+      return;
+    }
+    if (pool->pending(slab_id, base, [](auto *) {}))
+      pool->drain(); // the queued slab would overwrite x
+    BPT<Key, T>::write_value(x, pos);
+  }
+  /**
+   * @brief packs the slabs modified by the current command, and logs their
+   * blobs unless !logged (a checkpoint in the middle of a command writes them
+   * back as they are, like the nodes)
+   */
+  void pack_touched(bool logged) {
+    for (size_t i = 0; i < touched_slabs.size(); i++) {
+      auto s = static_cast<Slab *>(
+          pool->find(slab_id, touched_slabs[i], false));
+      size_t k = s->pos / (PER_SLAB * sizeof(T));
+      const PackedFile::Blob &b = s->blob =
+          this->value_pages->pack(k, (const char *)s->vals);
+      if (logged) {
+        log(value_id, this->value_seg, b.at.pos, b.data.data(), b.data.size());
+        log(page_id, this->page_seg, PackedFile::entry_pos(k), &b.at,
+            sizeof(b.at));
+      }
+    }
+    touched_slabs.clear();
+  }
+  void flush(Slab *s) {
+    if (s->dirty && this->packed && wal)
+      this->value_pages->store(s->blob), string().swap(s->blob.data);
+    else if (s->dirty)
+      this->write_values(s->vals, s->pos, s->n);
+    s->dirty = false, s->cmd = 0;
+  }
+  /**
+   * @brief flushes the cached nodes and values of the tree and drops them from
+   * the pool
    */
   void flush() {
-    for (auto it = cache.begin(), end = cache.end(); it != end; ++it)
-      flush(it);
-    cache.clear();
+    pool->drain();
+    pool->for_each(pool_id, [&](auto *f) { flush((Entry *)f); });
+    pool->for_each(slab_id, [&](auto *f) { flush((Slab *)f); });
+    pool->drop(pool_id), pool->drop(slab_id);
+  }
+  /**
+   * @brief writes back the held-back values (and reference counts) modified
+   * by commands up to cmd
+   */
+  void flush_values(size_t cmd) {
+    for (auto it = values.begin(), end = values.end(); it != end;) {
+      auto nxt = it;
+      ++nxt;
+      if (it->second.cmd <= cmd) {
+        write_through(it->second.val, it->first);
+        auto lock = exclusive();
+        values.erase(it);
+      }
+      it = nxt;
+    }
+    for (auto it = rcs.begin(), end = rcs.end(); it != end;) {
+      auto nxt = it;
+      ++nxt;
+      if (it->second.cmd <= cmd) {
+        BPT<Key, T>::write_rc(it->first, it->second.val);
+        rcs.erase(it);
+      }
+      it = nxt;
+    }
+  }
+  template <class V> void hold(Hashmap<int, Held<V>> &map, int pos, V val) {
+    auto lock = exclusive();
+    auto it = map.find(pos);
+    if (it == map.end())
+      map.insert(pos, Held<V>{val, cur_cmd()});
+    else
+      it->second = Held<V>{val, cur_cmd()};
+    changed = true;
+  }
+  /**
+   * @brief the frame of a node, or of a slab packed with a WAL, modified by
+   * command cmd, may be evicted (the log covering it is durable, or is synced
+   * now if wait)
+   */
+  bool evictable(size_t cmd, bool wait) {
+    if (wal && cmd == wal->current_cmd())
+      return false;
+    if (wal && cmd > wal->durable()) {
+      if (!wait)
+        return false;
+      wal->sync(); // write-ahead: the log goes first
+    }
+    return true;
+  }
+  /**
+   * @brief called by the pool to evict a node or a slab: the nodes modified by
+   * the current command stay (slabs only hold durable values, unless packed);
+   * dirty frames of a mapped or direct file are left to the background writer
+   * if there is one (a packed slab is written back at once)
+   */
+  virtual typename Pool::Client::Eviction
+  write_back(typename Pool::Frame *f, bool wait) override {
+    bool deferrable = (this->mapped || this->direct) && pool->has_writer();
+    if (Pool::file_of(f) == slab_id) {
+      Slab *s = static_cast<Slab *>(f);
+      if (!s->dirty)
+        return Pool::Client::DONE;
+      if (this->packed && !evictable(s->cmd, wait))
+        return Pool::Client::KEEP;
+      if (deferrable && !this->packed)
+        return Pool::Client::DEFER;
+      flush(s);
+      return Pool::Client::DONE;
+    }
+    Entry *e = static_cast<Entry *>(f);
+    if (!e->cmd)
+      return Pool::Client::DONE;
+    if (!evictable(e->cmd, wait))
+      return Pool::Client::KEEP;
+    if (deferrable)
+      return Pool::Client::DEFER;
+    flush(e);
+    return Pool::Client::DONE;
+  }
+  /**
+   * @brief on the background writer: only the mapping is written (or the write
+   * is queued in the ring of a direct file), and no latch is taken, since
+   * concurrent readers find the frame in the queue
+   */
+  virtual void write_out(const typename Pool::Frame *f) override {
+    if (Pool::file_of(f) == slab_id) {
+      const Slab *s = static_cast<const Slab *>(f);
+      return this->write_values(s->vals, s->pos, s->n);
+    }
+    const Entry *e = static_cast<const Entry *>(f);
+    this->node_file->write_async(&e->node, sizeof(Node), e->pos);
+  }
+  virtual void write_out_done() override { this->node_file->wait(); }
+  /**
+   * @brief reads a node that is not cached, from the queue of the background
+   * writer or from the file
+   */
+  void read_missed(Node &x, int pos, bool shared) {
+    if (pool->pending(pool_id, pos, [&](const typename Pool::Frame *f) {
+          x = static_cast<const Entry *>(f)->node;
+        }))
+      return;
+    if (shared)
+      BPT<Key, T>::read_shared(x, pos);
+    else
+      BPT<Key, T>::read(x, pos);
+  }
+  /**
+   * @brief inserts into the pool
+   */
+  Entry *cache_insert(int pos, const Node &x, size_t cmd) {
+    Entry *e = new Entry(this, pos, x, cmd);
+    pool->insert(pool_id, e);
+    return e;
   }
   /**
-   * @brief insert into LRU cache
+   * @brief marks that the current command modified a cached node
    */
-  void cache_insert(int pos, const Node &x) {
-    if (cache.size() == LRU_CAP)
-      flush(--cache.end()), cache.erase(--cache.end());
-    cache.insert(make_pair(pos, x));
+  void touch(int pos, Entry &e) {
+    if (e.cmd != cur_cmd() && wal)
+      touched.push_back(pos);
+    e.cmd = cur_cmd(), changed = true;
+  }
+
+  /**
+   * @brief writes the positions of the cached nodes and slabs into the
+   * manifest
+   */
+  void save_manifest() {
+    if (this->memory)
+      return; // a tree in memory is not reopened
+    sjtu::vector<int> nodes, slabs;
+    pool->for_each(pool_id, [&](auto *f) { nodes.push_back(f->pos); });
+    pool->for_each(slab_id, [&](auto *f) { slabs.push_back(f->pos); });
+    if (this->db) {
+      std::ostringstream fs;
+      write_flow_(fs, nodes, slabs);
+      return this->db->store(warm_filename, fs.str());
+    }
+    fstream fs(warm_filename, ios::out | ios::binary | ios::trunc);
+    write_flow_(fs, nodes, slabs);
+  }
+  /**
+   * @brief prefetches the nodes and slabs listed in the manifest, in file
+   * order: what goes through the page cache (mapped files, the value file of
+   * a direct tree) is read in by the kernel in the background; the rest is
+   * read into the pool now, within the free part of its budget
+   */
+  void warm_up() {
+    std::istringstream mem;
+    fstream file;
+    if (this->db)
+      mem.str(this->db->load(warm_filename));
+    else
+      file.open(warm_filename, ios::in | ios::binary);
+    istream &fs = this->db ? (istream &)mem : file;
+    sjtu::vector<int> nodes, slabs;
+    read_flow_(fs, nodes, slabs);
+    if (!fs)
+      return; // no manifest
+    auto by_pos = [](int a, int b) { return a < b; };
+    sort(nodes, 0, (int)nodes.size() - 1, by_pos);
+    sort(slabs, 0, (int)slabs.size() - 1, by_pos);
+    size_t room = pool->budget() - min(pool->budget(), pool->bytes());
+    // hints runs of positions (at most two records apart) at once
+    auto runs = [](const sjtu::vector<int> &pos, size_t n, auto hint) {
+      for (size_t l = 0, r; l < pos.size(); l = r) {
+        for (r = l + 1; r < pos.size() && pos[r] - pos[r - 1] <= int(2 * n);)
+          r++;
+        hint(pos[l], pos[r - 1] - pos[l] + n);
+      }
+    };
+    if (this->mapped) {
+      runs(nodes, sizeof(Node),
+           [&](int pos, size_t n) { this->node_file->will_need(pos, n); });
+    } else {
+      size_t len = this->node_file_size();
+      vector<int> miss;
+      for (size_t i = 0; i < nodes.size() && room >= sizeof(Entry); i++)
+        if (nodes[i] + sizeof(Node) <= len && !frame(nodes[i]))
+          miss.push_back(nodes[i]), room -= sizeof(Entry);
+      for (size_t l = 0; l < miss.size(); l += DirectFile::DEPTH) {
+        size_t n = min(miss.size() - l, (size_t)DirectFile::DEPTH);
+        Node *buf = new Node[n];
+        read_many(buf, &miss[l], n); // caches them
+        delete[] buf;
+      }
+    }
+    if ((this->mapped || this->direct) && !this->packed)
+      runs(slabs, PER_SLAB * sizeof(T),
+           [&](int pos, size_t n) { this->value_file->will_need(pos, n); });
+    else // read (and decoded if packed) now
+      for (size_t i = 0; i < slabs.size() && room >= sizeof(Slab); i++)
+        slab(slabs[i]), room -= sizeof(Slab);
+  }
+
+  virtual void on_commit(WAL &log) override {
+    for (size_t i = 0; i < touched.size(); i++)
+      this->log(node_id, this->node_seg, touched[i],
+                &frame(touched[i])->node, sizeof(Node));
+    pack_touched(true);
+    if (changed) {
+      // the pools are not logged: positions freed since the last checkpoint
+      // are leaked after a crash (vacuum reclaims them)
+      string head = this->header(false);
+      this->log(tree_id, this->tree_seg, 0, head.data(), head.size());
+    }
+    touched.clear(), changed = false;
+  }
+  virtual void on_sync() override { flush_values(wal->durable()); }
+  virtual void on_checkpoint() override {
+    flush_values(size_t(-1));
+    pack_touched(false);
+    pool->drain();
+    pool->for_each(pool_id, [&](auto *f) { flush((Entry *)f); });
+    pool->for_each(slab_id, [&](auto *f) { flush((Slab *)f); });
+    touched.clear(), changed = false;
+    this->sync_files(false); // the database is synced after all the trees
+    save_manifest();
   }
 
 protected:
   virtual void read(Node &x, int pos) override {
-    auto it = cache.find(pos);
-    if (it == cache.end()) { // cache miss
-      BPT<Key, T>::read(x, pos);
-      cache_insert(pos, x);
+    Entry *e = frame(pos);
+    if (!e) { // cache miss
+      read_missed(x, pos, false);
+      cache_insert(pos, x, 0);
     } else { // cache hit
-      x = it->second;
+      x = e->node;
+    }
+  }
+  virtual void read(Node &x) override { CachedBPT::read(x, x.pos); }
+  /**
+   * @brief the cache misses are read together, then cached
+   */
+  virtual void read_many(Node *xs, const int *pos, size_t n) override {
+    vector<size_t> miss;
+    vector<int> miss_pos;
+    for (size_t i = 0; i < n; i++) {
+      if (Entry *e = frame(pos[i]))
+        xs[i] = e->node;
+      else if (!pool->pending(pool_id, pos[i],
+                              [&](const typename Pool::Frame *f) {
+                                xs[i] = static_cast<const Entry *>(f)->node;
+                              }))
+        miss.push_back(i), miss_pos.push_back(pos[i]);
+    }
+    if (miss.size() == n) {
+      BPT<Key, T>::read_many(xs, pos, n);
+    } else if (!miss.empty()) {
+      Node *buf = new Node[miss.size()];
+      BPT<Key, T>::read_many(buf, &miss_pos[0], miss.size());
+      for (size_t i = 0; i < miss.size(); i++)
+        xs[miss[i]] = buf[i];
+      delete[] buf;
     }
+    for (size_t i = 0; i < n; i++)
+      if (!frame(pos[i]))
+        cache_insert(pos[i], xs[i], 0);
+  }
+  /**
+   * @brief O_DIRECT bypasses the page cache, so the leaves that are not cached
+   * yet are read into the pool with one submission instead
+   */
+  virtual void read_ahead(const Node &x, const int *leaves,
+                          size_t n) override {
+    BPT<Key, T>::read_ahead(x, leaves, n);
+    if (!n || !this->direct || this->latches)
+      return;
+    vector<int> miss;
+    for (size_t i = 0; i < n; i++)
+      if (!pool->find(pool_id, leaves[i], false) &&
+          !pool->pending(pool_id, leaves[i], [](auto *) {}))
+        miss.push_back(leaves[i]);
+    if (miss.empty())
+      return;
+    Node *buf = new Node[miss.size()];
+    read_many(buf, &miss[0], miss.size());
+    delete[] buf;
   }
-  virtual void read(Node &x) override { CachedBPT<Key, T>::read(x, x.pos); }
   virtual void write(Node &x, int pos) override {
-    auto it = cache.find(pos);
-    if (it == cache.end()) { // cache miss
-      cache_insert(pos, x);
+    this->latch_node(pos);
+    Entry *e = frame(pos);
+    if (!e) { // cache miss
+      e = cache_insert(pos, x, 0);
     } else { // cache hit
-      it->second = x;
+      pool->set_inner(e, !x.leaf);
+      auto lock = pool->exclusive();
+      e->node = x;
+    }
+    touch(pos, *e);
+  }
+  virtual void write(Node &x) override { CachedBPT::write(x, x.pos); }
+  virtual void read_value(T &x, int pos) override {
+    if (wal) {
+      auto it = values.find(pos);
+      if (it != values.end()) {
+        x = it->second.val;
+        return;
+      }
     }
+    Slab *s = slab(pos);
+    auto lock = pool->exclusive();
+    x = slot(s, pos);
+  }
+  virtual void write_value(T &x, int pos) override {
+    CachedBPT::write_value((const T &)x, pos);
+  }
+  virtual void write_value(const T &x, int pos) override {
+    this->latch_value(pos);
+    if (!wal || this->packed)
+      return cache_value(x, pos);
+    log(value_id, this->value_seg, pos, &x, sizeof(T));
+    hold(values, pos, x);
+  }
+  virtual int read_rc(int off) override {
+    if (wal) {
+      auto it = rcs.find(off);
+      if (it != rcs.end())
+        return it->second.val;
+    }
+    return BPT<Key, T>::read_rc(off);
+  }
+  virtual void write_rc(int off, int cnt) override {
+    if (!wal)
+      return BPT<Key, T>::write_rc(off, cnt);
+    this->cover_rc(off);
+    log(ref_id, this->ref_seg, off, &cnt, sizeof(cnt));
+    hold(rcs, off, cnt);
+  }
+  virtual void read_shared(Node &x, int pos) override {
+    {
+      auto lock = pool->shared();
+      if (auto e = static_cast<const Entry *>(pool->peek(pool_id, pos))) {
+        x = e->node;
+        return;
+      }
+    }
+    read_missed(x, pos, true);
+  }
+  virtual void read_value_shared(T &x, int pos) override {
+    if (wal) {
+      std::shared_lock<std::shared_mutex> lock(held_lock);
+      if (const Held<T> *e = values.peek(pos)) {
+        x = e->val;
+        return;
+      }
+    }
+    int base = slab_of(pos);
+    size_t i = (pos - base) / sizeof(T);
+    bool found = false;
+    auto get = [&](const typename Pool::Frame *f) {
+      auto s = static_cast<const Slab *>(f);
+      if (i < s->n)
+        x = s->vals[i], found = true;
+    };
+    {
+      auto lock = pool->shared();
+      if (auto f = pool->peek(slab_id, base))
+        get(f);
+    }
+    if (!found)
+      pool->pending(slab_id, base, get);
+    if (!found)
+      BPT<Key, T>::read_value_shared(x, pos);
+  }
+  /**
+   * @brief a cached node is not copied; a cache miss on a mapped file is not
+   * cached either, since the mapping can be read directly
+   */
+  virtual const Node *peek(int pos, Node &buf) override {
+    Entry *e = frame(pos);
+    if (e)
+      return &e->node;
+    if (pool->pending(pool_id, pos, [&](const typename Pool::Frame *f) {
+          buf = static_cast<const Entry *>(f)->node;
+        }))
+      return &buf;
+    return BPT<Key, T>::peek(pos, buf);
+  }
+  /**
+   * @brief the cached node itself, which the pool keeps while it is pinned
+   */
+  virtual const Node *pin(int pos) override {
+    if (this->latches)
+      return BPT<Key, T>::pin(pos);
+    Entry *e = frame(pos);
+    if (!e) {
+      Node x;
+      read_missed(x, pos, false);
+      e = cache_insert(pos, x, 0);
+    }
+    e->pins++;
+    return &e->node;
+  }
+  virtual const Node *repin(const Node *x) override {
+    if (this->latches)
+      return BPT<Key, T>::repin(x);
+    static_cast<Entry *>(pool->find(pool_id, x->pos, false))->pins++;
+    return x;
+  }
+  virtual void unpin(const Node *x) override {
+    if (this->latches)
+      return BPT<Key, T>::unpin(x);
+    auto e = pool->find(pool_id, x->pos, false);
+    if (e && e->pins) // not dropped since
+      e->pins--;
   }
-  virtual void write(Node &x) override { CachedBPT<Key, T>::write(x, x.pos); }
 
 public:
-  explicit CachedBPT(string filename, bool retrieve = true)
-      : BPT<Key, T>(filename, retrieve) {}
-  virtual ~CachedBPT() override { flush(); }
+  explicit CachedBPT(string filename, bool retrieve = true,
+                     Storage storage = Storage::MAPPED, bool concurrent = false,
+                     size_t bloom_bits = 0, Index index = Index::TREE,
+                     bool packed = false)
+      : BPT<Key, T>(filename, retrieve, storage, concurrent, bloom_bits,
+                    index, packed),
+        pool(Pool::get()),
+        // a tree in memory has nothing to recover
+        wal(storage == Storage::MEMORY ? nullptr : WAL::get()) {
+    if (!pool)
+      pool = own_pool = new Pool(MEM_CAP, false);
+    pool_id = pool->attach(concurrent);
+    slab_id = pool->attach(concurrent);
+    warm_filename = "./bin/BPT_" + filename + "_warm.bin"; // see BPT
+    if (wal) {
+      auto file = [&](const string &name) {
+        return wal->file(this->db ? this->db->name() : name); // see log()
+      };
+      tree_id = file(this->tree_filename);
+      node_id = file(this->node_filename);
+      value_id = file(this->value_filename);
+      ref_id = file(this->ref_filename);
+      if (packed)
+        page_id = file(this->page_filename);
+      wal->attach(this);
+    }
+    if (retrieve && !this->memory)
+      warm_up();
+  }
+  virtual ~CachedBPT() override {
+    if (wal) {
+      wal->sync();
+      on_checkpoint();
+      wal->detach(this);
+    } else {
+      save_manifest();
+    }
+    flush();
+    pool->detach(pool_id, this->latches);
+    pool->detach(slab_id, this->latches);
+    delete own_pool;
+  }
   virtual void clear() override {
+    if (wal)
+      wal->checkpoint();
     flush();
     BPT<Key, T>::clear();
+    if (wal)
+      this->sync_files();
+  }
+  /**
+   * @brief the nodes and values cached while copying belong to the old files,
+   * so they are dropped without being written back
+   */
+  virtual void vacuum() override {
+    if (wal)
+      wal->checkpoint();
+    flush();
+    BPT<Key, T>::vacuum();
+    pool->drop(pool_id), pool->drop(slab_id);
+    if (wal)
+      this->sync_files(); // the log refers to the new files from now on
   }
 };
 
@@ -0,0 +1,410 @@
+#ifndef _SJTU_DATABASE_HPP_
+#define _SJTU_DATABASE_HPP_
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <mutex>
+#include <shared_mutex>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "WAL.hpp"
+#include "utility.hpp"
+
+/**
+ * @brief one file holding the files of all the trees of a process as named
+ * segments: chunk 0 is the superblock, with the catalog of the segments, and
+ * the other chunks are allocated to the segments as they grow, so that a
+ * position in a segment is translated through its list of chunks (see
+ * extents()); the chunks freed by one segment are reused by any other
+ * the catalog is written alternately into two slots, each with a sequence
+ * number and a checksum, so that a torn write leaves the other one; freed
+ * chunks are reused only after a catalog without them is durable. the lengths
+ * of the segments change with nearly every command, so they are kept apart
+ * with a WAL (constructed before), the changes of the catalog and of the
+ * lengths are logged with the commands that made them, and the file is synced
+ * once per checkpoint, after all the trees are written back (see sync())
+ * trees find the database through Database::get(); without one, each tree
+ * keeps files of its own
+ */
+class Database : private WAL::Client {
+public:
+  static constexpr size_t CHUNK = 1 << 20; // unit of allocation (1 MB)
+  static constexpr size_t NONE = size_t(-1); // see extents()
+
+private:
+  // chunk 0: two slots for the catalog, then the lengths of the segments
+  static constexpr size_t SLOT = CHUNK / 16 * 7;
+  static constexpr size_t LENS = SLOT * 2;
+  static constexpr size_t MAX_SEGMENTS = (CHUNK - LENS) / sizeof(size_t);
+  static constexpr size_t MAGIC = 0x3130424455544a53ULL; // "SJTUDB01"
+
+  struct Head {
+    size_t magic, seq;
+    size_t len, sum; // of the catalog following the head
+  };
+  struct Segment {
+    string name;
+    size_t len = 0;
+    sjtu::vector<int> chunks; // indexes of its chunks in the file
+    bool resized = false;     // len changed since logged (WAL only)
+  };
+
+  static inline Database *current = nullptr;
+
+  string path;
+  int fd = -1, direct_fd = -1;
+  sjtu::vector<Segment> segs; // ids are indexes, and never change
+  int chunks_num = 1;          // chunks in the file, the superblock included
+  sjtu::vector<int> free_chunks, freed; // reusable, freed since the last sync
+  size_t seq = 0;               // of the last catalog written or logged
+  int slot = 1;                 // slot holding the catalog in the file
+  bool dirty = false;           // catalog changed since written into the file
+  bool unlogged = false;        // catalog changed since logged (WAL only)
+  WAL *wal;
+  int wal_id = -1;
+  // guards the lists of chunks, with which the background writer and
+  // concurrent readers translate positions
+  mutable std::shared_mutex lock;
+
+  string catalog() const {
+    string s;
+    auto put = [&](const auto &x) { s.append((const char *)&x, sizeof(x)); };
+    put(chunks_num), put(segs.size());
+    for (size_t i = 0; i < segs.size(); i++) {
+      put(segs[i].name.size());
+      s += segs[i].name;
+      put(segs[i].chunks.size());
+      for (size_t j = 0; j < segs[i].chunks.size(); j++)
+        put(segs[i].chunks[j]);
+    }
+    return s;
+  }
+  /**
+   * @brief the head and the catalog to be written into the slot other than
+   * the one in the file
+   */
+  string image() {
+    string body = catalog();
+    if (sizeof(Head) + body.size() > SLOT)
+      throw "Error in Database: catalog too large";
+    Head h{MAGIC, ++seq, body.size(), WAL::checksum(body.data(), body.size())};
+    return string((const char *)&h, sizeof(h)) + body;
+  }
+  /**
+   * @brief reads the newest valid catalog and the lengths, or starts a new
+   * database if there is none
+   */
+  void load() {
+    string body;
+    for (int i = 0; i < 2; i++) {
+      Head h;
+      if (pread(fd, &h, sizeof(h), i * SLOT) != sizeof(h) || h.magic != MAGIC ||
+          h.len > SLOT - sizeof(h) || (!body.empty() && h.seq < seq))
+        continue;
+      string s(h.len, '\0');
+      if (pread(fd, s.data(), h.len, i * SLOT + sizeof(h)) != (ssize_t)h.len ||
+          WAL::checksum(s.data(), s.size()) != h.sum)
+        continue;
+      body = s, seq = h.seq, slot = i;
+    }
+    if (body.empty()) { // a new database
+      dirty = unlogged = true;
+    } else {
+      size_t at = 0, n, m;
+      auto get = [&](auto &x) {
+        memcpy((void *)&x, body.data() + at, sizeof(x));
+        at += sizeof(x);
+      };
+      get(chunks_num), get(n);
+      segs.clear();
+      for (size_t i = 0; i < n; i++) {
+        Segment seg;
+        get(m);
+        seg.name = body.substr(at, m), at += m;
+        get(m);
+        for (int c; m--;)
+          get(c), seg.chunks.push_back(c);
+        segs.push_back(seg);
+      }
+    }
+    string lens(segs.size() * sizeof(size_t), '\0'), used(chunks_num, 0);
+    (void)!pread(fd, lens.data(), lens.size(), LENS);
+    for (size_t i = 0; i < segs.size(); i++) {
+      size_t len;
+      memcpy(&len, &lens[i * sizeof(len)], sizeof(len));
+      // lengths newer than the catalog (a crash without a WAL) are cut
+      segs[i].len = min(len, segs[i].chunks.size() * CHUNK);
+      for (size_t j = 0; j < segs[i].chunks.size(); j++)
+        used[segs[i].chunks[j]] = 1;
+    }
+    for (int c = chunks_num - 1; c > 0; c--)
+      if (!used[c])
+        free_chunks.push_back(c);
+    struct stat st;
+    fstat(fd, &st);
+    if ((size_t)st.st_size < chunks_num * CHUNK &&
+        ftruncate(fd, chunks_num * CHUNK) != 0)
+      throw "Error in Database: ftruncate() failed";
+  }
+  /**
+   * @return index of a zero-filled chunk for a segment
+   */
+  int alloc() {
+    if (free_chunks.empty()) {
+      if (ftruncate(fd, (chunks_num + 1) * CHUNK) != 0)
+        throw "Error in Database: ftruncate() failed";
+      return chunks_num++; // a hole in the file
+    }
+    int c = free_chunks.back();
+    free_chunks.pop_back();
+    size_t off = (size_t)c * CHUNK;
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, CHUNK)) {
+      static const char zero[1 << 16] = {};
+      for (size_t i = 0; i < CHUNK; i += sizeof(zero))
+        if (pwrite(fd, zero, sizeof(zero), off + i) != sizeof(zero))
+          throw "Error in Database: pwrite() failed";
+    }
+    return c;
+  }
+
+  virtual void on_commit(WAL &log) override {
+    if (unlogged) {
+      string img = image();
+      log.log(wal_id, (slot ^ 1) * SLOT, img.data(), img.size());
+      unlogged = false;
+    }
+    for (size_t i = 0; i < segs.size(); i++)
+      if (segs[i].resized) {
+        log.log(wal_id, LENS + i * sizeof(size_t), &segs[i].len,
+                sizeof(size_t));
+        segs[i].resized = false;
+      }
+  }
+  virtual void on_sync() override {}
+  virtual void on_checkpoint() override { sync(); }
+
+public:
+  /**
+   * @brief opens the database; must be constructed after the WAL, if any,
+   * and before the trees it holds
+   */
+  explicit Database(const string &name = "./bin/database.bin")
+      : path(name), wal(WAL::get()) {
+    std::filesystem::create_directory("./bin");
+    fd = ::open(name.data(), O_RDWR | O_CREAT, 0644);
+    if (fd == -1)
+      throw "Error in Database: open() failed";
+    load();
+    if (wal) {
+      wal_id = wal->file(path);
+      wal->attach(this);
+    }
+    current = this;
+  }
+  Database(const Database &) = delete;
+  Database &operator=(const Database &) = delete;
+  ~Database() {
+    if (wal)
+      wal->detach(this);
+    sync();
+    if (direct_fd != -1)
+      ::close(direct_fd);
+    ::close(fd);
+    current = nullptr;
+  }
+  /**
+   * @return the database of the process, nullptr if there is none
+   */
+  static Database *get() { return current; }
+  const string &name() const { return path; }
+  /**
+   * @return a descriptor of the file, opened with O_DIRECT if direct (and if
+   * supported)
+   */
+  int handle(bool direct = false) {
+    if (!direct)
+      return fd;
+    if (direct_fd == -1) {
+      direct_fd = ::open(path.data(), O_RDWR | O_DIRECT);
+      if (direct_fd == -1 && errno == EINVAL)
+        direct_fd = ::open(path.data(), O_RDWR);
+      if (direct_fd == -1)
+        throw "Error in Database: open() failed";
+    }
+    return direct_fd;
+  }
+
+  /**
+   * @return id of the segment name, -1 if there is none
+   */
+  int find(const string &name) const {
+    for (size_t i = 0; i < segs.size(); i++)
+      if (segs[i].name == name)
+        return i;
+    return -1;
+  }
+  /**
+   * @return id of the segment name, which is created empty if there is none
+   */
+  int segment(const string &name) {
+    int id = find(name);
+    if (id != -1)
+      return id;
+    if (segs.size() == MAX_SEGMENTS)
+      throw "Error in Database: too many segments";
+    std::unique_lock<std::shared_mutex> guard(lock);
+    Segment seg;
+    seg.name = name;
+    segs.push_back(seg);
+    dirty = unlogged = true;
+    return segs.size() - 1;
+  }
+  size_t size(int id) const { return segs[id].len; }
+  /**
+   * @brief makes sure that the first n bytes of a segment have chunks
+   */
+  void reserve(int id, size_t n) {
+    Segment &s = segs[id];
+    if (s.chunks.size() * CHUNK >= n)
+      return;
+    std::unique_lock<std::shared_mutex> guard(lock);
+    while (s.chunks.size() * CHUNK < n)
+      s.chunks.push_back(alloc());
+    dirty = unlogged = true;
+  }
+  /**
+   * @brief sets the length of a segment, allocating chunks for it (chunks
+   * are not freed, see trim())
+   */
+  void resize(int id, size_t n) {
+    reserve(id, n);
+    if (segs[id].len != n)
+      segs[id].len = n, segs[id].resized = true;
+  }
+  /**
+   * @brief frees the chunks of a segment after its length
+   */
+  void trim(int id) {
+    Segment &s = segs[id];
+    size_t n = (s.len + CHUNK - 1) / CHUNK;
+    if (s.chunks.size() <= n)
+      return;
+    std::unique_lock<std::shared_mutex> guard(lock);
+    for (; s.chunks.size() > n; s.chunks.pop_back())
+      freed.push_back(s.chunks.back());
+    dirty = unlogged = true;
+  }
+  void truncate(int id) { resize(id, 0), trim(id); }
+  /**
+   * @brief moves the contents of segment from into segment to, whose old
+   * contents are freed; from is left empty
+   */
+  void replace(int from, int to) {
+    truncate(to);
+    std::unique_lock<std::shared_mutex> guard(lock);
+    segs[to].chunks = segs[from].chunks, segs[from].chunks.clear();
+    segs[to].len = segs[from].len, segs[from].len = 0;
+    segs[to].resized = segs[from].resized = true;
+    dirty = unlogged = true;
+  }
+
+  /**
+   * @brief calls f(off, done, n) for each part of [pos, pos + len) of a
+   * segment that is contiguous in the file: off is its position in the file
+   * (NONE if it lies after the chunks of the segment), done its offset in
+   * [0, len) and n its length
+   */
+  template <class Func>
+  void extents(int id, size_t pos, size_t len, Func f) const {
+    std::shared_lock<std::shared_mutex> guard(lock);
+    const sjtu::vector<int> &c = segs[id].chunks;
+    for (size_t done = 0, n; done < len; done += n) {
+      size_t i = (pos + done) / CHUNK, off = NONE;
+      n = CHUNK - (pos + done) % CHUNK;
+      if (i < c.size()) {
+        off = (size_t)c[i] * CHUNK + CHUNK - n;
+        for (; i + 1 < c.size() && c[i + 1] == c[i] + 1 && n < len - done; i++)
+          n += CHUNK;
+      }
+      n = min(n, len - done);
+      f(off, done, n);
+    }
+  }
+  /**
+   * @brief reads [pos, pos + n) of a segment into p (zeros after its chunks)
+   */
+  void read(int id, void *p, size_t n, size_t pos) const {
+    extents(id, pos, n, [&](size_t off, size_t done, size_t len) {
+      char *q = (char *)p + done;
+      if (off == NONE)
+        memset(q, 0, len);
+      else if (pread(fd, q, len, off) != (ssize_t)len)
+        throw "Error in Database: pread() failed";
+    });
+  }
+  /**
+   * @brief writes p into [pos, pos + n) of a segment, extending it if needed
+   */
+  void write(int id, const void *p, size_t n, size_t pos) {
+    if (pos + n > size(id))
+      resize(id, pos + n);
+    extents(id, pos, n, [&](size_t off, size_t done, size_t len) {
+      if (pwrite(fd, (const char *)p + done, len, off) != (ssize_t)len)
+        throw "Error in Database: pwrite() failed";
+    });
+  }
+  /**
+   * @return the contents of segment name (empty if there is none)
+   */
+  string load(const string &name) const {
+    int id = find(name);
+    string s(id == -1 ? 0 : size(id), '\0');
+    if (!s.empty())
+      read(id, s.data(), s.size(), 0);
+    return s;
+  }
+  /**
+   * @brief replaces the contents of segment name as a whole: a crash leaves
+   * either the old contents or the new ones, once the catalog is durable
+   */
+  void store(const string &name, const string &data) {
+    int tmp = segment(name + ".tmp");
+    truncate(tmp);
+    write(tmp, data.data(), data.size(), 0);
+    replace(tmp, segment(name));
+  }
+
+  /**
+   * @brief makes the segments durable: the data first, then the lengths and
+   * the catalog, after which the freed chunks may be reused
+   * with a WAL, this is called by checkpoints; a call at any other time must
+   * follow a checkpoint, so that no catalog logged before it is replayed
+   */
+  void sync() {
+    if (fsync(fd) != 0)
+      throw "Error in Database: fsync() failed";
+    string lens;
+    for (size_t i = 0; i < segs.size(); i++)
+      lens.append((const char *)&segs[i].len, sizeof(size_t));
+    if (pwrite(fd, lens.data(), lens.size(), LENS) != (ssize_t)lens.size())
+      throw "Error in Database: pwrite() failed";
+    if (dirty) {
+      string img = image();
+      slot ^= 1;
+      if (pwrite(fd, img.data(), img.size(), slot * SLOT) !=
+          (ssize_t)img.size())
+        throw "Error in Database: pwrite() failed";
+      dirty = false;
+    }
+    if (fsync(fd) != 0)
+      throw "Error in Database: fsync() failed";
+    for (size_t i = 0; i < freed.size(); i++)
+      free_chunks.push_back(freed[i]);
+    freed.clear();
+  }
+};
+
+#endif
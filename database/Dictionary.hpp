@@ -0,0 +1,52 @@
+#ifndef _SJTU_DICTIONARY_HPP_
+#define _SJTU_DICTIONARY_HPP_
+
+#include "CachedBPT.hpp"
+
+/**
+ * @brief interns names: every name gets a dense id (0, 1, 2, ... in the order
+ * they are first seen), so that records hold and compare ids, and names are
+ * looked up only to be printed
+ * ids are never reused, and names are never removed until clear() (not even
+ * by restoring a snapshot), so ids held anywhere stay valid; the names are
+ * saved in a tree keyed by id, and kept in memory with an index by hash
+ */
+template <class Str> class Dictionary {
+  CachedBPT<int, Str> names; // key: id
+  sjtu::vector<Str> all;     // the names by id
+  Hashmap<ID, int> ids;      // key: hash of a name
+
+public:
+  explicit Dictionary(const string &filename, bool retrieve = true,
+                      Storage storage = Storage::MAPPED)
+      : names(filename, retrieve, storage) {
+    for (auto it = names.begin(); it; ++it) // in the order of the ids
+      ids.insert(it.value().hash(), it.key()), all.push_back(it.value());
+  }
+
+  size_t size() const { return all.size(); }
+  /**
+   * @return the id of a name, -1 if it has none
+   */
+  int find(const Str &s) const {
+    const int *id = ids.peek(s.hash());
+    return id ? *id : -1;
+  }
+  /**
+   * @return the id of a name, which gets a new one if it has none
+   */
+  int intern(const Str &s) {
+    int id = find(s);
+    if (id != -1)
+      return id;
+    id = all.size();
+    names.insert(id, s), ids.insert(s.hash(), id), all.push_back(s);
+    return id;
+  }
+  const Str &operator[](int id) const { return all[id]; }
+
+  void clear() { names.clear(), ids.clear(), all.clear(); }
+  void vacuum() { names.vacuum(); }
+};
+
+#endif
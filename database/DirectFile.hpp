@@ -0,0 +1,430 @@
+#ifndef _SJTU_DIRECT_FILE_HPP_
+#define _SJTU_DIRECT_FILE_HPP_
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <mutex>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "Database.hpp"
+#include "PageStore.hpp"
+#include "utility.hpp"
+
+/**
+ * @brief a minimal io_uring (without liburing): operations are prepared in
+ * the submission queue, then submitted together by one system call
+ * if the kernel does not allow io_uring, ok() is false and the file falls
+ * back to pread/pwrite
+ */
+class IoRing {
+  int fd = -1;
+  unsigned depth = 0;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  io_uring_sqe *sqes = (io_uring_sqe *)MAP_FAILED;
+  io_uring_cqe *cqes;
+  void *sq_ptr = MAP_FAILED, *cq_ptr = MAP_FAILED;
+  size_t sq_len = 0, cq_len = 0, sqes_len = 0;
+  unsigned queued = 0, inflight = 0; // prepared, submitted and not reaped
+
+  static unsigned *field(void *ring, unsigned off) {
+    return (unsigned *)((char *)ring + off);
+  }
+
+public:
+  IoRing() {}
+  IoRing(const IoRing &) = delete;
+  IoRing &operator=(const IoRing &) = delete;
+  ~IoRing() { close(); }
+
+  /**
+   * @return false if io_uring is not available
+   */
+  bool init(unsigned depth_) {
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    fd = syscall(__NR_io_uring_setup, depth_, &p);
+    if (fd < 0)
+      return false;
+    depth = p.sq_entries;
+    sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_len = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    sqes_len = p.sq_entries * sizeof(io_uring_sqe);
+    sq_ptr = mmap(nullptr, sq_len, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    cq_ptr = mmap(nullptr, cq_len, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    sqes = (io_uring_sqe *)mmap(nullptr, sqes_len, PROT_READ | PROT_WRITE,
+                                MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sq_ptr == MAP_FAILED || cq_ptr == MAP_FAILED || sqes == MAP_FAILED) {
+      close();
+      return false;
+    }
+    sq_head = field(sq_ptr, p.sq_off.head);
+    sq_tail = field(sq_ptr, p.sq_off.tail);
+    sq_mask = field(sq_ptr, p.sq_off.ring_mask);
+    sq_array = field(sq_ptr, p.sq_off.array);
+    cq_head = field(cq_ptr, p.cq_off.head);
+    cq_tail = field(cq_ptr, p.cq_off.tail);
+    cq_mask = field(cq_ptr, p.cq_off.ring_mask);
+    cqes = (io_uring_cqe *)((char *)cq_ptr + p.cq_off.cqes);
+    return true;
+  }
+  void close() {
+    if (fd == -1)
+      return;
+    if (sq_ptr != MAP_FAILED)
+      munmap(sq_ptr, sq_len);
+    if (cq_ptr != MAP_FAILED)
+      munmap(cq_ptr, cq_len);
+    if (sqes != MAP_FAILED)
+      munmap(sqes, sqes_len);
+    ::close(fd);
+    fd = -1, sq_ptr = cq_ptr = MAP_FAILED;
+    sqes = (io_uring_sqe *)MAP_FAILED;
+  }
+  bool ok() const { return fd != -1; }
+  /**
+   * @return whether another operation can be prepared without wait()
+   */
+  bool full() const { return queued + inflight == depth; }
+
+  /**
+   * @brief prepares a read (IORING_OP_READ) or a write of len bytes at off
+   */
+  void prep(int op, int file, void *buf, unsigned len, size_t off) {
+    unsigned tail = *sq_tail, idx = tail & *sq_mask;
+    io_uring_sqe &e = sqes[idx];
+    memset(&e, 0, sizeof(e));
+    e.opcode = op, e.fd = file;
+    e.addr = (unsigned long)buf, e.len = len, e.off = off;
+    e.user_data = len; // checked on completion
+    sq_array[idx] = idx;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    queued++;
+  }
+  /**
+   * @brief submits the prepared operations and waits until all the submitted
+   * ones are complete
+   * @param allow_short = true: an operation may transfer fewer bytes than
+   * asked (a read beyond the end of the file)
+   * @return false if any of them failed
+   */
+  bool wait(bool allow_short = false) {
+    bool good = true;
+    while (queued || inflight) {
+      unsigned n = queued;
+      int ret = syscall(__NR_io_uring_enter, fd, n, 1, IORING_ENTER_GETEVENTS,
+                        nullptr, 0);
+      if (ret < 0) {
+        if (errno == EINTR)
+          continue;
+        throw "Error in IoRing: io_uring_enter() failed";
+      }
+      queued -= ret, inflight += ret;
+      unsigned head = *cq_head;
+      while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+        const io_uring_cqe &c = cqes[head & *cq_mask];
+        if (c.res < 0 || (!allow_short && (unsigned)c.res != c.user_data))
+          good = false;
+        head++, inflight--;
+      }
+      __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    }
+    return good;
+  }
+};
+
+/**
+ * @brief a file accessed with O_DIRECT in PAGE-aligned units, bypassing the
+ * page cache of the kernel (the nodes are cached by BufferPool instead)
+ * records of at least half a page are padded to whole pages, so that they are
+ * read and written alone; smaller ones are packed, and written by
+ * read-modify-write of their pages
+ * several reads are submitted together by read_many(), and writes can be
+ * queued by write_async() until wait(); reads and writes have separate rings,
+ * so that a background writer does not wait for readers
+ * if O_DIRECT is not supported (e.g. tmpfs), the file is opened without it
+ * the file may also be a segment of a Database: I/O is then split where the
+ * pages are not contiguous in the file of the database
+ */
+class DirectFile : public PageStore {
+public:
+  static constexpr size_t PAGE = 4096;
+  static constexpr unsigned DEPTH = 64; // operations submitted at once
+
+private:
+  int fd = -1;
+  size_t len = 0;    // logical size
+  size_t record = 0; // size of a record (0: unknown, packed)
+  IoRing reads, writes;
+  std::mutex read_lock, write_lock;
+  sjtu::vector<char *> writing; // buffers of the queued writes
+  Database *db = nullptr;       // holding the file as segment seg, if any
+  int seg = -1;
+
+  static size_t down(size_t x) { return x / PAGE * PAGE; }
+  static size_t up(size_t x) { return (x + PAGE - 1) / PAGE * PAGE; }
+  static char *alloc(size_t n) {
+    void *p = nullptr;
+    if (posix_memalign(&p, PAGE, n) != 0)
+      throw "Error in DirectFile: out of memory";
+    return (char *)p;
+  }
+  bool padded() const { return record >= PAGE / 2; }
+
+  /**
+   * @brief calls f(at, done, len) for each part of [off, off + n) that is
+   * contiguous in fd, at being its position there (see Database::extents())
+   */
+  template <class Func> void parts(size_t off, size_t n, Func f) {
+    if (db)
+      db->extents(seg, off, n, f);
+    else
+      f(off, 0, n);
+  }
+  /**
+   * @brief reads whole pages [off, off + n) into buf (aligned), zero-filling
+   * what lies beyond the end of the file
+   */
+  void read_pages(char *buf, size_t n, size_t off) {
+    parts(off, n, [&](size_t at, size_t skip, size_t len) {
+      size_t done = 0;
+      while (at != Database::NONE && done < len) {
+        ssize_t r = pread(fd, buf + skip + done, len - done, at + done);
+        if (r < 0)
+          throw "Error in DirectFile: pread() failed";
+        if (r == 0)
+          break;
+        done += r;
+      }
+      memset(buf + skip + done, 0, len - done);
+    });
+  }
+  void write_pages(const char *buf, size_t n, size_t off) {
+    parts(off, n, [&](size_t at, size_t skip, size_t len) {
+      if (at == Database::NONE ||
+          pwrite(fd, buf + skip, len, at) != (ssize_t)len)
+        throw "Error in DirectFile: pwrite() failed";
+    });
+  }
+  /**
+   * @brief the whole pages covering [pos, pos + n) in buf, with the record
+   * at buf + pos % PAGE; the padding of a padded record is zero
+   */
+  char *page_image(const void *src, size_t n, size_t pos, size_t &off,
+                   size_t &bytes) {
+    off = down(pos), bytes = up(pos + n) - off;
+    char *buf = alloc(bytes);
+    if (padded() && pos % PAGE == 0)
+      memset(buf + n, 0, bytes - n);
+    else
+      read_pages(buf, bytes, off); // shares its pages with other records
+    memcpy(buf + pos - off, src, n);
+    return buf;
+  }
+
+public:
+  DirectFile() {}
+  DirectFile(const DirectFile &) = delete;
+  DirectFile &operator=(const DirectFile &) = delete;
+  ~DirectFile() { close(); }
+
+  /**
+   * @param record_ size of the records stored in the file
+   * @param trunc = true: discard old data
+   * @param cached = true: go through the page cache all the same (for the
+   * files whose records are not cached by the process)
+   */
+  void open(const string &name, size_t record_, bool trunc = false,
+            bool cached = false) {
+    close();
+    int flags = O_RDWR | O_CREAT | (trunc ? O_TRUNC : 0);
+    fd = ::open(name.data(), flags | (cached ? 0 : O_DIRECT), 0644);
+    if (fd == -1 && errno == EINVAL)
+      fd = ::open(name.data(), flags, 0644);
+    if (fd == -1)
+      throw "Error in DirectFile: open() failed";
+    struct stat st;
+    fstat(fd, &st);
+    len = st.st_size, record = record_;
+    if (!reads.ok() && reads.init(DEPTH))
+      writes.init(DEPTH);
+  }
+  /**
+   * @brief opens segment seg of a database instead of a file of its own
+   */
+  void open(Database &db_, int seg_, size_t record_, bool trunc = false,
+            bool cached = false) {
+    close();
+    db = &db_, seg = seg_, fd = db->handle(!cached);
+    if (trunc)
+      db->truncate(seg);
+    len = db->size(seg), record = record_;
+    if (!reads.ok() && reads.init(DEPTH))
+      writes.init(DEPTH);
+  }
+  virtual void close() override {
+    if (fd == -1)
+      return;
+    wait();
+    if (db) {
+      db->resize(seg, len), db->trim(seg);
+    } else {
+      (void)!ftruncate(fd, len); // drop the padding after the last record
+      ::close(fd);
+    }
+    fd = -1, len = 0, db = nullptr;
+  }
+  bool is_open() const { return fd != -1; }
+  virtual size_t size() const override { return len; }
+  /**
+   * @return the space a record takes in the file (see append())
+   */
+  size_t stride() const { return padded() ? up(record) : record; }
+
+  /**
+   * @brief reserves space for a record of n bytes at the end of the file
+   * @return position of the reserved space (zero-filled)
+   */
+  virtual size_t append(size_t n) override {
+    if (padded())
+      len = up(len), n = up(n);
+    size_t pos = len;
+    len += n;
+    if (db)
+      db->resize(seg, len);
+    return pos;
+  }
+
+  /**
+   * @brief reads n bytes at pos (those past the end of the file as zeros)
+   */
+  virtual void read(void *dst, size_t n, size_t pos) override {
+    size_t k = pos < len ? min(n, len - pos) : 0;
+    memset((char *)dst + k, 0, n - k);
+    if (k)
+      read_many(1, &dst, k, &pos);
+  }
+  /**
+   * @brief hints that [pos, pos + n) is about to be read (only effective if
+   * the file goes through the page cache)
+   */
+  virtual void will_need(size_t pos, size_t n) override {
+    if (fd == -1)
+      return;
+    parts(pos, n, [&](size_t at, size_t, size_t len) {
+      if (at != Database::NONE)
+        posix_fadvise(fd, at, len, POSIX_FADV_WILLNEED);
+    });
+  }
+  /**
+   * @brief reads cnt records of n bytes at pos[i] into dst[i], submitting
+   * them together
+   */
+  virtual void read_many(size_t cnt, void *const *dst, size_t n,
+                         const size_t *pos) override {
+    std::lock_guard<std::mutex> lock(read_lock);
+    for (size_t l = 0; l < cnt; l += DEPTH) {
+      size_t r = min(cnt, l + DEPTH), total = 0;
+      for (size_t i = l; i < r; i++)
+        total += up(pos[i] + n) - down(pos[i]);
+      char *buf = alloc(total), *p = buf;
+      if (reads.ok()) {
+        memset(buf, 0, total); // reads beyond the end of the file are short
+        bool good = true;
+        for (size_t i = l; i < r; i++) {
+          size_t bytes = up(pos[i] + n) - down(pos[i]);
+          parts(down(pos[i]), bytes, [&](size_t at, size_t skip, size_t len) {
+            if (at == Database::NONE)
+              return;
+            if (reads.full())
+              good &= reads.wait(true);
+            reads.prep(IORING_OP_READ, fd, p + skip, len, at);
+          });
+          p += bytes;
+        }
+        if (!reads.wait(true) || !good)
+          throw "Error in DirectFile: read failed";
+      } else {
+        for (size_t i = l; i < r; i++) {
+          size_t bytes = up(pos[i] + n) - down(pos[i]);
+          read_pages(p, bytes, down(pos[i]));
+          p += bytes;
+        }
+      }
+      p = buf;
+      for (size_t i = l; i < r; i++) {
+        memcpy(dst[i], p + pos[i] % PAGE, n);
+        p += up(pos[i] + n) - down(pos[i]);
+      }
+      free(buf);
+    }
+  }
+  virtual void write(const void *src, size_t n, size_t pos) override {
+    std::lock_guard<std::mutex> lock(write_lock);
+    size_t off, bytes;
+    char *buf = page_image(src, n, pos, off, bytes);
+    write_pages(buf, bytes, off);
+    free(buf);
+  }
+  /**
+   * @brief queues a write, which is complete after wait(); only a padded
+   * record has pages of its own, others are written at once
+   */
+  virtual void write_async(const void *src, size_t n,
+                           size_t pos) override {
+    std::lock_guard<std::mutex> lock(write_lock);
+    size_t off, bytes;
+    char *buf = page_image(src, n, pos, off, bytes);
+    if (!writes.ok() || !padded() || pos % PAGE) {
+      write_pages(buf, bytes, off);
+      free(buf);
+      return;
+    }
+    parts(off, bytes, [&](size_t at, size_t skip, size_t len) {
+      if (at == Database::NONE)
+        throw "Error in DirectFile: write beyond the segment";
+      if (writes.full())
+        wait_writes();
+      writes.prep(IORING_OP_WRITE, fd, buf + skip, len, at);
+    });
+    writing.push_back(buf);
+  }
+  /**
+   * @brief waits for the writes queued by write_async()
+   */
+  virtual void wait() override {
+    std::lock_guard<std::mutex> lock(write_lock);
+    wait_writes();
+  }
+
+  /**
+   * @brief makes the file durable
+   */
+  virtual void sync() override {
+    wait();
+    if (fd != -1 && fsync(fd) != 0)
+      throw "Error in DirectFile: sync failed";
+  }
+
+private:
+  void wait_writes() {
+    if (writing.empty())
+      return;
+    bool good = writes.wait();
+    for (size_t i = 0; i < writing.size(); i++)
+      free(writing[i]);
+    writing.clear();
+    if (!good)
+      throw "Error in DirectFile: write failed";
+  }
+};
+
+#endif
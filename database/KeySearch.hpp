@@ -0,0 +1,189 @@
+#ifndef _SJTU_KEY_SEARCH_HPP_
+#define _SJTU_KEY_SEARCH_HPP_
+
+#include <climits>
+#include <type_traits>
+#include <utility>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define KEY_SEARCH_AVX2 // kernels are compiled for AVX2, chosen at runtime
+#endif
+
+using std::pair;
+
+/**
+ * @brief flat keys: integers and (nested) pairs of integers, which can be
+ * compared without branches
+ */
+template <class T> struct is_flat_key : std::is_integral<T> {};
+template <class A, class B>
+struct is_flat_key<pair<A, B>>
+    : std::bool_constant<is_flat_key<A>::value && is_flat_key<B>::value> {};
+
+template <class T> inline bool key_eq(const T &a, const T &b) {
+  if constexpr (is_flat_key<T>::value && !std::is_integral<T>::value)
+    return key_eq(a.first, b.first) & key_eq(a.second, b.second);
+  else
+    return a == b;
+}
+/**
+ * @brief a < b, lexicographically for pairs, with & and | instead of && and ||
+ */
+template <class T> inline bool key_less(const T &a, const T &b) {
+  if constexpr (is_flat_key<T>::value && !std::is_integral<T>::value)
+    return key_less(a.first, b.first) |
+           (key_eq(a.first, b.first) & key_less(a.second, b.second));
+  else
+    return a < b;
+}
+
+/**
+ * @brief search in the sorted key array of a node: branchless binary search
+ * in general (with branchless comparison for flat keys)
+ * lower_bound/upper_bound return the index of the first key >= or > x
+ */
+template <class Key> struct BinarySearch {
+  static size_t lower_bound(const Key *a, size_t n, const Key &x) {
+    if (!n)
+      return 0;
+    const Key *base = a;
+    while (n > 1) {
+      size_t half = n >> 1;
+      base = key_less(base[half], x) ? base + half : base; // cmov
+      n -= half;
+    }
+    return base - a + key_less(*base, x);
+  }
+  static size_t upper_bound(const Key *a, size_t n, const Key &x) {
+    if (!n)
+      return 0;
+    const Key *base = a;
+    while (n > 1) {
+      size_t half = n >> 1;
+      base = key_less(x, base[half]) ? base : base + half; // cmov
+      n -= half;
+    }
+    return base - a + !key_less(x, *base);
+  }
+};
+template <class Key> struct KeySearch : BinarySearch<Key> {};
+
+#ifdef KEY_SEARCH_AVX2
+
+inline const bool has_avx2 =
+    (__builtin_cpu_init(), __builtin_cpu_supports("avx2"));
+
+#define AVX2_ __attribute__((target("avx2")))
+
+/**
+ * @brief the 256-bit lanes of a vector, as size_t or int (AVX2 has signed
+ * 64-bit comparison only: size_t lanes get their sign bits flipped)
+ */
+template <class T> struct Lanes;
+template <> struct Lanes<size_t> {
+  static constexpr int FIRSTS = 0x5; // the lanes of pair::first
+  AVX2_ static __m256i flip(__m256i v) {
+    return _mm256_xor_si256(v, _mm256_set1_epi64x(LLONG_MIN));
+  }
+  AVX2_ static __m256i load(const void *p) {
+    return flip(_mm256_loadu_si256((const __m256i *)p));
+  }
+  AVX2_ static __m256i set(size_t lo, size_t hi) {
+    return flip(_mm256_set_epi64x(hi, lo, hi, lo));
+  }
+  AVX2_ static int lt(__m256i a, __m256i b) {
+    return _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(b, a)));
+  }
+  AVX2_ static int eq(__m256i a, __m256i b) {
+    return _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(a, b)));
+  }
+};
+template <> struct Lanes<int> {
+  static constexpr int FIRSTS = 0x55;
+  AVX2_ static __m256i load(const void *p) {
+    return _mm256_loadu_si256((const __m256i *)p);
+  }
+  AVX2_ static __m256i set(int lo, int hi) {
+    return _mm256_set_epi32(hi, lo, hi, lo, hi, lo, hi, lo);
+  }
+  AVX2_ static int lt(__m256i a, __m256i b) {
+    return _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(b, a)));
+  }
+  AVX2_ static int eq(__m256i a, __m256i b) {
+    return _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(a, b)));
+  }
+};
+
+template <class T> const T &lo_(const T &x) { return x; }
+template <class T> const T &hi_(const T &x) { return x; }
+template <class T> const T &lo_(const pair<T, T> &x) { return x.first; }
+template <class T> const T &hi_(const pair<T, T> &x) { return x.second; }
+
+/**
+ * @brief counts the keys < x (or <= x if le) among the W keys from a, all of
+ * them: keys of type T, or pairs of T (first and second in adjacent lanes)
+ */
+template <class T, size_t W, bool le, class Key>
+AVX2_ inline size_t count_avx2(const Key *a, const Key &x) {
+  using L = Lanes<T>;
+  constexpr bool PAIR = sizeof(Key) == 2 * sizeof(T);
+  constexpr size_t STEP = 32 / sizeof(Key); // keys per vector
+  static_assert(W % STEP == 0);
+  __m256i vx = L::set(lo_(x), hi_(x));
+  size_t cnt = 0;
+  for (size_t i = 0; i < W; i += STEP) {
+    __m256i v = L::load(a + i);
+    int lt = L::lt(v, vx), eq = L::eq(v, vx), m = le ? lt | eq : lt;
+    if constexpr (PAIR)
+      m = (lt | (eq & m >> 1)) & L::FIRSTS; // second decides if first ties
+    cnt += __builtin_popcount(m);
+  }
+  return cnt;
+}
+
+/**
+ * @brief the branchless binary search narrows the node to W keys, which are
+ * then compared at once (a node of fewer than W keys is searched as usual);
+ * the kernel takes the W keys from the start of the window, or the last W
+ * keys of the node, all of which are counted
+ */
+template <class Key, class T, size_t W> struct WindowSearch {
+  using Generic = BinarySearch<Key>;
+  template <bool le>
+  AVX2_ static size_t count(const Key *a, size_t n, const Key &x) {
+    const Key *base = a, *end = a + n;
+    while (n > W) {
+      size_t half = n >> 1;
+      bool right = le ? !key_less(x, base[half]) : key_less(base[half], x);
+      base = right ? base + half : base; // cmov
+      n -= half;
+    }
+    base = base + W <= end ? base : end - W;
+    return base - a + count_avx2<T, W, le>(base, x);
+  }
+  static size_t lower_bound(const Key *a, size_t n, const Key &x) {
+    return has_avx2 && n >= W ? count<false>(a, n, x)
+                              : Generic::lower_bound(a, n, x);
+  }
+  static size_t upper_bound(const Key *a, size_t n, const Key &x) {
+    return has_avx2 && n >= W ? count<true>(a, n, x)
+                              : Generic::upper_bound(a, n, x);
+  }
+};
+
+// no kernel for size_t keys: their binary search is as fast (see
+// tests/keysearch.cpp), as 8 of them fill a cache line; ints (the ids of a
+// Dictionary) are twice as dense, and gain from the window like pairs
+template <>
+struct KeySearch<pair<size_t, size_t>>
+    : WindowSearch<pair<size_t, size_t>, size_t, 16> {};
+template <> struct KeySearch<int> : WindowSearch<int, int, 16> {};
+template <>
+struct KeySearch<pair<int, int>> : WindowSearch<pair<int, int>, int, 16> {};
+
+#undef AVX2_
+
+#endif // KEY_SEARCH_AVX2
+
+#endif
@@ -0,0 +1,786 @@
+#ifndef _SJTU_LSM_HPP_
+#define _SJTU_LSM_HPP_
+
+#include <atomic>
+#include <iterator>
+#include <thread>
+
+#include "BPT.hpp"
+#include "WAL.hpp"
+
+/**
+ * @brief log-structured store for data written in no particular key order
+ * and rarely read (e.g. orders, keyed by user): a write goes into the
+ * memtable, a tree in memory, and into the WAL, so that a command appends to
+ * the log instead of dirtying a leaf somewhere in the files; at checkpoints
+ * the memtable is written out as a run, a sorted array of records that never
+ * changes, and runs are merged on another thread (see compact())
+ * a lookup tries the memtable, then the runs from the newest one on, and a
+ * range scan merges them (see iterator). writes are blind: insert() and set()
+ * do not look the key up, and erase() writes a tombstone, which is dropped
+ * when the oldest run is merged
+ * runs are always mapped (MappedFile), as segments of the Database if there
+ * is one; with Storage::MEMORY nothing is written to disk
+ * a snapshot is a list of runs (the memtable is written out first); runs are
+ * deleted once neither the live store nor any snapshot lists them
+ */
+template <class Key, class T, size_t MEMTABLE = 1 << 24>
+class LSM : private WAL::Client {
+  struct Cell {
+    T val;
+    bool dead; // a tombstone
+  };
+  struct Record {
+    Key key;
+    Cell cell;
+  };
+  static constexpr size_t PER_PAGE =
+      sizeof(Record) >= 4096 ? 1 : 4096 / sizeof(Record);
+
+  /**
+   * @brief a run of file run<id>: n records in ascending order of keys, then
+   * the keys of records 0, PER_PAGE, 2 * PER_PAGE, ... (fences), which are
+   * kept in memory, so that a search reads about one page of records
+   */
+  struct Run {
+    int id;
+    size_t n = 0;
+    MappedFile file;
+    sjtu::vector<Key> fences;
+
+    static size_t bound(size_t n) {
+      return n * sizeof(Record) + (n / PER_PAGE + 1) * sizeof(Key);
+    }
+    size_t bytes() const {
+      return n * sizeof(Record) + fences.size() * sizeof(Key);
+    }
+    const Record &at(size_t i) {
+      return *file.template at<Record>(i * sizeof(Record));
+    }
+    /**
+     * @brief appends a record (the file has room for it, see bound())
+     */
+    void push(const Record &r) {
+      if (n % PER_PAGE == 0)
+        fences.push_back(r.key);
+      memcpy((void *)file.at(n++ * sizeof(Record)), (const void *)&r,
+             sizeof(r));
+    }
+    /**
+     * @brief writes the fences after the records
+     */
+    void seal() {
+      for (size_t i = 0; i < fences.size(); i++)
+        memcpy((void *)file.at(n * sizeof(Record) + i * sizeof(Key)),
+               (const void *)&fences[i], sizeof(Key));
+    }
+    /**
+     * @brief reads the fences written by seal()
+     */
+    void load() {
+      size_t m = (n + PER_PAGE - 1) / PER_PAGE;
+      if (file.size() < n * sizeof(Record) + m * sizeof(Key))
+        throw "Error in LSM: a run is damaged";
+      fences.clear();
+      for (size_t i = 0; i < m; i++)
+        fences.push_back(*file.template at<Key>(n * sizeof(Record) +
+                                                i * sizeof(Key)));
+    }
+    /**
+     * @return index of the first record whose key is not before(key), n if
+     * there is none
+     */
+    template <class Before> size_t search(Before before) {
+      size_t l = 0, r = fences.size();
+      while (l < r) {
+        size_t mid = (l + r) / 2;
+        before(fences[mid]) ? l = mid + 1 : r = mid;
+      }
+      if (!l)
+        return 0;
+      size_t lo = (l - 1) * PER_PAGE, hi = min(n, l * PER_PAGE);
+      while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        before(at(mid).key) ? lo = mid + 1 : hi = mid;
+      }
+      return lo;
+    }
+    size_t lower_bound(const Key &k) {
+      return search([&](const Key &x) { return x < k; });
+    }
+    size_t upper_bound(const Key &k) {
+      return search([&](const Key &x) { return !(k < x); });
+    }
+  };
+
+  /**
+   * @brief a merge in progress: the runs in (newest first, consecutive in
+   * live) are merged into out by worker
+   */
+  struct Job {
+    sjtu::vector<Run *> in;
+    Run *out;
+    bool drop_dead; // in ends with the oldest live run
+    std::thread worker;
+    std::atomic<bool> done{false};
+  };
+
+  bool memory;  // storage is MEMORY
+  Database *db; // holding the files as segments (named after them), if any
+  WAL *wal;
+  int log_id = -1, log_seg = -1; // log_file in the WAL, in the database
+  string head_filename, log_filename, run_prefix;
+
+  BPT<Key, Cell> mem; // the memtable
+  size_t mem_count = 0; // keys in the memtable
+  string unlogged;      // records written by the current command (WAL only)
+  size_t log_len = 0;   // bytes of log_file, where the WAL replays records
+
+  sjtu::vector<Run *> runs; // all the runs, listed or not
+  sjtu::vector<Run *> live; // runs of the live store, newest first
+  struct Snapshot {
+    int id;
+    sjtu::vector<Run *> runs; // newest first
+  };
+  sjtu::vector<Snapshot> snaps;
+  Job *job = nullptr;
+  bool holding = false; // no merge starts (the lists of runs are changing)
+  size_t ver = 0;       // incremented by every modification, see iterator
+
+  static Record record(const Key &key, const Cell &cell) {
+    Record r;
+    memset((void *)&r, 0, sizeof(r)); // no stray padding bytes in the log
+    r.key = key, r.cell = cell;
+    return r;
+  }
+  string run_filename(int id) const {
+    return run_prefix + std::to_string(id) + ".bin";
+  }
+  static string load_file(const string &path) {
+    std::ifstream fs(path, ios::binary);
+    return string(std::istreambuf_iterator<char>(fs),
+                  std::istreambuf_iterator<char>());
+  }
+
+  /**
+   * @brief opens the file of a run
+   * @param trunc = true: a new run (an old file of the same id was left by a
+   * crash, and is not listed)
+   */
+  void open_run(Run *r, bool trunc) {
+    if (memory)
+      r->file.open();
+    else if (db)
+      r->file.open(*db, db->segment(run_filename(r->id)), trunc);
+    else
+      r->file.open(run_filename(r->id), trunc);
+  }
+  /**
+   * @return a new empty run, numbered by the smallest unused id (so that a
+   * database does not collect segments)
+   */
+  Run *new_run() {
+    int id = 0;
+    for (bool used = true; used; id += used) {
+      used = false;
+      for (size_t i = 0; i < runs.size(); i++)
+        used |= runs[i]->id == id;
+    }
+    Run *r = new Run;
+    r->id = id;
+    open_run(r, true);
+    runs.push_back(r);
+    return r;
+  }
+  /**
+   * @brief resizes a written run to its contents, and makes it durable before
+   * any list refers to it (a database is synced as a whole, see sync())
+   */
+  void finish_run(Run *r) {
+    r->seal();
+    r->file.resize(r->bytes());
+    if (wal && !db)
+      r->file.sync();
+  }
+  static bool contains(const sjtu::vector<Run *> &vec, const Run *r) {
+    for (size_t i = 0; i < vec.size(); i++)
+      if (vec[i] == r)
+        return true;
+    return false;
+  }
+  bool listed(const Run *r) const {
+    if (contains(live, r) || (job && (job->out == r || contains(job->in, r))))
+      return true;
+    for (size_t i = 0; i < snaps.size(); i++)
+      if (contains(snaps[i].runs, r))
+        return true;
+    return false;
+  }
+  /**
+   * @brief deletes the runs no list refers to; the lists must be durable
+   * first (freed chunks of a database wait for its catalog anyway)
+   */
+  void drop_unlisted() {
+    for (size_t i = runs.size(); i--;) {
+      Run *r = runs[i];
+      if (listed(r))
+        continue;
+      r->file.close();
+      if (db)
+        db->truncate(db->segment(run_filename(r->id)));
+      else if (!memory)
+        std::filesystem::remove(run_filename(r->id));
+      delete r;
+      runs.erase(i);
+    }
+  }
+
+  /**
+   * @brief merges the runs in[0, k) (newest first) into out: the newest
+   * record of a key wins, and tombstones are dropped if drop_dead
+   * out has room for all the records (see Run::bound()); only the files of
+   * the runs are touched, so that it may run on another thread
+   */
+  static void merge(Run *const *in, size_t k, Run *out, bool drop_dead) {
+    sjtu::vector<size_t> pos;
+    for (size_t i = 0; i < k; i++)
+      pos.push_back(0);
+    while (1) {
+      int from = -1;
+      for (size_t i = 0; i < k; i++)
+        if (pos[i] < in[i]->n &&
+            (from == -1 ||
+             in[i]->at(pos[i]).key < in[from]->at(pos[from]).key))
+          from = i;
+      if (from == -1)
+        break;
+      const Record &r = in[from]->at(pos[from]);
+      if (!drop_dead || !r.cell.dead)
+        out->push(r);
+      Key key = r.key;
+      for (size_t i = 0; i < k; i++) // older records of the key are shadowed
+        if (pos[i] < in[i]->n && in[i]->at(pos[i]).key == key)
+          pos[i]++;
+    }
+  }
+  /**
+   * @brief starts merging the newest runs, as long as each next one holds no
+   * more records than the newer ones together: the sizes of the runs then
+   * grow like the bits of a binary counter, so there are O(log n) runs, and
+   * a record is merged O(log n) times. one merge runs at a time
+   */
+  void compact() {
+    if (job || holding || live.size() < 2)
+      return;
+    size_t k = 0, sum = live[0]->n;
+    for (size_t j = 1; j < live.size(); sum += live[j++]->n)
+      if (live[j]->n <= sum)
+        k = j + 1;
+    if (!k)
+      return;
+    job = new Job;
+    size_t total = 0;
+    for (size_t i = 0; i < k; i++)
+      job->in.push_back(live[i]), total += live[i]->n;
+    job->drop_dead = k == live.size();
+    job->out = new_run();
+    job->out->file.append(Run::bound(total)); // mapped here, written there
+    Job *j = job;
+    j->worker = std::thread([j]() {
+      merge(&j->in[0], j->in.size(), j->out, j->drop_dead);
+      j->done.store(true, std::memory_order_release);
+    });
+  }
+  /**
+   * @brief waits for the merge in progress, whose run takes the place of its
+   * inputs in live
+   */
+  void finish_job() {
+    if (!job)
+      return;
+    job->worker.join();
+    Run *out = job->out;
+    finish_run(out);
+    size_t i = 0, k = job->in.size();
+    while (i < live.size() && live[i] != job->in[0])
+      i++;
+    if (i + k <= live.size()) { // flushes only add runs before the inputs
+      for (size_t j = 0; j < k; j++)
+        live.erase(i);
+      if (out->n)
+        live.insert(i, out);
+    }
+    delete job;
+    job = nullptr, ver++;
+  }
+
+  /**
+   * @brief writes the memtable out as the newest run
+   */
+  void flush() {
+    if (mem.empty())
+      return;
+    bool drop_dead = live.empty(); // nothing older to shadow
+    Run *r = new_run();
+    r->file.append(Run::bound(mem_count));
+    for (auto it = mem.begin(); it; ++it)
+      if (!drop_dead || !it.value().dead)
+        r->push(record(it.key(), it.value()));
+    finish_run(r);
+    if (r->n)
+      live.insert(0, r);
+    mem.clear();
+    mem_count = 0, unlogged.clear(), ver++;
+  }
+  /**
+   * @brief empties log_file (the memtable has been written out)
+   */
+  void truncate_log() {
+    log_len = 0;
+    if (memory)
+      return;
+    if (db)
+      return db->truncate(log_seg);
+    if (!std::filesystem::exists(log_filename) ||
+        !std::filesystem::file_size(log_filename))
+      return;
+    std::filesystem::resize_file(log_filename, 0);
+    if (wal)
+      fsync_path(log_filename); // the WAL replays records at offsets from 0
+  }
+  /**
+   * @brief the lists of runs: (id, number of records) of each listed run,
+   * the ids of the live runs, then the id and the runs of each snapshot
+   */
+  string manifest() {
+    std::ostringstream fs;
+    sjtu::vector<pair<int, size_t>> metas;
+    sjtu::vector<int> ids;
+    for (size_t i = 0; i < runs.size(); i++)
+      if (listed(runs[i]) && (!job || runs[i] != job->out))
+        metas.push_back(pair<int, size_t>(runs[i]->id, runs[i]->n));
+    for (size_t i = 0; i < live.size(); i++)
+      ids.push_back(live[i]->id);
+    size_t m = snaps.size();
+    write_flow_(fs, metas, ids, m);
+    for (size_t i = 0; i < m; i++) {
+      ids.clear();
+      for (size_t j = 0; j < snaps[i].runs.size(); j++)
+        ids.push_back(snaps[i].runs[j]->id);
+      write_flow_(fs, snaps[i].id, ids);
+    }
+    return fs.str();
+  }
+  /**
+   * @brief replaces head_file as a whole (durably if logged; a database
+   * keeps it with its catalog)
+   */
+  void save_manifest() {
+    if (memory)
+      return;
+    string s = manifest();
+    if (db)
+      return db->store(head_filename, s);
+    string tmp = head_filename + ".tmp";
+    {
+      fstream fs(tmp, ios::out | ios::binary | ios::trunc);
+      fs.write(s.data(), s.size());
+    }
+    if (wal)
+      fsync_path(tmp);
+    std::filesystem::rename(tmp, head_filename);
+  }
+  Run *run_of(int id) {
+    for (size_t i = 0; i < runs.size(); i++)
+      if (runs[i]->id == id)
+        return runs[i];
+    throw "Error in LSM: a listed run does not exist";
+  }
+  /**
+   * @brief opens the runs listed in head_file, and replays log_file (records
+   * written by the commands since the last checkpoint, put there by the WAL
+   * after a crash) into the memtable
+   */
+  void open(bool retrieve) {
+    if (memory)
+      return;
+    string head, log;
+    if (db)
+      log_seg = db->segment(log_filename);
+    if (retrieve) {
+      head = db ? db->load(head_filename) : load_file(head_filename);
+      log = db ? db->load(log_filename) : load_file(log_filename);
+    }
+    std::istringstream fs(head);
+    sjtu::vector<pair<int, size_t>> metas;
+    sjtu::vector<int> ids;
+    size_t m = 0;
+    read_flow_(fs, metas, ids, m);
+    for (size_t i = 0; i < metas.size(); i++) {
+      Run *r = new Run;
+      r->id = metas[i].first, r->n = metas[i].second;
+      open_run(r, false);
+      r->load();
+      runs.push_back(r);
+    }
+    for (size_t i = 0; i < ids.size(); i++)
+      live.push_back(run_of(ids[i]));
+    for (size_t i = 0; i < m; i++) {
+      Snapshot snap;
+      read_flow_(fs, snap.id, ids);
+      for (size_t j = 0; j < ids.size(); j++)
+        snap.runs.push_back(run_of(ids[j]));
+      snaps.push_back(snap);
+    }
+    log_len = log.size() / sizeof(Record) * sizeof(Record);
+    for (size_t pos = 0; pos < log_len; pos += sizeof(Record)) {
+      Record r;
+      memcpy((void *)&r, log.data() + pos, sizeof(r));
+      upsert(r.key, r.cell);
+    }
+    if (!retrieve)
+      truncate_log();
+  }
+  /**
+   * @brief writes the memtable out, puts a finished merge in place and starts
+   * the next one (unless closing), saves the lists of runs, empties the log
+   * and deletes the runs no longer listed
+   */
+  void checkpoint(bool closing) {
+    flush();
+    if (job && (closing || job->done.load(std::memory_order_acquire)))
+      finish_job();
+    if (!closing)
+      compact();
+    save_manifest();
+    truncate_log();
+    drop_unlisted();
+  }
+  /**
+   * @brief the lists of runs are about to change outside of a checkpoint:
+   * the merge in progress is finished, and the memtable is written out by a
+   * checkpoint (or directly if not logged)
+   */
+  void begin_change() {
+    finish_job();
+    holding = true;
+    if (wal)
+      wal->checkpoint();
+    else
+      flush();
+    ver++;
+  }
+  /**
+   * @brief makes the changed lists durable (the database is synced, which
+   * may follow the checkpoint of begin_change()), and deletes the runs no
+   * longer listed
+   */
+  void end_change() {
+    holding = false;
+    save_manifest();
+    if (db)
+      db->sync();
+    drop_unlisted();
+    compact();
+  }
+
+  virtual void on_commit(WAL &log) override {
+    if (unlogged.empty())
+      return;
+    if (!db) {
+      log.log(log_id, log_len, unlogged.data(), unlogged.size());
+    } else {
+      db->resize(log_seg, log_len + unlogged.size());
+      db->extents(log_seg, log_len, unlogged.size(),
+                  [&](size_t off, size_t done, size_t len) {
+                    log.log(log_id, off, unlogged.data() + done, len);
+                  });
+    }
+    log_len += unlogged.size();
+    unlogged.clear();
+  }
+  virtual void on_sync() override {}
+  virtual void on_checkpoint() override { checkpoint(false); }
+
+  /**
+   * @brief sets key in the memtable
+   */
+  void upsert(const Key &key, const Cell &cell) {
+    auto it = mem.find(key);
+    if (it) {
+      it.set(cell);
+    } else {
+      mem.insert(key, cell);
+      mem_count++;
+    }
+  }
+  /**
+   * @brief writes key: into the memtable and the log, and the memtable is
+   * written out once it holds MEMTABLE bytes of records (at the next
+   * checkpoint if logged)
+   */
+  void put(const Key &key, const Cell &cell) {
+    upsert(key, cell);
+    ver++;
+    if (wal) {
+      Record r = record(key, cell);
+      unlogged.append((const char *)&r, sizeof(r));
+    }
+    if (mem_count * sizeof(Record) >= MEMTABLE)
+      wal ? wal->request_checkpoint() : checkpoint(false);
+  }
+  size_t find_snapshot(int id) const {
+    size_t i = 0;
+    while (i < snaps.size() && snaps[i].id != id)
+      i++;
+    return i;
+  }
+
+public:
+  /**
+   * @brief position in the merged sources (the memtable and the live runs)
+   * ! modifications other than through set() do not invalidate an iterator,
+   * but make its next move search the key again
+   */
+  class iterator {
+    friend class LSM;
+    LSM *tr = nullptr;
+    bool merged = false; // positioned in every source (not by find())
+    size_t ver = 0;      // of tr when positioned
+    typename BPT<Key, Cell>::iterator mem; // position in the memtable
+    sjtu::vector<size_t> pos;              // positions in tr->live
+    bool ended = true;
+    Key k;
+    Cell cell;
+
+    /**
+     * @brief moves on to the smallest key of the sources, whose value is the
+     * one of the newest source holding it, skipping tombstones
+     */
+    void settle() {
+      while (1) {
+        const Key *least = nullptr;
+        int from = -1; // -1: the memtable
+        if (mem)
+          least = &mem.key();
+        for (size_t i = 0; i < pos.size(); i++) {
+          Run *r = tr->live[i];
+          if (pos[i] < r->n && (!least || r->at(pos[i]).key < *least))
+            least = &r->at(pos[i]).key, from = i;
+        }
+        if (!least) {
+          ended = true;
+          return;
+        }
+        ended = false, k = *least;
+        cell = from == -1 ? mem.value() : tr->live[from]->at(pos[from]).cell;
+        if (!cell.dead)
+          return;
+        skip();
+      }
+    }
+    /**
+     * @brief moves every source past k
+     */
+    void skip() {
+      if (mem && mem.key() == k)
+        ++mem;
+      for (size_t i = 0; i < pos.size(); i++)
+        if (pos[i] < tr->live[i]->n && tr->live[i]->at(pos[i]).key == k)
+          pos[i]++;
+    }
+
+  public:
+    iterator() {}
+    T value() const { return cell.val; }
+    const Key &key() const { return k; }
+    /**
+     * @brief set the value (a write of the key)
+     */
+    void set(const T &val) {
+      cell.val = val;
+      tr->put(k, cell);
+    }
+    /**
+     * @brief ++iter
+     */
+    iterator &operator++() {
+      if (!merged || ver != tr->ver)
+        return *this = tr->upper_bound(k);
+      skip();
+      settle();
+      return *this;
+    }
+    bool operator==(const iterator &rhs) const {
+      return ended == rhs.ended && (ended || k == rhs.k);
+    }
+    bool operator!=(const iterator &rhs) const { return !(*this == rhs); }
+    //! differs from STL
+    operator bool() const { return !ended; }
+  }; // class iterator
+
+private:
+  template <class Seek, class SeekMem> iterator scan(Seek seek, SeekMem at) {
+    iterator it;
+    it.tr = this, it.merged = true, it.ver = ver;
+    it.mem = at();
+    for (size_t i = 0; i < live.size(); i++)
+      it.pos.push_back(seek(live[i]));
+    it.settle();
+    return it;
+  }
+
+public:
+  /**
+   * @param retrieve = false: ignore old data (for debugging)
+   * @param storage MEMORY keeps the store in memory, any other one maps runs
+   */
+  explicit LSM(const string &name, bool retrieve = true,
+               Storage storage = Storage::MAPPED)
+      : memory(storage == Storage::MEMORY),
+        db(memory ? nullptr : Database::get()),
+        wal(memory ? nullptr : WAL::get()),
+        mem("LSM_" + name + "_mem", false, Storage::MEMORY) {
+    if (!memory)
+      std::filesystem::create_directory("./bin");
+    string filename = "./bin/LSM_" + name;
+    head_filename = filename + "_head.bin";
+    log_filename = filename + "_log.bin";
+    run_prefix = filename + "_run";
+    open(retrieve);
+    if (wal) {
+      log_id = wal->file(db ? db->name() : log_filename);
+      wal->attach(this);
+    }
+  }
+  LSM(const LSM &) = delete;
+  LSM &operator=(const LSM &) = delete;
+  virtual ~LSM() override {
+    finish_job();
+    if (wal) {
+      wal->sync();
+      checkpoint(true);
+      wal->detach(this);
+    } else if (!memory) {
+      checkpoint(true);
+    }
+    for (size_t i = 0; i < runs.size(); i++)
+      delete runs[i];
+  }
+
+  iterator begin() {
+    return scan([](Run *) { return size_t(0); }, [&]() { return mem.begin(); });
+  }
+  iterator end() {
+    iterator it;
+    it.tr = this;
+    return it;
+  }
+  /**
+   * @return iterator pointing to key, end() if not found
+   */
+  iterator find(const Key &key) {
+    iterator it = end();
+    if (auto m = mem.find(key)) {
+      it.cell = m.value();
+    } else {
+      size_t i = 0, j = 0;
+      for (; i < live.size(); i++)
+        if ((j = live[i]->lower_bound(key)) < live[i]->n &&
+            live[i]->at(j).key == key)
+          break;
+      if (i == live.size())
+        return it;
+      it.cell = live[i]->at(j).cell;
+    }
+    if (!it.cell.dead)
+      it.ended = false, it.k = key;
+    return it;
+  }
+  iterator lower_bound(const Key &key) {
+    return scan([&](Run *r) { return r->lower_bound(key); },
+                [&]() { return mem.lower_bound(key); });
+  }
+  iterator upper_bound(const Key &key) {
+    return scan([&](Run *r) { return r->upper_bound(key); },
+                [&]() { return mem.upper_bound(key); });
+  }
+
+  /**
+   * @brief writes key, which may exist already (it is not looked up)
+   */
+  void insert(const Key &key, const T &value) { put(key, Cell{value, false}); }
+  void set(const Key &key, const T &value) { put(key, Cell{value, false}); }
+  /**
+   * @brief writes a tombstone of key, which may not exist
+   */
+  void erase(const Key &key) { put(key, Cell{T(), true}); }
+
+  void clear() {
+    begin_change(); // the memtable goes into a run that is then dropped
+    live.clear(), snaps.clear();
+    end_change();
+  }
+  /**
+   * @brief merges the live runs into one, without tombstones
+   */
+  void vacuum() {
+    begin_change();
+    if (!live.empty()) {
+      size_t total = 0;
+      for (size_t i = 0; i < live.size(); i++)
+        total += live[i]->n;
+      Run *r = new_run();
+      r->file.append(Run::bound(total));
+      merge(&live[0], live.size(), r, true);
+      finish_run(r);
+      live.clear();
+      if (r->n)
+        live.push_back(r);
+    }
+    end_change();
+  }
+
+  /**
+   * @brief snapshots list the live runs, after the memtable is written out
+   * throws error if snapshot id already exists
+   */
+  void snapshot(int id) {
+    if (has_snapshot(id))
+      throw "Error in snapshot(): snapshot already exists";
+    begin_change();
+    snaps.push_back(Snapshot{id, live});
+    end_change();
+  }
+  /**
+   * @brief switches the live store to snapshot id, which is kept
+   */
+  void restore(int id) {
+    size_t i = find_snapshot(id);
+    if (i == snaps.size())
+      throw "Error in restore(): snapshot does not exist";
+    begin_change();
+    live = snaps[i].runs;
+    end_change();
+  }
+  void drop_snapshot(int id) {
+    size_t i = find_snapshot(id);
+    if (i == snaps.size())
+      throw "Error in drop_snapshot(): snapshot does not exist";
+    begin_change();
+    snaps.erase(i);
+    end_change();
+  }
+  bool has_snapshot(int id) const { return find_snapshot(id) < snaps.size(); }
+  /**
+   * @return the largest snapshot id, 0 if there is none
+   */
+  int max_snapshot() const {
+    int ret = 0;
+    for (size_t i = 0; i < snaps.size(); i++)
+      ret = std::max(ret, snaps[i].id);
+    return ret;
+  }
+}; // class LSM
+
+#endif
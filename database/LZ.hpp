@@ -0,0 +1,140 @@
+#ifndef _SJTU_LZ_HPP_
+#define _SJTU_LZ_HPP_
+
+#include <cstring>
+
+/**
+ * @brief a small LZ77 codec for pages, in the manner of LZ4: the data is a
+ * series of sequences, each a run of literals followed by a match (a copy of
+ * earlier output), so that runs of zeros and repeated records take a few bytes
+ * a sequence: a token (literal length in the high 4 bits, match length minus
+ * MIN_MATCH in the low 4 bits, 15 meaning that bytes of 255 and a last byte
+ * are added), the literals, then the offset of the match in 2 bytes; the last
+ * sequence has literals only
+ */
+class LZ {
+  static constexpr size_t MIN_MATCH = 4;
+  static constexpr size_t MAX_OFFSET = 65535;
+  static constexpr int HASH_BITS = 12; // entries of the match finder
+
+  static unsigned read32(const char *p) {
+    unsigned x;
+    memcpy(&x, p, sizeof(x));
+    return x;
+  }
+  static size_t hash(unsigned x) { return x * 2654435761u >> (32 - HASH_BITS); }
+  static char *put_len(char *op, size_t n) {
+    for (; n >= 255; n -= 255)
+      *op++ = (char)255;
+    *op++ = (char)n;
+    return op;
+  }
+  /**
+   * @brief writes the sequence of literals [lit, lit + n) followed by a match
+   * of len bytes at off back (none if len = 0)
+   */
+  static char *sequence(char *op, const char *lit, size_t n, size_t off,
+                        size_t len) {
+    size_t ml = len ? len - MIN_MATCH : 0;
+    *op++ = (char)((n < 15 ? n : 15) << 4 | (ml < 15 ? ml : 15));
+    if (n >= 15)
+      op = put_len(op, n - 15);
+    memcpy(op, lit, n);
+    op += n;
+    if (!len)
+      return op;
+    *op++ = (char)(off & 255), *op++ = (char)(off >> 8);
+    if (ml >= 15)
+      op = put_len(op, ml - 15);
+    return op;
+  }
+  [[noreturn]] static void damaged() { throw "Error in LZ: damaged data"; }
+
+public:
+  /**
+   * @return the largest compressed size of n bytes
+   */
+  static size_t bound(size_t n) { return n + n / 255 + 16; }
+
+  /**
+   * @brief compresses src[0, n) into dst, which holds bound(n) bytes
+   * @return the compressed size
+   */
+  static size_t compress(const char *src, size_t n, char *dst) {
+    int table[1 << HASH_BITS];
+    memset(table, -1, sizeof(table)); // every byte set: -1
+    const char *ip = src, *anchor = src, *end = src + n;
+    char *op = dst;
+    while (ip + MIN_MATCH <= end) {
+      unsigned x = read32(ip);
+      int &slot = table[hash(x)], cand = slot;
+      slot = ip - src;
+      if (cand < 0 || size_t(slot - cand) > MAX_OFFSET ||
+          read32(src + cand) != x) {
+        ip++;
+        continue;
+      }
+      const char *m = src + cand;
+      size_t len = MIN_MATCH;
+      for (size_t a, b; ip + len + sizeof(a) <= end; len += sizeof(a)) {
+        memcpy(&a, ip + len, sizeof(a)), memcpy(&b, m + len, sizeof(b));
+        if (a != b)
+          break;
+      }
+      while (ip + len < end && ip[len] == m[len])
+        len++;
+      op = sequence(op, anchor, ip - anchor, ip - m, len);
+      ip += len, anchor = ip;
+    }
+    return sequence(op, anchor, end - anchor, 0, 0) - dst;
+  }
+
+  /**
+   * @brief decompresses src[0, n) into dst[0, out), which it must fill
+   */
+  static void decompress(const char *src, size_t n, char *dst, size_t out) {
+    const unsigned char *ip = (const unsigned char *)src, *end = ip + n;
+    char *op = dst, *oend = dst + out;
+    auto get_len = [&](size_t len) {
+      if (len == 15)
+        for (unsigned char b = 255; b == 255; len += b) {
+          if (ip == end)
+            damaged();
+          b = *ip++;
+        }
+      return len;
+    };
+    while (1) {
+      if (ip == end)
+        damaged();
+      unsigned token = *ip++;
+      size_t lit = get_len(token >> 4);
+      if (lit > size_t(end - ip) || lit > size_t(oend - op))
+        damaged();
+      memcpy(op, ip, lit);
+      op += lit, ip += lit;
+      if (ip == end)
+        break;
+      if (end - ip < 2)
+        damaged();
+      size_t off = ip[0] | ip[1] << 8;
+      ip += 2;
+      size_t len = get_len(token & 15) + MIN_MATCH;
+      if (!off || off > size_t(op - dst) || len > size_t(oend - op))
+        damaged();
+      const char *m = op - off;
+      if (off >= len)
+        memcpy(op, m, len);
+      else if (off == 1)
+        memset(op, *m, len);
+      else
+        for (size_t i = 0; i < len; i++)
+          op[i] = m[i];
+      op += len;
+    }
+    if (op != oend)
+      damaged();
+  }
+};
+
+#endif
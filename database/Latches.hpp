@@ -0,0 +1,90 @@
+#ifndef _SJTU_LATCHES_HPP_
+#define _SJTU_LATCHES_HPP_
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+#include "utility.hpp"
+
+/**
+ * @brief optimistic latches (version locks) of the nodes and values of a
+ * concurrent tree, striped over a fixed table by position
+ * a version is odd while the writer modifies the data it guards; a reader
+ * copies the data between read_lock() and a successful check(), and retries
+ * otherwise, so readers never block the writer or each other
+ * writers are serialized by writer (see begin_write()), and hold every latch
+ * they take until the end of the operation
+ */
+class Latches {
+  static constexpr size_t SLOTS = 1 << 12;
+
+  std::atomic<size_t> ver[SLOTS];
+  sjtu::vector<size_t> held; // slots locked by the current operation
+  std::recursive_mutex writer;
+  size_t depth = 0; // nesting of the current operation
+
+  static size_t slot(size_t key) {
+    return (key * 0x9E3779B97F4A7C15ULL) >> 52; // Fibonacci hashing
+  }
+
+public:
+  std::mutex io; // serializes accesses to fstreams, whose cursors are shared
+
+  Latches() {
+    for (size_t i = 0; i < SLOTS; i++)
+      ver[i].store(0, std::memory_order_relaxed);
+  }
+  Latches(const Latches &) = delete;
+  Latches &operator=(const Latches &) = delete;
+
+  /**
+   * @return version of key, once no writer holds it
+   */
+  size_t read_lock(size_t key) const {
+    const std::atomic<size_t> &v = ver[slot(key)];
+    size_t x;
+    while ((x = v.load(std::memory_order_acquire)) & 1)
+      std::this_thread::yield();
+    return x;
+  }
+  /**
+   * @brief whether the data read since read_lock() returned x is consistent
+   */
+  bool check(size_t key, size_t x) const {
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return ver[slot(key)].load(std::memory_order_relaxed) == x;
+  }
+
+  /**
+   * @brief begins/ends a (possibly nested) modification; the outermost end
+   * releases the latches taken in between
+   */
+  void begin_write() {
+    writer.lock();
+    depth++;
+  }
+  void end_write() {
+    if (!--depth) {
+      for (size_t i = 0; i < held.size(); i++)
+        ver[held[i]].fetch_add(1, std::memory_order_release);
+      held.clear();
+    }
+    writer.unlock();
+  }
+  bool writing() const { return depth; }
+  /**
+   * @brief latches key until the end of the operation, before it is modified
+   */
+  void lock(size_t key) {
+    std::atomic<size_t> &v = ver[slot(key)];
+    size_t x = v.load(std::memory_order_relaxed);
+    if (x & 1)
+      return; // taken by this operation already
+    v.store(x + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    held.push_back(slot(key));
+  }
+};
+
+#endif
@@ -0,0 +1,193 @@
+#ifndef _SJTU_MAPPED_FILE_HPP_
+#define _SJTU_MAPPED_FILE_HPP_
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+
+#include "Database.hpp"
+#include "PageStore.hpp"
+#include "utility.hpp"
+
+/**
+ * @brief a file mapped into memory (mmap), accessed through raw pointers
+ * the mapping grows in large extents inside a fixed range of address space,
+ * so it never moves, and the file is truncated back to its logical size when
+ * closed
+ * the file may also be a segment of a Database, whose chunks are mapped one
+ * after another, so that the segment looks contiguous all the same, or no
+ * file at all: plain memory that is lost when closed (see Storage::MEMORY)
+ */
+class MappedFile : public PageStore {
+  static constexpr size_t EXTENT = 1 << 22; // minimum size of a mapping (4 MB)
+  // address space reserved for a mapping (positions in files are ints)
+  static constexpr size_t RESERVE = size_t(1) << 31;
+
+  int fd = -1; // -1 if in memory
+  char *base = nullptr;
+  size_t len = 0, cap = 0; // logical size, size of the mapping
+  Database *db = nullptr;  // holding the file as segment seg, if any
+  int seg = -1;
+
+  /**
+   * @brief grows the file and the mapping to new_cap bytes, mapping the new
+   * part right after the old one: pointers handed out before stay valid
+   * (concurrent readers may be using them)
+   */
+  void remap(size_t new_cap) {
+    if (new_cap > RESERVE)
+      throw "Error in MappedFile: file too large";
+    if (db) {
+      db->reserve(seg, new_cap);
+      auto map_part = [&](size_t off, size_t at, size_t n) {
+        if (mmap(base + cap + at, n, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_FIXED, fd, off) == MAP_FAILED)
+          throw "Error in MappedFile: mmap() failed";
+      };
+      db->extents(seg, cap, new_cap - cap, map_part);
+      cap = new_cap;
+      return;
+    }
+    if (fd == -1) { // in memory: the reserved pages are made accessible
+      if (mprotect(base + cap, new_cap - cap, PROT_READ | PROT_WRITE) != 0)
+        throw "Error in MappedFile: mprotect() failed";
+      cap = new_cap;
+      return;
+    }
+    if (ftruncate(fd, new_cap) != 0)
+      throw "Error in MappedFile: ftruncate() failed";
+    void *p = mmap(base + cap, new_cap - cap, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_FIXED, fd, cap);
+    if (p == MAP_FAILED)
+      throw "Error in MappedFile: mmap() failed";
+    cap = new_cap;
+  }
+  /**
+   * @brief reserves the address space of the mapping and maps the file
+   */
+  void map_file() {
+    void *p = mmap(nullptr, RESERVE, PROT_NONE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED)
+      throw "Error in MappedFile: mmap() failed";
+    base = (char *)p;
+    remap((len / EXTENT + 1) * EXTENT);
+  }
+
+public:
+  MappedFile() {}
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+  ~MappedFile() { close(); }
+
+  /**
+   * @param trunc = true: discard old data
+   */
+  void open(const string &name, bool trunc = false) {
+    close();
+    fd = ::open(name.data(), O_RDWR | O_CREAT | (trunc ? O_TRUNC : 0), 0644);
+    if (fd == -1)
+      throw "Error in MappedFile: open() failed";
+    struct stat st;
+    fstat(fd, &st);
+    len = st.st_size;
+    map_file();
+  }
+  /**
+   * @brief opens segment seg of a database instead of a file of its own
+   */
+  void open(Database &db_, int seg_, bool trunc = false) {
+    close();
+    db = &db_, seg = seg_, fd = db->handle();
+    if (trunc)
+      db->truncate(seg);
+    len = db->size(seg);
+    map_file();
+  }
+  /**
+   * @brief opens an empty file in memory
+   */
+  void open() {
+    close();
+    len = 0;
+    map_file();
+  }
+  virtual void close() override {
+    if (!base)
+      return;
+    munmap(base, RESERVE);
+    if (db) { // the chunks of the unused part go back to the database
+      db->resize(seg, len), db->trim(seg);
+    } else if (fd != -1) {
+      (void)!ftruncate(fd, len); // drop the unused part of the last extent
+      ::close(fd);
+    }
+    fd = -1, base = nullptr, len = cap = 0, db = nullptr;
+  }
+  bool is_open() const { return base != nullptr; }
+  virtual size_t size() const override { return len; }
+
+  /**
+   * @brief reserves n bytes at the end of the file
+   * @return position of the reserved space
+   */
+  virtual size_t append(size_t n) override {
+    size_t pos = len;
+    if ((len += n) > cap)
+      remap(max(cap << 1, (len / EXTENT + 1) * EXTENT));
+    if (db)
+      db->resize(seg, len);
+    return pos;
+  }
+
+  /**
+   * @brief sets the size of the file to n bytes: grows it like append(), or
+   * drops its end (whose space is released when the file is closed)
+   */
+  void resize(size_t n) {
+    if (n > len)
+      return (void)append(n - len);
+    len = n;
+    if (db)
+      db->resize(seg, len);
+  }
+
+  /**
+   * @brief makes the file durable
+   */
+  virtual void sync() override {
+    if (fd != -1 && (msync(base, len, MS_SYNC) != 0 || fsync(fd) != 0))
+      throw "Error in MappedFile: sync failed";
+  }
+
+  /**
+   * @brief hints that [pos, pos + n) is about to be read, so that the kernel
+   * reads it in asynchronously
+   */
+  virtual void will_need(size_t pos, size_t n) override {
+    if (pos >= len)
+      return;
+    size_t off = pos / 4096 * 4096;
+    madvise(base + off, min(pos + n, len) - off, MADV_WILLNEED);
+  }
+
+  /**
+   * @brief reads n bytes at pos (those past the end of the file as zeros)
+   */
+  virtual void read(void *dst, size_t n, size_t pos) override {
+    size_t k = pos < len ? min(n, len - pos) : 0;
+    memcpy(dst, base + pos, k);
+    memset((char *)dst + k, 0, n - k);
+  }
+  virtual void write(const void *src, size_t n, size_t pos) override {
+    memcpy(base + pos, src, n);
+  }
+  virtual char *map(size_t pos) override { return base + pos; }
+
+  char *at(size_t pos) { return base + pos; }
+  template <class T> T *at(size_t pos) { return (T *)(base + pos); }
+};
+
+#endif
@@ -0,0 +1,248 @@
+#ifndef _SJTU_PACKED_FILE_HPP_
+#define _SJTU_PACKED_FILE_HPP_
+
+#include <istream>
+
+#include "LZ.hpp"
+#include "MappedFile.hpp"
+
+/**
+ * @brief a file of fixed-size pages kept compressed (see LZ): each page is a
+ * blob of the data file, found through the table of pages in another file, so
+ * that a page of mostly padding takes a few units of GRAIN bytes on disk and
+ * in the page cache
+ * a page is rewritten in two steps: pack() compresses it and allocates its
+ * blob, and store() writes the blob and its entry, so that a caller logging
+ * its changes (CachedBPT) logs them in between. a blob stays where it is if
+ * its size in units does not change; freed blobs are reused by blobs of the
+ * same size
+ * both files are mapped whatever the storage of their owner (see MappedFile)
+ */
+class PackedFile : public PageStore {
+public:
+  static constexpr size_t GRAIN = 64; // blobs take whole units of GRAIN bytes
+
+  /**
+   * @brief where the blob of a page is: len = 0 if the page was never written
+   * (zeros), len = the page size if it is stored as is (incompressible)
+   */
+  struct Entry {
+    int pos = 0, len = 0;
+  };
+  /**
+   * @brief a packed page, ready to be stored
+   */
+  struct Blob {
+    size_t page = 0; // index of the page
+    Entry at;
+    string data;
+  };
+
+private:
+  MappedFile data, table;
+  size_t page = 0; // bytes per page
+  size_t len = 0;  // logical size in bytes (see append())
+  sjtu::vector<Entry> where; // the entries as packed, stored or not
+  sjtu::vector<sjtu::vector<int>> pool; // positions of free blobs by units
+  string buf;                           // a decoded page
+
+  static size_t units(size_t n) { return (n + GRAIN - 1) / GRAIN; }
+  int alloc(size_t n) {
+    if (n < pool.size() && !pool[n].empty()) {
+      int pos = pool[n].back();
+      pool[n].pop_back();
+      return pos;
+    }
+    return data.append(n * GRAIN);
+  }
+  void release(const Entry &e) {
+    while (pool.size() <= units(e.len))
+      pool.push_back(sjtu::vector<int>());
+    pool[units(e.len)].push_back(e.pos);
+  }
+  /**
+   * @brief loads the entries of the pages from the table
+   */
+  void load_table(size_t page_) {
+    page = page_, buf.resize(page);
+    where.clear();
+    for (size_t i = 0; i + sizeof(Entry) <= table.size(); i += sizeof(Entry))
+      where.push_back(*table.at<Entry>(i));
+  }
+
+public:
+  PackedFile() {}
+  PackedFile(const PackedFile &) = delete;
+  PackedFile &operator=(const PackedFile &) = delete;
+
+  /**
+   * @param trunc = true: discard old data (the state too, see restore())
+   */
+  void open(size_t page_, const string &data_name, const string &table_name,
+            bool trunc = false) {
+    data.open(data_name, trunc), table.open(table_name, trunc);
+    if (trunc)
+      len = 0, pool.clear();
+    load_table(page_);
+  }
+  /**
+   * @brief opens segments of a database instead of files of their own
+   */
+  void open(size_t page_, Database &db, int data_seg, int table_seg,
+            bool trunc = false) {
+    data.open(db, data_seg, trunc), table.open(db, table_seg, trunc);
+    if (trunc)
+      len = 0, pool.clear();
+    load_table(page_);
+  }
+  /**
+   * @brief opens empty files in memory
+   */
+  void open(size_t page_) {
+    data.open(), table.open();
+    len = 0, pool.clear();
+    load_table(page_);
+  }
+  virtual void close() override {
+    data.close(), table.close(), where.clear();
+  }
+  bool is_open() const { return data.is_open(); }
+  virtual void sync() override { data.sync(), table.sync(); }
+
+  /**
+   * @brief the state kept by the owner (in the header of a tree): the logical
+   * size, and the free blobs unless !pools
+   */
+  string state(bool pools) const {
+    string s;
+    auto put = [&](const auto &x) { s.append((const char *)&x, sizeof(x)); };
+    size_t n = 0;
+    for (size_t i = 0; pools && i < pool.size(); i++)
+      n += pool[i].size();
+    put(len), put(n);
+    for (size_t i = 0; pools && i < pool.size(); i++)
+      for (size_t j = 0; j < pool[i].size(); j++)
+        put(i), put(pool[i][j]);
+    return s;
+  }
+  /**
+   * @brief reads the state written by state() (none leaves the file empty)
+   */
+  void restore(istream &fs) {
+    len = 0, pool.clear();
+    size_t n = 0, u;
+    int pos;
+    fs.read((char *)&len, sizeof(len)), fs.read((char *)&n, sizeof(n));
+    while (fs && n--) {
+      fs.read((char *)&u, sizeof(u)), fs.read((char *)&pos, sizeof(pos));
+      release(Entry{pos, int(u * GRAIN)});
+    }
+  }
+
+  /**
+   * @return position of the entry of page k in the table file
+   */
+  static size_t entry_pos(size_t k) { return k * sizeof(Entry); }
+  /**
+   * @return the size of the pages covering the logical size (see append()),
+   * all of which can be read
+   */
+  virtual size_t size() const override {
+    return (len + page - 1) / page * page;
+  }
+  /**
+   * @brief reserves n bytes at the end of the file (zeros until written)
+   * @return position of the reserved space
+   */
+  virtual size_t append(size_t n) override {
+    size_t pos = len;
+    len += n;
+    return pos;
+  }
+
+  /**
+   * @brief decodes page k as stored into dst[0, page)
+   */
+  void load(size_t k, char *dst) {
+    Entry e;
+    if (entry_pos(k + 1) <= table.size())
+      e = *table.at<Entry>(entry_pos(k));
+    if (!e.len)
+      memset(dst, 0, page);
+    else if (e.pos < 0 || e.len < 0 || size_t(e.pos) + e.len > data.size())
+      throw "Error in PackedFile: a page is damaged";
+    else if (size_t(e.len) == page)
+      memcpy(dst, data.at(e.pos), page);
+    else
+      LZ::decompress(data.at(e.pos), e.len, dst, page);
+  }
+  /**
+   * @brief compresses src[0, page) as the new image of page k, and allocates
+   * its blob (the old one is freed, unless it is reused)
+   */
+  Blob pack(size_t k, const char *src) {
+    Blob b;
+    b.page = k;
+    b.data.resize(LZ::bound(page));
+    size_t n = LZ::compress(src, page, &b.data[0]);
+    if (n >= page)
+      b.data.assign(src, n = page);
+    b.data.resize(n);
+    while (where.size() <= k)
+      where.push_back(Entry());
+    Entry &e = where[k];
+    if (!e.len || units(e.len) != units(n)) {
+      if (e.len)
+        release(e);
+      e.pos = alloc(units(n));
+    }
+    e.len = n, b.at = e;
+    return b;
+  }
+  /**
+   * @brief writes a packed page into the files
+   */
+  void store(const Blob &b) {
+    memcpy(data.at(b.at.pos), b.data.data(), b.data.size());
+    size_t end = entry_pos(b.page + 1);
+    if (end > table.size()) {
+      size_t old = table.size();
+      table.append(end - old);
+      memset(table.at(old), 0, end - old);
+    }
+    write_(table, b.at, entry_pos(b.page));
+  }
+  /**
+   * @brief reads [pos, pos + n), whole pages decoded in place
+   */
+  virtual void read(void *dst, size_t n, size_t pos) override {
+    for (char *p = (char *)dst; n;) {
+      size_t k = pos / page, off = pos % page, m = min(n, page - off);
+      if (m == page) {
+        load(k, p);
+      } else {
+        load(k, &buf[0]);
+        memcpy(p, &buf[off], m);
+      }
+      p += m, pos += m, n -= m;
+    }
+  }
+  /**
+   * @brief writes [pos, pos + n), repacking the pages
+   */
+  virtual void write(const void *src, size_t n, size_t pos) override {
+    for (const char *p = (const char *)src; n;) {
+      size_t k = pos / page, off = pos % page, m = min(n, page - off);
+      if (m == page) {
+        store(pack(k, p));
+      } else {
+        load(k, &buf[0]);
+        memcpy(&buf[off], p, m);
+        store(pack(k, buf.data()));
+      }
+      p += m, pos += m, n -= m;
+    }
+  }
+};
+
+#endif
@@ -0,0 +1,145 @@
+#ifndef _SJTU_PAGE_STORE_HPP_
+#define _SJTU_PAGE_STORE_HPP_
+
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <unistd.h>
+
+#include "utility.hpp"
+
+/**
+ * @brief a file of records (the nodes, values or reference counts of a
+ * tree), as BPT accesses it whatever the Storage: positions are byte offsets,
+ * and the file only grows through append()
+ * implementations: StreamFile (fstream), MappedFile (mmap, or plain memory),
+ * DirectFile (io_uring with O_DIRECT, or pread/pwrite) and PackedFile
+ * (compressed pages); the last three may be segments of a Database
+ */
+class PageStore {
+public:
+  virtual ~PageStore() {}
+
+  virtual void read(void *dst, size_t n, size_t pos) = 0;
+  virtual void write(const void *src, size_t n, size_t pos) = 0;
+  /**
+   * @brief reserves n zero bytes at the end of the file
+   * @return position of the reserved space
+   */
+  virtual size_t append(size_t n) = 0;
+  /**
+   * @return the bytes that can be read from the file
+   */
+  virtual size_t size() const = 0;
+  /**
+   * @brief makes the file durable (a segment is made durable with its
+   * Database instead)
+   */
+  virtual void sync() = 0;
+  virtual void close() = 0;
+
+  /**
+   * @return the byte at pos, if the file is mapped into memory (valid until
+   * the file is closed), nullptr otherwise: then records must be copied out
+   * with read()
+   */
+  virtual char *map(size_t pos) { return nullptr; }
+  /**
+   * @brief hints that [pos, pos + n) is about to be read (ignored by files
+   * that cannot read ahead)
+   */
+  virtual void will_need(size_t pos, size_t n) {}
+  /**
+   * @brief reads cnt records of n bytes at pos[i] into dst[i], at once if
+   * the file can submit several reads together
+   */
+  virtual void read_many(size_t cnt, void *const *dst, size_t n,
+                         const size_t *pos) {
+    for (size_t i = 0; i < cnt; i++)
+      read(dst[i], n, pos[i]);
+  }
+  /**
+   * @brief a write() that may complete as late as the next wait()
+   */
+  virtual void write_async(const void *src, size_t n, size_t pos) {
+    write(src, n, pos);
+  }
+  virtual void wait() {}
+};
+
+/**
+ * @brief makes a file that is accessed in another way (e.g. fstream) durable
+ */
+inline void fsync_path(const string &name) {
+  int fd = ::open(name.data(), O_RDONLY);
+  if (fd == -1 || fsync(fd) != 0)
+    throw "Error in fsync_path(): fsync failed";
+  ::close(fd);
+}
+
+/**
+ * @brief a file accessed through fstream; not thread-safe, unlike the other
+ * implementations (see BPT::io_lock())
+ */
+class StreamFile : public PageStore {
+  mutable std::fstream fs;
+  string name;
+
+public:
+  StreamFile() {}
+  StreamFile(const StreamFile &) = delete;
+  StreamFile &operator=(const StreamFile &) = delete;
+  ~StreamFile() { close(); }
+
+  /**
+   * @param trunc = true: discard old data
+   */
+  void open(const string &name_, bool trunc = false) {
+    close();
+    name = name_;
+    if (trunc || !std::filesystem::exists(name))
+      fs.open(name, ios::out | ios::binary | ios::trunc), fs.close();
+    fs.open(name, ios::in | ios::out | ios::binary);
+    if (!fs)
+      throw "Error in StreamFile: open() failed";
+  }
+  virtual void close() override {
+    if (fs.is_open())
+      fs.close();
+  }
+  virtual void read(void *dst, size_t n, size_t pos) override {
+    fs.seekg(pos);
+    fs.read((char *)dst, n);
+    if (!fs) // beyond the end of the file
+      fs.clear();
+  }
+  virtual void write(const void *src, size_t n, size_t pos) override {
+    fs.seekp(pos);
+    fs.write((const char *)src, n);
+  }
+  virtual size_t append(size_t n) override {
+    static const char zero[4096] = {};
+    fs.seekp(0, ios::end);
+    size_t pos = fs.tellp();
+    for (size_t k; n; n -= k) // allocated even if writes are delayed
+      k = min(n, sizeof(zero)), fs.write(zero, k);
+    return pos;
+  }
+  virtual size_t size() const override {
+    fs.seekg(0, ios::end);
+    return fs.tellg();
+  }
+  virtual void sync() override {
+    fs.flush();
+    fsync_path(name);
+  }
+};
+
+template <class T> inline void read_(PageStore &ps, T &x, int pos) {
+  ps.read((void *)&x, sizeof(x), pos);
+}
+template <class T> inline void write_(PageStore &ps, const T &x, int pos) {
+  ps.write((const void *)&x, sizeof(x), pos);
+}
+
+#endif
@@ -0,0 +1,175 @@
+#ifndef _SJTU_REPLACEMENT_POLICY_HPP_
+#define _SJTU_REPLACEMENT_POLICY_HPP_
+
+#include "Hashmap.hpp"
+
+/**
+ * @brief replacement policies of BufferPool, which keep the resident frames in
+ * intrusive lists through PoolHook
+ * a policy provides:
+ *   insert(x): x becomes resident
+ *   access(x): x is hit
+ *   erase(x):  x is dropped without being chosen as a victim
+ *   victim(evict): chooses a frame for which evict(x) returns true, and
+ *                  removes it; nullptr if every frame is refused
+ *   size():    number of resident frames
+ * only the thread modifying the pool calls them
+ */
+
+struct PoolHook {
+  PoolHook *prev = nullptr, *next = nullptr;
+  size_t key = 0;   // (file, position), set by the pool
+  bool ref = false; // CLOCK: referenced since the hand last passed
+  bool main = false; // 2Q: in the main queue
+};
+
+/**
+ * @brief circular doubly linked list of PoolHooks, with a sentinel
+ */
+class PoolList {
+  PoolHook head;
+  size_t n = 0;
+
+public:
+  PoolList() { head.prev = head.next = &head; }
+  PoolList(const PoolList &) = delete;
+  PoolList &operator=(const PoolList &) = delete;
+
+  PoolHook *end() { return &head; }
+  PoolHook *front() { return head.next; }
+  size_t size() const { return n; }
+  /**
+   * @brief inserts x before pos
+   */
+  void insert(PoolHook *pos, PoolHook *x) {
+    x->prev = pos->prev, x->next = pos;
+    pos->prev->next = x, pos->prev = x;
+    n++;
+  }
+  void push_front(PoolHook *x) { insert(head.next, x); }
+  void remove(PoolHook *x) {
+    x->prev->next = x->next, x->next->prev = x->prev;
+    n--;
+  }
+  /**
+   * @brief removes and returns the hindmost frame that evict lets go
+   */
+  template <class Evict> PoolHook *victim(Evict &evict) {
+    for (PoolHook *x = head.prev; x != &head; x = x->prev)
+      if (evict(x)) {
+        remove(x);
+        return x;
+      }
+    return nullptr;
+  }
+};
+
+/**
+ * @brief least recently used
+ */
+class LRUPolicy {
+  PoolList list; // most recently used first
+
+public:
+  void insert(PoolHook *x) { list.push_front(x); }
+  void access(PoolHook *x) { list.remove(x), list.push_front(x); }
+  void erase(PoolHook *x) { list.remove(x); }
+  template <class Evict> PoolHook *victim(Evict evict) {
+    return list.victim(evict);
+  }
+  size_t size() const { return list.size(); }
+};
+
+/**
+ * @brief CLOCK (second chance): a hit only sets a bit, the hand clears it and
+ * evicts the first frame whose bit is clear
+ * new frames are inserted behind the hand with the bit clear, so a frame read
+ * once (by a scan) goes before the frames hit since the last sweep
+ */
+class ClockPolicy {
+  PoolList ring;
+  PoolHook *hand = ring.end();
+
+public:
+  void insert(PoolHook *x) {
+    x->ref = false;
+    ring.insert(hand, x);
+  }
+  void access(PoolHook *x) { x->ref = true; }
+  void erase(PoolHook *x) {
+    if (hand == x)
+      hand = x->next;
+    ring.remove(x);
+  }
+  template <class Evict> PoolHook *victim(Evict evict) {
+    // two sweeps: the first may only clear bits
+    for (size_t step = 0, n = 2 * ring.size() + 1; step < n; step++) {
+      if (hand == ring.end())
+        hand = ring.front();
+      if (hand == ring.end())
+        return nullptr;
+      PoolHook *x = hand;
+      hand = x->next;
+      if (x->ref) {
+        x->ref = false;
+      } else if (evict(x)) {
+        ring.remove(x);
+        return x;
+      }
+    }
+    return nullptr;
+  }
+  size_t size() const { return ring.size(); }
+};
+
+/**
+ * @brief 2Q: a new frame enters the FIFO queue A1in, and is promoted into the
+ * LRU queue Am only if it is read again after being evicted from A1in while
+ * its key is remembered in A1out, so a scan (even one reading each leaf a few
+ * times in a row) passes through A1in without evicting the frames of Am
+ * A1in takes about a quarter of the frames, A1out remembers half as many keys
+ * as there are frames
+ */
+class TwoQPolicy {
+  PoolList in, main; // A1in (newest first), Am (most recently used first)
+  Hashmap<size_t, bool> ghosts; // A1out, newest first
+
+  void forget(PoolHook *x) {
+    ghosts.insert(x->key, true);
+    while (ghosts.size() > size() / 2 + 1)
+      ghosts.erase(--ghosts.end());
+  }
+
+public:
+  void insert(PoolHook *x) {
+    if (ghosts.peek(x->key)) {
+      ghosts.erase(ghosts.find(x->key));
+      x->main = true, main.push_front(x);
+    } else {
+      x->main = false, in.push_front(x);
+    }
+  }
+  /**
+   * @brief a hit in A1in is not a promotion: it is most likely correlated to
+   * the read that brought the frame in
+   */
+  void access(PoolHook *x) {
+    if (x->main)
+      main.remove(x), main.push_front(x);
+  }
+  void erase(PoolHook *x) { (x->main ? main : in).remove(x); }
+  template <class Evict> PoolHook *victim(Evict evict) {
+    PoolHook *x = nullptr;
+    bool full = in.size() * 4 >= size(); // A1in over its share
+    if (full && (x = in.victim(evict)))
+      return forget(x), x;
+    if ((x = main.victim(evict)))
+      return x;
+    if (!full && (x = in.victim(evict)))
+      return forget(x), x;
+    return nullptr;
+  }
+  size_t size() const { return in.size() + main.size(); }
+};
+
+#endif
@@ -0,0 +1,281 @@
+#ifndef _SJTU_WAL_HPP_
+#define _SJTU_WAL_HPP_
+
+#include <fcntl.h>
+#include <filesystem>
+#include <unistd.h>
+
+#include "utility.hpp"
+
+/**
+ * @brief write-ahead (redo) log shared by all the CachedBPTs of a process
+ * each command appends the after-images of the bytes it changed, followed by a
+ * commit record; the log is fsynced once per group of commands (group commit),
+ * and a checkpoint writes every client back and empties the log, so recovery
+ * only replays the commands since the last checkpoint
+ * rules for clients: a change must not reach its file before the log covering
+ * it is durable (see durable()), and changes of the current command must not
+ * reach the files at all
+ * clients are committed and checkpointed in the reverse order of attach(), so
+ * that a Database (attached before its trees) logs its catalog after the trees
+ * allocate space, and is synced after they are written back
+ */
+class WAL {
+public:
+  /**
+   * @brief a component whose changes are logged (a CachedBPT)
+   */
+  class Client {
+  public:
+    virtual ~Client() {}
+    /**
+     * @brief appends the after-images of the current command to the log
+     */
+    virtual void on_commit(WAL &wal) = 0;
+    /**
+     * @brief the log is durable up to the last commit: buffered changes may be
+     * written back
+     */
+    virtual void on_sync() = 0;
+    /**
+     * @brief writes everything back and makes the files durable
+     */
+    virtual void on_checkpoint() = 0;
+  };
+
+  static constexpr size_t GROUP = 64;            // commands per fsync
+  static constexpr size_t GROUP_BYTES = 1 << 22; // log bytes per fsync
+  static constexpr size_t CHECKPOINT = 1 << 26;  // log bytes per checkpoint
+
+private:
+  enum Kind : int { FILE, DATA, COMMIT };
+  struct Record {
+    Kind kind;
+    int file;   // FILE: id, DATA: id of the file written
+    size_t pos; // DATA: offset in the file
+    int len;    // length of the payload following the record
+    int pad = 0; // no padding bytes, which would spoil the checksums
+  };
+
+  static inline WAL *current = nullptr;
+
+  int fd = -1;
+  string buf;             // records not written into the log yet
+  size_t log_size = 0;    // bytes written into the log
+  size_t cur = 1;         // sequence number of the current (writing) command
+  size_t synced = 0;      // commands up to synced are durable
+  size_t unsynced = 0;    // commands (read-only included) since the last sync
+  size_t cmd_beg = 0;     // position in buf where the current command begins
+  size_t cmd_len = 0;     // number of DATA records of the current command
+  size_t cmd_sum = checksum(nullptr, 0); // checksum of them
+  bool requested = false; // a checkpoint at the end of the current command
+  sjtu::vector<string> files;
+  sjtu::vector<Client *> clients;
+
+  void append(Kind kind, int file, size_t pos, const void *p, int len) {
+    Record rec{kind, file, pos, len};
+    buf.append((const char *)&rec, sizeof(rec));
+    buf.append((const char *)p, len);
+  }
+  void declare(int id) {
+    append(FILE, id, 0, files[id].data(), files[id].size());
+  }
+
+  /**
+   * @brief applies the committed commands in the log to the files, and drops
+   * the torn or uncommitted tail
+   */
+  void recover() {
+    sjtu::vector<string> paths;
+    sjtu::vector<int> fds;
+    string cmd; // records of the command being read
+    Record rec;
+    size_t h = checksum(nullptr, 0);
+    auto read_all = [&](void *p, size_t n) {
+      return ::read(fd, p, n) == (ssize_t)n;
+    };
+    auto apply = [&]() {
+      for (size_t i = 0; i < cmd.size();) {
+        Record r;
+        memcpy(&r, &cmd[i], sizeof(r));
+        i += sizeof(r);
+        if (fds[r.file] == -1)
+          fds[r.file] =
+              ::open(paths[r.file].data(), O_WRONLY | O_CREAT, 0644);
+        if (pwrite(fds[r.file], &cmd[i], r.len, r.pos) != r.len)
+          throw "Error in WAL: recovery failed";
+        i += r.len;
+      }
+    };
+    lseek(fd, 0, SEEK_SET);
+    while (read_all(&rec, sizeof(rec)) && rec.len >= 0) {
+      string payload(rec.len, '\0');
+      if (!read_all(payload.data(), rec.len))
+        break; // torn record
+      if (rec.kind == FILE) {
+        while ((int)paths.size() <= rec.file)
+          paths.push_back(""), fds.push_back(-1);
+        paths[rec.file] = payload;
+      } else if (rec.kind == DATA) {
+        if (rec.file < 0 || rec.file >= (int)paths.size())
+          break;
+        h = checksum((const char *)&rec, sizeof(rec), h);
+        h = checksum(payload.data(), rec.len, h);
+        cmd.append((const char *)&rec, sizeof(rec));
+        cmd.append(payload);
+      } else {
+        size_t sum;
+        if (rec.len != sizeof(sum))
+          break;
+        memcpy(&sum, payload.data(), sizeof(sum));
+        if (sum != h)
+          break; // torn command
+        apply();
+        cmd.clear(), h = checksum(nullptr, 0);
+      }
+    }
+    for (size_t i = 0; i < fds.size(); i++)
+      if (fds[i] != -1)
+        fsync(fds[i]), ::close(fds[i]);
+    truncate();
+  }
+  /**
+   * @brief empties the log, a new one starts with the file declarations
+   */
+  void truncate() {
+    if (ftruncate(fd, 0) != 0 || fsync(fd) != 0)
+      throw "Error in WAL: truncate failed";
+    lseek(fd, 0, SEEK_SET);
+    log_size = 0;
+    buf.clear(), cmd_beg = cmd_len = 0, cmd_sum = checksum(nullptr, 0);
+    for (size_t i = 0; i < files.size(); i++)
+      declare(i);
+  }
+
+public:
+  /**
+   * @brief FNV-1a over 8-byte words, detects commands torn by a crash
+   */
+  static size_t checksum(const char *p, size_t n,
+                         size_t h = 14695981039346656037ULL) {
+    size_t w;
+    for (; n >= sizeof(w); p += sizeof(w), n -= sizeof(w)) {
+      memcpy(&w, p, sizeof(w));
+      h = (h ^ w) * 1099511628211ULL;
+    }
+    for (; n; p++, n--)
+      h = (h ^ (unsigned char)*p) * 1099511628211ULL;
+    return h;
+  }
+
+  /**
+   * @brief opens the log and recovers from it; must be constructed before
+   * the trees it protects, which find it through WAL::get()
+   */
+  explicit WAL(const string &name = "./bin/wal.log") {
+    std::filesystem::create_directory("./bin");
+    fd = ::open(name.data(), O_RDWR | O_CREAT, 0644);
+    if (fd == -1)
+      throw "Error in WAL: open() failed";
+    recover();
+    current = this;
+  }
+  WAL(const WAL &) = delete;
+  WAL &operator=(const WAL &) = delete;
+  /**
+   * @brief clients normally detach first, writing themselves back
+   */
+  ~WAL() {
+    checkpoint();
+    ::close(fd);
+    current = nullptr;
+  }
+  /**
+   * @return the log of the process, nullptr if there is none (changes are not
+   * logged then)
+   */
+  static WAL *get() { return current; }
+
+  void attach(Client *c) { clients.push_back(c); }
+  void detach(Client *c) {
+    for (size_t i = 0; i < clients.size(); i++)
+      if (clients[i] == c) {
+        clients.erase(i);
+        return;
+      }
+  }
+  /**
+   * @brief registers a file written through the log
+   * @return id of the file in records
+   */
+  int file(const string &path) {
+    for (size_t i = 0; i < files.size(); i++)
+      if (files[i] == path)
+        return i;
+    files.push_back(path);
+    declare(files.size() - 1);
+    return files.size() - 1;
+  }
+
+  size_t current_cmd() const { return cur; }
+  size_t durable() const { return synced; }
+
+  /**
+   * @brief logs that the current command writes len bytes at pos of a file
+   */
+  void log(int file, size_t pos, const void *p, int len) {
+    Record rec{DATA, file, pos, len};
+    cmd_sum = checksum((const char *)&rec, sizeof(rec), cmd_sum);
+    cmd_sum = checksum((const char *)p, len, cmd_sum);
+    cmd_len++;
+    append(DATA, file, pos, p, len);
+  }
+  /**
+   * @brief ends the current command
+   */
+  void commit() {
+    for (size_t i = clients.size(); i--;)
+      clients[i]->on_commit(*this);
+    if (cmd_len) { // not read-only
+      append(COMMIT, -1, 0, &cmd_sum, sizeof(cmd_sum));
+      cmd_beg = buf.size(), cmd_len = 0, cmd_sum = checksum(nullptr, 0);
+      cur++;
+    }
+    if (++unsynced >= GROUP || buf.size() >= GROUP_BYTES)
+      sync();
+    if (log_size >= CHECKPOINT || requested)
+      checkpoint();
+  }
+  /**
+   * @brief asks for a checkpoint once the current command is committed (a
+   * client holding too much in memory until the next one)
+   */
+  void request_checkpoint() { requested = true; }
+  /**
+   * @brief writes the committed commands into the log and fsyncs it
+   */
+  void sync() {
+    if (cmd_beg) {
+      if (::write(fd, buf.data(), cmd_beg) != (ssize_t)cmd_beg ||
+          fdatasync(fd) != 0)
+        throw "Error in WAL: write failed";
+      log_size += cmd_beg;
+      buf.erase(0, cmd_beg), cmd_beg = 0;
+    }
+    synced = cur - 1, unsynced = 0;
+    for (size_t i = 0; i < clients.size(); i++)
+      clients[i]->on_sync();
+  }
+  /**
+   * @brief writes every client back and empties the log
+   */
+  void checkpoint() {
+    requested = false;
+    sync();
+    for (size_t i = clients.size(); i--;)
+      clients[i]->on_checkpoint();
+    truncate();
+  }
+};
+
+#endif
@@ -39,7 +39,7 @@ private:
   /**
    * @brief hash function
    */
-  int hash(const Key &key) { return hash_(key) % BNUM; }
+  int hash(const Key &key) const { return hash_(key) % BNUM; }
   struct Node;
   struct ListNode;
   using NodePtr = Node *;
@@ -223,6 +223,20 @@ public:
     return end();
   }
   bool count(const Key &key) { return find(key) != end_; }
+  /**
+   * @brief finds a key without touching the list
+   * may run concurrently with find() (which only reorders the list), but not
+   * with insert(), erase() or clear()
+   * @return pointer to the value, nullptr if not found
+   */
+  const T *peek(const Key &key) const {
+    if (!table)
+      return nullptr;
+    for (NodePtr p = table[hash(key)]; p; p = p->next)
+      if (eq(p->key(), key))
+        return &p->iter->data.second;
+    return nullptr;
+  }
   /**
    * @brief erases a key at the given position
    * to erase a given key, first call find(key) to check if the key exists
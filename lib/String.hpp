@@ -17,8 +17,13 @@ template <size_t MaxLen_> class String {
 
 public:
   String() : len(0) { memset(s, 0, sizeof(s)); }
-  String(const char *str) : len(strlen(str)) { strcpy(s, str); }
-  String(const string &str) : len(str.size()) { strcpy(s, str.data()); }
+  // the rest of s is zero-filled, so that equal strings have equal bytes
+  String(const char *str) : len(strlen(str)) {
+    memset(s, 0, sizeof(s)), strcpy(s, str);
+  }
+  String(const string &str) : len(str.size()) {
+    memset(s, 0, sizeof(s)), strcpy(s, str.data());
+  }
 
   size_t size() const { return len; }
   const char *data() const { return s; }
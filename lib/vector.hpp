@@ -260,7 +260,7 @@ public:
    */
   vector() : arr(nullptr), siz(0), cap(0) {}
   vector(const vector &other) : siz(other.siz), cap(other.cap) {
-    arr = alloc.allocate(cap);
+    arr = cap ? alloc.allocate(cap) : nullptr;
     // copy
     for (size_t i = 0; i < siz; i++) {
       alloc.construct(arr + i, other.arr[i]);
@@ -289,7 +289,7 @@ public:
     }
     alloc.deallocate(arr, cap);
     siz = other.siz, cap = other.cap;
-    arr = alloc.allocate(cap);
+    arr = cap ? alloc.allocate(cap) : nullptr;
     // copy
     for (size_t i = 0; i < siz; i++) {
       alloc.construct(arr + i, other.arr[i]);
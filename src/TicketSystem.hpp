@@ -1,6 +1,7 @@
 #ifndef __SJTU_TICKETSYSTEM_HPP__
 #define __SJTU_TICKETSYSTEM_HPP__
 
+#include "LSM.hpp"
 #include "TrainSystem.hpp"
 #include "UserSystem.hpp"
 
@@ -9,22 +10,19 @@ enum Status { SUCCESS, PENDING, REFUNDED };
 using PendingID = pair<TrainDay, int>; //(train_day, op_time)
 
 /**
- * @brief records ticket (passage) information
+ * @brief records ticket (passage) information; the train and the stations are
+ * ids (see Dictionary), printed by TicketSystem::print()
  */
 struct Ticket {
-  Train train;
-  Station from, to;
+  int train;
+  int from, to;
   DateTime leave, arrive;
   int time, price, seat; // total time/price/seats
   Ticket() {}
-  Ticket(const Train &tr, const Station &ss, const Station &ts,
-         const DateTime &lv, const DateTime &arv, int tm, int p, int st)
+  Ticket(int tr, int ss, int ts, const DateTime &lv, const DateTime &arv,
+         int tm, int p, int st)
       : train(tr), from(ss), to(ts), leave(lv), arrive(arv), time(tm), price(p),
         seat(st) {}
-  friend ostream &operator<<(ostream &os, const Ticket &p) {
-    return os << p.train << ' ' << p.from << ' ' << p.leave << " -> " << p.to
-              << ' ' << p.arrive << ' ' << p.price << ' ' << p.seat;
-  }
 };
 /**
  * @brief records transfer ticket information
@@ -39,53 +37,68 @@ struct Transfer {
   }
 };
 /**
- * @brief comparators by time/cost
+ * @brief compares two transfers by the names of their first trains, then by
+ * those of their second ones
+ */
+inline bool less_names(const Dictionary<Train> &trains, const Transfer &lhs,
+                       const Transfer &rhs) {
+  if (lhs.ticket.train != rhs.ticket.train) // the same id iff the same name
+    return trains[lhs.ticket.train] < trains[rhs.ticket.train];
+  return trains[lhs.ticket2.train] < trains[rhs.ticket2.train];
+}
+
+/**
+ * @brief comparators by time/cost, ties broken by the names of the trains
  */
 struct LessTime {
+  const Dictionary<Train> &trains;
   bool operator()(const Ticket &lhs, const Ticket &rhs) const {
     return lhs.time < rhs.time ||
-           (lhs.time == rhs.time && lhs.train < rhs.train);
+           (lhs.time == rhs.time && trains[lhs.train] < trains[rhs.train]);
   }
   bool operator()(const Transfer &lhs, const Transfer &rhs) const {
-    return make_tuple(lhs.time, lhs.cost, lhs.ticket.train, lhs.ticket2.train) <
-           make_tuple(rhs.time, rhs.cost, rhs.ticket.train, rhs.ticket2.train);
+    if (lhs.time != rhs.time)
+      return lhs.time < rhs.time;
+    if (lhs.cost != rhs.cost)
+      return lhs.cost < rhs.cost;
+    return less_names(trains, lhs, rhs);
   }
-} less_time;
+};
 struct LessCost {
+  const Dictionary<Train> &trains;
   bool operator()(const Ticket &lhs, const Ticket &rhs) const {
     return lhs.price < rhs.price ||
-           (lhs.price == rhs.price && lhs.train < rhs.train);
+           (lhs.price == rhs.price && trains[lhs.train] < trains[rhs.train]);
   }
   bool operator()(const Transfer &lhs, const Transfer &rhs) const {
-    return make_tuple(lhs.cost, lhs.time, lhs.ticket.train, lhs.ticket2.train) <
-           make_tuple(rhs.cost, rhs.time, rhs.ticket.train, rhs.ticket2.train);
+    if (lhs.cost != rhs.cost)
+      return lhs.cost < rhs.cost;
+    if (lhs.time != rhs.time)
+      return lhs.time < rhs.time;
+    return less_names(trains, lhs, rhs);
   }
-} less_cost;
+};
 
 /**
- * @brief records order information
+ * @brief records order information; the train and the stations are ids, like
+ * in Ticket
  */
 struct Order {
   static const char *status_str[3];
   Status status;
-  Train train;
-  Station from, to;
+  int train;
+  int from, to;
   DateTime leave, arrive;
   int price, ticket_num;
   // extra information
-  int l, r; // tr.sta[l] = from, tr.sta[r] = to
+  int l, r; // tr.stops[l].sta = from, tr.stops[r].sta = to
   PendingID pending_id;
   Order() {}
-  Order(Status status_, const Train &tr, const Station &ss, const Station &ts,
-        const DateTime &lv, const DateTime &arv, int price_, int tk, int l_,
-        int r_, const PendingID &pd_id)
+  Order(Status status_, int tr, int ss, int ts, const DateTime &lv,
+        const DateTime &arv, int price_, int tk, int l_, int r_,
+        const PendingID &pd_id)
       : status(status_), train(tr), from(ss), to(ts), leave(lv), arrive(arv),
         price(price_), ticket_num(tk), l(l_), r(r_), pending_id(pd_id) {}
-  friend ostream &operator<<(ostream &os, const Order &obj) {
-    return os << obj.status_str[obj.status] << ' ' << obj.train << ' '
-              << obj.from << ' ' << obj.leave << " -> " << obj.to << ' '
-              << obj.arrive << ' ' << obj.price << ' ' << obj.ticket_num;
-  }
 };
 const char *Order::status_str[3] = {"[success]", "[pending]", "[refunded]"};
 
@@ -93,12 +106,12 @@ const char *Order::status_str[3] = {"[success]", "[pending]", "[refunded]"};
  * @brief maintains pending orders
  */
 struct Pending {
-  int handle; // handle: quick access to order information
+  pair<ID, int> order; // key of the order (its handle may move, see restore)
   int l, r;
   int ticket_num;
   Pending() {}
-  Pending(int hd, int l_, int r_, int tk)
-      : handle(hd), l(l_), r(r_), ticket_num(tk) {}
+  Pending(const pair<ID, int> &ord, int l_, int r_, int tk)
+      : order(ord), l(l_), r(r_), ticket_num(tk) {}
 };
 
 /**
@@ -107,26 +120,49 @@ struct Pending {
 class TicketSystem : public UserSystem, public TrainSystem {
 
 protected:
-  CachedBPT<pair<ID, int>, Order> orders; // key: (user, order_id)
-  CachedBPT<ID, int> ord_num;             // key: user, value: number of orders
+  LSM<pair<ID, int>, Order> orders; // key: (user, order_id), see LSM
+  CachedBPT<ID, int> ord_num;       // key: user, value: number of orders
   CachedBPT<PendingID, Pending>
       pending; // key: ((train, start_date), pending_op_time)
+  LessTime less_time;
+  LessCost less_cost;
+
+  void print(const Ticket &p) {
+    cout << train_names[p.train] << ' ' << station_names[p.from] << ' '
+         << p.leave << " -> " << station_names[p.to] << ' ' << p.arrive << ' '
+         << p.price << ' ' << p.seat << '\n';
+  }
+  void print(const Order &p) {
+    cout << p.status_str[p.status] << ' ' << train_names[p.train] << ' '
+         << station_names[p.from] << ' ' << p.leave << " -> "
+         << station_names[p.to] << ' ' << p.arrive << ' ' << p.price << ' '
+         << p.ticket_num << '\n';
+  }
 
 public:
   TicketSystem()
-      : orders("orders", RETRIEVE), ord_num("orderNumber", RETRIEVE),
-        pending("ordersPending", RETRIEVE) {}
+      : orders("orders", RETRIEVE, STORAGE),
+        ord_num("orderNumber", RETRIEVE, STORAGE, false, BLOOM_BITS,
+                Index::HASH),
+        pending("ordersPending", RETRIEVE, STORAGE),
+        less_time{train_names}, less_cost{train_names} {}
 
   void query_ticket(const Station &from, const Station &to, const Date &date,
                     bool by_cost) {
+    trim_released();
     vector<Ticket> ans;
-    ID sid = from.hash(), sid2 = to.hash();
+    int sid = station_names.find(from), sid2 = station_names.find(to);
+    if (sid == -1 || sid2 == -1 || !passby.may_contain_prefix(sid) ||
+        !passby.may_contain_prefix(sid2)) {
+      cout << "0\n"; // a station no train passes by
+      return;
+    }
     auto it = passby.lower_bound(make_pair(sid, 0)),
-         end = passby.upper_bound(make_pair(sid, ID(-1))),
+         end = passby.upper_bound(make_pair(sid, 1 << 30)),
          it2 = passby.lower_bound(make_pair(sid2, 0)),
-         end2 = passby.upper_bound(make_pair(sid2, ID(-1)));
+         end2 = passby.upper_bound(make_pair(sid2, 1 << 30));
     for (; it != end; ++it) { // enumerate trains passing station "from"
-      ID tid = it.key().second;
+      int tid = it.key().second;
       while (it2 != end2 && it2.key().second < tid)
         ++it2; //$ two pointers method
       if (it2 == end2)
@@ -137,18 +173,17 @@ public:
       int l = psb.idx, r = psb2.idx;
       if (l > r)
         continue;
-      TrainInfo tr = trains.get_by_handle(psb.handle);
-      Date virtual_start_date = date - tr.leave[l] / MIN_IN_D;
+      const Timetable &tr = released_train(psb.train);
+      Date virtual_start_date = date - tr.stops[l].leave / MIN_IN_D;
       // must count the date as if we started from sta[0]
       if (tr.invalid_date(virtual_start_date))
         continue; // check starting date
       // found an answer
-      const Train &train = psb.train;
-      DateTime leave(virtual_start_date, tr.leave[l]),
-          arrive(virtual_start_date, tr.arrive[r]);
+      DateTime leave(virtual_start_date, tr.stops[l].leave),
+          arrive(virtual_start_date, tr.stops[r].arrive);
       SeatInfo seatinfo =
           seats.get(TrainDay(tid, virtual_start_date - tr.date0));
-      ans.push_back(Ticket(train, from, to, leave, arrive, tr.total_time(l, r),
+      ans.push_back(Ticket(tid, sid, sid2, leave, arrive, tr.total_time(l, r),
                            tr.total_price(l, r), seatinfo.min(l, r)));
     }
     int n = ans.size();
@@ -157,8 +192,8 @@ public:
     else
       sort(ans, 0, n - 1, less_time);
     cout << n << '\n';
-    for (auto ticket : ans)
-      cout << ticket << '\n';
+    for (const auto &ticket : ans)
+      print(ticket);
   }
 
   /**
@@ -166,57 +201,62 @@ public:
    */
   void query_transfer(const Station &from, const Station &to, const Date &date,
                       bool by_cost) {
-    ID sid = from.hash(), sid2 = to.hash();
+    trim_released();
+    int sid = station_names.find(from), sid2 = station_names.find(to);
+    if (sid == -1 || sid2 == -1 || !passby.may_contain_prefix(sid) ||
+        !passby.may_contain_prefix(sid2)) {
+      cout << "0\n";
+      return;
+    }
     auto it = passby.lower_bound(make_pair(sid, 0)),
-         end = passby.upper_bound(make_pair(sid, ID(-1))),
+         end = passby.upper_bound(make_pair(sid, 1 << 30)),
          it2 = passby.lower_bound(make_pair(sid2, 0)),
-         end2 = passby.upper_bound(make_pair(sid2, ID(-1)));
+         end2 = passby.upper_bound(make_pair(sid2, 1 << 30));
     vector<Passby> vec; // for caching repeated range iteration
+    vector<const Timetable *> trains2; // their trains, looked up once
     for (; it2 != end2; ++it2) {
       vec.push_back(it2.value());
+      trains2.push_back(&released_train(vec.back().train));
     }
 
-    Hashmap<Station, int, size_t(-1), std::hash<string>>
-        map; // match train.station[r] with train2.station[l2]
+    // match tr.stops[r] with tr2.stops[l2]: the index in tr of each station
+    // (by id), -1 if not after l
+    vector<int> at;
+    for (size_t i = 0; i < station_names.size(); i++)
+      at.push_back(-1);
     Transfer ans;
     bool flag = 0; // flag = 1: has found a potential answer
     for (; it != end; ++it) {
       Passby psb = it.value();
-      TrainInfo tr = trains.get_by_handle(psb.handle);
+      const Timetable &tr = released_train(psb.train);
       int l = psb.idx;
-      Date virtual_start_date = date - tr.leave[l] / MIN_IN_D;
+      Date virtual_start_date = date - tr.stops[l].leave / MIN_IN_D;
       if (tr.invalid_date(virtual_start_date))
         continue; // check starting date
 
-      const Train &train = psb.train;
-      ID tid = it.key().second;
-      DateTime leave(virtual_start_date, tr.leave[l]);
+      int tid = it.key().second;
+      DateTime leave(virtual_start_date, tr.stops[l].leave);
 
-      map.clear();
       for (int r = l + 1; r < tr.size; r++)
-        map.insert(make_pair(tr.sta[r], r)); // maps station to index in tr
+        at[tr.stops[r].sta] = r;
 
-      for (const auto &psb2 : vec) {
-        int r2 = psb2.idx;
-        const Train &train2 = psb2.train;
-        ID tid2 = train2.hash();
+      for (size_t j = 0; j < vec.size(); j++) {
+        int r2 = vec[j].idx;
+        int tid2 = vec[j].train;
         if (tid2 == tid)
           continue; // must take two different trains
-        TrainInfo tr2 = trains.get_by_handle(psb2.handle);
+        const Timetable &tr2 = *trains2[j];
         for (int l2 = r2 - 1; l2 >= 0; l2--) {
-          const Station &mid = tr2.sta[l2]; // transfer station
-          auto mp_it = map.find(mid);
-          if (mp_it == map.end())
-            continue;
-          int r = mp_it->second; // tr[l] -> tr[r]=tr2[l2] -> tr2[r2]
-          if (l >= r)
+          int mid = tr2.stops[l2].sta; // transfer station
+          int r = at[mid]; // tr[l] -> tr[r]=tr2[l2] -> tr2[r2]
+          if (r == -1)
             continue;
-          DateTime arrive(virtual_start_date, tr.arrive[r]);
-          if (DateTime(tr2.date1, tr2.leave[l2]) < arrive)
+          DateTime arrive(virtual_start_date, tr.stops[r].arrive);
+          if (DateTime(tr2.date1, tr2.stops[l2].leave) < arrive)
             continue; // fail to catch the last train (tr2)
           // minimize leave2 s.t. leave2 >= arrive
           DateTime
-              earliest = DateTime(tr2.date0, tr2.leave[l2]),
+              earliest = DateTime(tr2.date0, tr2.stops[l2].leave),
               leave2 =
                   earliest; // default: take the first train (tr2) available
           Date virtual_start_date2 = tr2.date0;
@@ -225,11 +265,11 @@ public:
             leave2.date = arrive.date + (int)(leave2.time < arrive.time);
             virtual_start_date2 += leave2.date - earliest.date;
           }
-          DateTime arrive2(virtual_start_date2, tr2.arrive[r2]);
+          DateTime arrive2(virtual_start_date2, tr2.stops[r2].arrive);
 
-          Transfer res(Ticket(train, from, mid, leave, arrive, -1,
+          Transfer res(Ticket(tid, sid, mid, leave, arrive, -1,
                               tr.total_price(l, r), 0),
-                       Ticket(train2, mid, to, leave2, arrive2, -1,
+                       Ticket(tid2, mid, sid2, leave2, arrive2, -1,
                               tr2.total_price(l2, r2),
                               0)); // seats are not calculated yet
           if (!flag || (by_cost ? less_cost(res, ans) : less_time(res, ans))) {
@@ -243,11 +283,13 @@ public:
           }
         }
       }
+      for (int r = l + 1; r < tr.size; r++)
+        at[tr.stops[r].sta] = -1;
     }
     if (!flag) {
       cout << "0\n";
     } else {
-      cout << ans.ticket << '\n' << ans.ticket2 << '\n';
+      print(ans.ticket), print(ans.ticket2);
     }
   }
 
@@ -259,24 +301,26 @@ public:
                   int ticket_num, const Station &from, const Station &to,
                   bool pending_allowed, int op_time) {
 
-    ID uid = usr.hash(), tid = train.hash();
+    ID uid = usr.hash();
+    int tid = train_names.find(train);
     if (!logged_in.count(uid))
       throw "buy_ticket() failed: user not logged in";
-    TrainInfo tr = trains.get(tid); //! try catch throw for more error info
+    Timetable tr = get_train(tid);
     if (!tr.released)
       throw "buy_ticket() failed: train not released yet";
     if (ticket_num > tr.seat)
       throw "buy_ticket() failed: not enough seats";
+    int sid = station_names.find(from), sid2 = station_names.find(to);
     int l = -1, r = -1;
     for (int i = 0; i < tr.size; i++) {
-      if (tr.sta[i] == from)
+      if (tr.stops[i].sta == sid)
         l = i;
-      else if (tr.sta[i] == to)
+      else if (tr.stops[i].sta == sid2)
         r = i;
     }
     if (l == -1 || r == -1 || l >= r)
       throw "buy_ticket() failed: invalid stations";
-    Date virtual_start_date = date - tr.leave[l] / MIN_IN_D;
+    Date virtual_start_date = date - tr.stops[l].leave / MIN_IN_D;
     if (tr.invalid_date(virtual_start_date))
       throw "buy_ticket() failed: invalid date";
     TrainDay train_day(tid, virtual_start_date - tr.date0);
@@ -286,23 +330,24 @@ public:
     if (remainder < ticket_num && !pending_allowed)
       throw "buy_ticket() failed: tickets sold out";
     Status status = Status(remainder < ticket_num); // SUCCESS=0, PENDING=1
-    Order ord(status, train, from, to,
-              DateTime(virtual_start_date, tr.leave[l]),
-              DateTime(virtual_start_date, tr.arrive[r]), price, ticket_num, l,
-              r, PendingID(train_day, op_time));
+    Order ord(status, tid, sid, sid2,
+              DateTime(virtual_start_date, tr.stops[l].leave),
+              DateTime(virtual_start_date, tr.stops[r].arrive), price,
+              ticket_num, l, r, PendingID(train_day, op_time));
     int ord_id = ord_num.get_default(uid);
     // update the number of orders
     if (ord_id)
       ord_num.set(uid, ord_id + 1); // already exists
     else
       ord_num.insert(uid, ord_id + 1); // create
-    int handle = orders.insert(make_pair(uid, ord_id), ord);
+    orders.insert(make_pair(uid, ord_id), ord);
     if (status == SUCCESS) {
       seatinfo.add(l, r, -ticket_num); // buy
       seat_it.set(seatinfo);
       cout << (long long)price * ticket_num << '\n';
     } else {
-      pending.insert(ord.pending_id, Pending(handle, l, r, ticket_num));
+      pending.insert(ord.pending_id,
+                     Pending(make_pair(uid, ord_id), l, r, ticket_num));
       cout << "queue\n";
     }
   }
@@ -320,7 +365,7 @@ public:
     int n = vec.size();
     cout << n << '\n';
     for (int i = n - 1; i >= 0; i--)
-      cout << vec[i] << '\n';
+      print(vec[i]);
   }
 
   void refund_ticket(const Usr &usr, int ord_id) {
@@ -341,18 +386,22 @@ public:
       seatinfo.add(ord.l, ord.r, ord.ticket_num); // refund
       auto it = pending.lower_bound(PendingID(train_day, 0)),
            end = pending.upper_bound(PendingID(train_day, 1 << 30));
+      vector<PendingID> done; // erased after the scan (iterators see the tree)
       for (; it != end; ++it) {
         // try to execute pending orders in ascending chronological order
         Pending pd = it.value();
         if (seatinfo.min(pd.l, pd.r) >= pd.ticket_num) {
           // enough tickets available
           seatinfo.add(pd.l, pd.r, -pd.ticket_num); // buy
-          Order tmp = orders.get_by_handle(pd.handle);
+          auto ord_it = orders.find(pd.order);
+          Order tmp = ord_it.value();
           tmp.status = SUCCESS;
-          orders.set_by_handle(pd.handle, tmp);
-          pending.erase(tmp.pending_id);
+          ord_it.set(tmp);
+          done.push_back(tmp.pending_id);
         }
       }
+      for (auto &id : done)
+        pending.erase(id);
       seat_it.set(seatinfo); // save modifications
     } else {
       // status == PENDING
@@ -371,6 +420,66 @@ public:
     pending.clear();
     cout << "0\n";
   }
+  /**
+   * @brief compacts all files
+   */
+  virtual void vacuum() override {
+    UserSystem::vacuum();
+    TrainSystem::vacuum();
+    orders.vacuum();
+    ord_num.vacuum();
+    pending.vacuum();
+    cout << "0\n";
+  }
+
+  /**
+   * @brief snapshots of the whole database (copy-on-write, see BPT), numbered
+   * from 1; every tree holds the same snapshots
+   */
+  void create_snapshot() {
+    int id = orders.max_snapshot() + 1;
+    snapshot(id);
+    cout << id << '\n';
+  }
+  /**
+   * @brief rolls the database back to a snapshot (which is kept) and logs
+   * all users out
+   */
+  void restore_snapshot(int id) {
+    if (!orders.has_snapshot(id))
+      throw "restore_snapshot() failed: snapshot not found";
+    restore(id);
+    cout << "0\n";
+  }
+  void delete_snapshot(int id) {
+    if (!orders.has_snapshot(id))
+      throw "delete_snapshot() failed: snapshot not found";
+    drop_snapshot(id);
+    cout << "0\n";
+  }
+
+protected:
+  virtual void snapshot(int id) override {
+    UserSystem::snapshot(id);
+    TrainSystem::snapshot(id);
+    orders.snapshot(id);
+    ord_num.snapshot(id);
+    pending.snapshot(id);
+  }
+  virtual void restore(int id) override {
+    UserSystem::restore(id);
+    TrainSystem::restore(id);
+    orders.restore(id);
+    ord_num.restore(id);
+    pending.restore(id);
+  }
+  virtual void drop_snapshot(int id) override {
+    UserSystem::drop_snapshot(id);
+    TrainSystem::drop_snapshot(id);
+    orders.drop_snapshot(id);
+    ord_num.drop_snapshot(id);
+    pending.drop_snapshot(id);
+  }
 
 }; // class TrainSystem
 
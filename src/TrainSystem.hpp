@@ -2,61 +2,87 @@
 #define __SJTU_TRAINSYSTEM_HPP__
 
 #include "CachedBPT.hpp"
+#include "Dictionary.hpp"
 #include "utility.hpp"
 
 constexpr int STA_NUM = 101;
 
-using TrainDay = pair<ID, int>;
+using TrainDay = pair<int, int>;
 //(train, start_date), encodes a train that starts on a given day
 
+/**
+ * @brief the fixed part of a train, kept in TrainSystem::trains (inlined in
+ * the leaves, see BPT::INLINE); its stations are kept apart (see Stop)
+ */
 struct TrainInfo {
   bool released = 0;
-  char type;            // D/G/etc.
-  int size;             // stationNum
-  Station sta[STA_NUM]; // stations (0-base)
-  int seat;             // seatNum
-  int price[STA_NUM];   // prefix sum of prices
+  char type;         // D/G/etc.
+  int size;          // stationNum
+  int seat;          // seatNum
+  Date date0, date1; // saleDate (start, end)
 
-  Date date0, date1;                   // saleDate (start, end)
-  int arrive[STA_NUM], leave[STA_NUM]; // time in the day
+  /**
+   * @warning must consider offset if the starting station is not sta[0]
+   */
+  bool invalid_date(const Date &dt) const { return dt < date0 || date1 < dt; }
+};
 
-  TrainInfo() {}
-  TrainInfo(int sta_num_, int seat_num_, const string &sta_str,
+/**
+ * @brief a row of a timetable: a train has exactly size of them, kept in
+ * TrainSystem::stops under (train, index), so that the rows of a train are
+ * consecutive entries of a leaf
+ */
+struct Stop {
+  int sta;           // station
+  int price;         // prefix sum of prices
+  int arrive, leave; // time in the day
+};
+
+/**
+ * @brief a train with its timetable, as read (see TrainSystem::get_train())
+ */
+struct Timetable : TrainInfo {
+  vector<Stop> stops; // stations (0-base)
+
+  Timetable() {}
+  Timetable(int sta_num_, int seat_num_, const string &sta_str,
             const string &prices_str, const Time &st_time,
             const string &trav_times_str, const string &stop_times_str,
-            const string &sale_date_str, char type_)
-      : size(sta_num_), seat(seat_num_), type(type_) {
+            const string &sale_date_str, char type_,
+            Dictionary<Station> &stations) {
+    size = sta_num_, seat = seat_num_, type = type_;
     Scanner scan(sta_str, '|');
+    Stop stop{};
     for (int i = 0; i < size; i++)
-      sta[i] = scan.next();
+      stop.sta = stations.intern(scan.next()), stops.push_back(stop);
 
     scan.init(prices_str, '|');
-    price[0] = 0;
     for (int i = 1; i < size; i++)
-      price[i] = price[i - 1] + scan.next_int();
+      stops[i].price = stops[i - 1].price + scan.next_int();
 
     scan.init(sale_date_str, '|');
     date0 = scan.next(), date1 = scan.next();
 
-    arrive[0] = leave[0] = st_time;
+    stops[0].arrive = stops[0].leave = st_time;
     scan.init(trav_times_str, '|');
     for (int i = 1; i < size; i++)
-      arrive[i] = scan.next_int(); // temporary
+      stops[i].arrive = scan.next_int(); // temporary
     scan.init(stop_times_str, '|');
     for (int i = 1; i < size; i++)
-      arrive[i] += leave[i - 1],
-          leave[i] = arrive[i] + scan.next_int(); // atoi(invalid string) = 0
+      stops[i].arrive += stops[i - 1].leave,
+          stops[i].leave =
+              stops[i].arrive + scan.next_int(); // atoi(invalid string) = 0
   }
 
-  /**
-   * @warning must consider offset if the starting station is not sta[0]
-   */
-  bool invalid_date(const Date &dt) const { return dt < date0 || date1 < dt; }
   /**
    * @brief total price from station no. l to no. r
    */
-  int total_price(int l, int r) const { return price[r] - price[l]; }
-  int total_time(int l, int r) const { return arrive[r] - leave[l]; }
+  int total_price(int l, int r) const {
+    return stops[r].price - stops[l].price;
+  }
+  int total_time(int l, int r) const {
+    return stops[r].arrive - stops[l].leave;
+  }
 };
 
 /**
@@ -65,7 +91,7 @@ struct TrainInfo {
  * supports interval addition and interval minimum query
  */
 struct SeatInfo {
-  int seat[STA_NUM];
+  int seat[STA_NUM] = {};
   int size;
 
   SeatInfo(int mx = 0, int sz = 0) : size(sz) {
@@ -88,11 +114,10 @@ struct SeatInfo {
  * @brief  maintains released trains that pass by a given station
  */
 struct Passby {
-  Train train;
-  int handle; // handle: quick access to train information
-  int idx;    // station index, i.e. TrainInfo.sta[idx] = station
+  int train; // id of the train
+  int idx;   // station index, i.e. Timetable.stops[idx].sta = station
   Passby() {}
-  Passby(const Train &tr, int hd, int i = 0) : train(tr), handle(hd), idx(i) {}
+  Passby(int tr, int i = 0) : train(tr), idx(i) {}
 };
 
 /**
@@ -100,68 +125,162 @@ struct Passby {
  */
 class TrainSystem {
 protected:
-  CachedBPT<ID, TrainInfo> trains;        // key: train
-  CachedBPT<TrainDay, SeatInfo> seats;    // key: (train, day)
-  CachedBPT<pair<ID, ID>, Passby> passby; // key: (station, train)
+  // ids of trains and stations, kept by clean() only (see Dictionary)
+  Dictionary<Train> train_names;
+  Dictionary<Station> station_names;
+  CachedBPT<int, TrainInfo> trains;         // key: train
+  CachedBPT<pair<int, int>, Stop> stops;    // key: (train, index)
+  CachedBPT<TrainDay, SeatInfo> seats;      // key: (train, day)
+  CachedBPT<pair<int, int>, Passby> passby; // key: (station, train)
+
+  static constexpr size_t RELEASED_CAP = 1 << 11;
+  Hashmap<int, Timetable> released_cache; // key: train, most recent first
+
+  /**
+   * @brief reads a train and its timetable: one leaf of stops, or two, however
+   * many stations it has
+   */
+  Timetable get_train(int tid) {
+    Timetable tr;
+    (TrainInfo &)tr = trains.get(tid); //! try catch throw for error info
+    auto it = stops.lower_bound(make_pair(tid, 0));
+    for (int i = 0; i < tr.size; i++, ++it)
+      tr.stops.push_back(it.value());
+    return tr;
+  }
+  /**
+   * @brief a released train (which never changes again) from a read-only LRU
+   * cache, without copying it
+   * @warning the reference is valid until the next trim_released()
+   */
+  const Timetable &released_train(int tid) {
+    auto it = released_cache.find(tid);
+    if (it != released_cache.end())
+      return it->second;
+    released_cache.insert(tid, get_train(tid));
+    return released_cache.begin()->second;
+  }
+  /**
+   * @brief evicts released trains beyond RELEASED_CAP, between commands (so
+   * the references handed out during a command are kept)
+   */
+  void trim_released() {
+    while (released_cache.size() > RELEASED_CAP)
+      released_cache.erase(--released_cache.end());
+  }
 
   virtual void clean() {
+    released_cache.clear();
+    train_names.clear();
+    station_names.clear();
     trains.clear();
+    stops.clear();
     seats.clear();
     passby.clear();
   }
+  virtual void vacuum() {
+    train_names.vacuum();
+    station_names.vacuum();
+    trains.vacuum();
+    stops.vacuum();
+    seats.vacuum();
+    passby.vacuum();
+  }
+  virtual void snapshot(int id) {
+    trains.snapshot(id);
+    stops.snapshot(id);
+    seats.snapshot(id);
+    passby.snapshot(id);
+  }
+  virtual void restore(int id) {
+    released_cache.clear(); // trains may differ in the snapshot
+    trains.restore(id);
+    stops.restore(id);
+    seats.restore(id);
+    passby.restore(id);
+  }
+  virtual void drop_snapshot(int id) {
+    trains.drop_snapshot(id);
+    stops.drop_snapshot(id);
+    seats.drop_snapshot(id);
+    passby.drop_snapshot(id);
+  }
 
 public:
   TrainSystem()
-      : trains("trains", RETRIEVE), seats("seats", RETRIEVE),
-        passby("trainsPassing", RETRIEVE) {}
+      : train_names("trainNames", RETRIEVE, STORAGE),
+        station_names("stationNames", RETRIEVE, STORAGE),
+        trains("trains", RETRIEVE, STORAGE, false, BLOOM_BITS, Index::HASH),
+        stops("stops", RETRIEVE, STORAGE),
+        seats("seats", RETRIEVE, STORAGE, false, 0, Index::TREE, PACKED),
+        passby("trainsPassing", RETRIEVE, STORAGE, false, BLOOM_BITS) {}
 
   void add_train(const Train &train, int sta_num, int seat_num,
                  const string &sta_str, const string &prices_str,
                  const Time &st_time, const string &trav_times_str,
                  const string &stop_times_str, const string &sale_date_str,
                  char type) {
-    ID tid = train.hash();
+    int tid = train_names.intern(train);
     if (trains.count(tid))
       throw "add_train() failed: train already exists";
-    TrainInfo tr(sta_num, seat_num, sta_str, prices_str, st_time,
-                 trav_times_str, stop_times_str, sale_date_str, type);
+    Timetable tr(sta_num, seat_num, sta_str, prices_str, st_time,
+                 trav_times_str, stop_times_str, sale_date_str, type,
+                 station_names);
     trains.insert(tid, tr);
+    vector<pair<pair<int, int>, Stop>> rows;
+    for (int i = 0; i < tr.size; i++)
+      rows.push_back(make_pair(make_pair(tid, i), tr.stops[i]));
+    stops.insert_sorted(rows); // keys are consecutive: one descent in total
     cout << "0\n";
   }
 
   void delete_train(const Train &train) {
-    ID tid = train.hash();
+    int tid = train_names.find(train);
     TrainInfo tr = trains.get(tid); //! try catch throw for further error info
     if (tr.released)
       throw "delete_train() failed: train already released";
     trains.erase(tid);
+    for (int i = 0; i < tr.size; i++)
+      stops.erase(make_pair(tid, i));
     cout << "0\n";
   }
 
   void release_train(const Train &train) {
-    ID tid = train.hash();
+    int tid = train_names.find(train);
     auto it = trains.find(tid);
-    TrainInfo tr = it.value(); //! try catch throw for further error info
+    if (!it)
+      throw "release_train() failed: train not found";
+    TrainInfo tr = it.value();
     if (tr.released)
-      throw "delete_train() failed: train already released";
+      throw "release_train() failed: train already released";
     tr.released = 1;
     it.set(tr);
     SeatInfo seatinfo = SeatInfo(tr.seat, tr.size - 1);
+    vector<pair<TrainDay, SeatInfo>> days;
     for (int i = 0, d = tr.date1 - tr.date0; i <= d; i++)
-      seats.insert(TrainDay(tid, i), seatinfo);
+      days.push_back(make_pair(TrainDay(tid, i), seatinfo));
+    seats.insert_sorted(days); // keys are consecutive: one descent in total
 
-    int handle = it.handle();
-    Passby psb(train, handle);
-    for (int i = 0; i < tr.size; i++) {
+    trim_released();
+    const Timetable &tt = released_train(tid);
+    Passby psb(tid);
+    vector<pair<pair<int, int>, Passby>> rows;
+    for (int i = 0; i < tt.size; i++) {
       psb.idx = i;
-      passby.insert(make_pair(tr.sta[i].hash(), tid), psb);
+      rows.push_back(make_pair(make_pair(tt.stops[i].sta, tid), psb));
     }
+    sort(rows, 0, tt.size - 1,
+         [](const pair<pair<int, int>, Passby> &lhs,
+            const pair<pair<int, int>, Passby> &rhs) {
+           return lhs.first < rhs.first;
+         });
+    passby.insert_sorted(rows);
     cout << "0\n";
   }
 
   void query_train(const Train &train, const Date &date) {
-    ID tid = train.hash();
-    TrainInfo tr = trains.get(tid); //! try catch throw for further error info
+    int tid = train_names.find(train);
+    Timetable tr = get_train(tid);
     if (tr.invalid_date(date))
       throw "query_train() failed: invalid date";
     cout << train << ' ' << tr.type << '\n';
@@ -169,17 +288,18 @@ public:
     if (tr.released)
       seatinfo = seats.get(TrainDay(tid, date - tr.date0));
     for (int i = 0; i < tr.size; i++) {
-      cout << tr.sta[i] << ' ';
+      const Stop &stop = tr.stops[i];
+      cout << station_names[stop.sta] << ' ';
       if (i == 0)
         cout << "xx-xx xx:xx";
       else
-        cout << DateTime(date, tr.arrive[i]);
+        cout << DateTime(date, stop.arrive);
       cout << " -> ";
       if (i == tr.size - 1)
         cout << "xx-xx xx:xx";
       else
-        cout << DateTime(date, tr.leave[i]);
-      cout << ' ' << tr.price[i] << ' ';
+        cout << DateTime(date, stop.leave);
+      cout << ' ' << stop.price << ' ';
       if (i == tr.size - 1) {
         cout << "x\n";
         break;
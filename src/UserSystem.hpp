@@ -34,9 +34,17 @@ protected:
     users.clear();
     logged_in.clear();
   }
+  virtual void vacuum() { users.vacuum(); }
+  virtual void snapshot(int id) { users.snapshot(id); }
+  virtual void restore(int id) {
+    users.restore(id);
+    logged_in.clear();
+  }
+  virtual void drop_snapshot(int id) { users.drop_snapshot(id); }
 
 public:
-  UserSystem() : users("users", RETRIEVE) {}
+  UserSystem() : users("users", RETRIEVE, STORAGE, false, BLOOM_BITS,
+                       Index::HASH) {}
 
   void add_user(const Usr &cur_usr, const Usr &usr, const Pwd &pwd,
                 const Name &name, const Mail &mail, int pri) {
@@ -1,4 +1,10 @@
 #define RETRIEVE true
+#define POOL_BYTES (size_t(1) << 26) // default budget of the buffer pool
+#ifndef STORAGE // e.g. -DSTORAGE=Storage::MEMORY to measure without I/O
+#define STORAGE Storage::MAPPED // access to node/value files (see Storage)
+#endif
+#define BLOOM_BITS (size_t(1) << 23) // Bloom filters of lookup-heavy trees
+#define PACKED true // compressed value pages for padded records (PackedFile)
 
 #ifdef DEBUG
 #include <cassert>
@@ -9,6 +15,30 @@
 
 #include "TicketSystem.hpp"
 #include <cstdio>
+#include <cstdlib>
+
+/**
+ * @return budget of the buffer pool: bytes given by the environment variable
+ * POOL_BYTES (with an optional K/M/G suffix), or else the POOL_BYTES macro
+ * (also when the variable is not a positive size)
+ */
+size_t pool_bytes() {
+  const char *env = getenv("POOL_BYTES");
+  if (!env || !*env)
+    return POOL_BYTES;
+  char *end = (char *)env;
+  size_t n = *env == '-' ? 0 : strtoull(env, &end, 10);
+  const char *units = "KMG";
+  for (int i = 0; units[i]; i++)
+    if ((*end | 32) == (units[i] | 32)) {
+      n <<= 10 * (i + 1), end++;
+      break;
+    }
+  if (n && !*end)
+    return n;
+  cerr << "bad POOL_BYTES " << env << ", using the default" << endl;
+  return POOL_BYTES;
+}
 
 struct ArgMap {
   string a[26];
@@ -18,6 +48,9 @@ struct ArgMap {
 
 int main() {
   ios::sync_with_stdio(0);
+  WAL wal; // recovers the files before the trees open them
+  Database db; // holds the files of all the trees
+  BufferPool<> pool(pool_bytes(), true, true); // shared, with a writer thread
   TicketSystem sys;
 
   string input, op_time, op;
@@ -81,6 +114,14 @@ int main() {
       // global
       else if (op == "clean") {
         sys.clean();
+      } else if (op == "vacuum") {
+        sys.vacuum();
+      } else if (op == "create_snapshot") {
+        sys.create_snapshot();
+      } else if (op == "restore_snapshot") {
+        sys.restore_snapshot(to_int(arg['i']));
+      } else if (op == "delete_snapshot") {
+        sys.delete_snapshot(to_int(arg['i']));
       } else if (op == "exit") {
         cout << "bye" << endl;
         return 0;
@@ -88,6 +129,7 @@ int main() {
     } catch (const char *s) {
       cout << "-1\n";
     }
+    wal.commit();
   }
 
   return cout << flush, 0;
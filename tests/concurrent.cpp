@@ -0,0 +1,92 @@
+/**
+ * @brief stress test of concurrent mode: one writer inserts, rewrites and
+ * erases keys while reader threads scan the tree and look keys up; every
+ * value a reader gets must be whole, and one stored under its key
+ */
+#include "CachedBPT.hpp"
+#include <cstdio>
+#include <random>
+#include <thread>
+
+/**
+ * @brief a value too large to be inlined (see BPT::INLINE), so that readers
+ * go through value_file
+ */
+struct Big {
+  size_t key, gen;
+  char pad[160 - 2 * sizeof(size_t)];
+
+  Big(size_t key_ = 0, size_t gen_ = 0) : key(key_), gen(gen_) {
+    memset(pad, (int)(key + gen), sizeof(pad));
+  }
+  bool whole() const {
+    for (size_t i = 0; i < sizeof(pad); i++)
+      if (pad[i] != (char)(key + gen))
+        return false;
+    return true;
+  }
+};
+
+constexpr size_t KEYS = 1 << 14, ROUNDS = 6, READERS = 4;
+
+bool stress(const char *name, Storage storage) {
+  CachedBPT<size_t, Big> tr(name, false, storage, true);
+  std::atomic<bool> done(false), bad(false);
+  auto check = [&](size_t key, const Big &val) {
+    if (val.key != key || !val.whole())
+      bad = true;
+  };
+
+  std::thread readers[READERS];
+  for (size_t r = 0; r < READERS; r++) {
+    readers[r] = std::thread([&, r] {
+      std::mt19937_64 rng(r);
+      Big val;
+      while (!done && !bad) {
+        size_t last = 0;
+        bool first = true;
+        for (auto it = tr.begin(); it; ++it) {
+          if (!first && !(last < it.key()))
+            bad = true; // a scan goes in ascending order
+          last = it.key(), first = false;
+          if (it.try_value(val))
+            check(it.key(), val);
+        }
+        for (size_t i = 0; i < KEYS; i++) {
+          size_t key = rng() % KEYS;
+          auto it = tr.find(key);
+          if (it && it.try_value(val))
+            check(key, val);
+        }
+      }
+    });
+  }
+
+  std::mt19937_64 rng(READERS);
+  for (size_t gen = 1; gen <= ROUNDS && !bad; gen++) {
+    for (size_t i = 0; i < KEYS; i++) {
+      size_t key = rng() % KEYS;
+      auto it = tr.find(key);
+      if (!it)
+        tr.insert(key, Big(key, gen));
+      else if (rng() % 3)
+        tr.set(key, Big(key, gen));
+      else
+        tr.erase(key);
+    }
+  }
+  done = true;
+  for (auto &t : readers)
+    t.join();
+  tr.clear();
+  printf("%s: %s\n", name, bad ? "failed" : "ok");
+  return !bad;
+}
+
+int main() {
+  BufferPool<> pool(1 << 20, true, true);
+  bool ok = stress("stress_mapped", Storage::MAPPED);
+  ok = stress("stress_fstream", Storage::FSTREAM) && ok;
+  ok = stress("stress_direct", Storage::DIRECT) && ok;
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,109 @@
+/**
+ * @brief checks KeySearch against the branchless binary search on random
+ * sorted key arrays of every node size, then times both on nodes as large as
+ * those of BPT (the keys searched are the ones the tree actually uses)
+ * usage: keysearch_test [rounds], where rounds = 0 skips the timing
+ */
+#include "KeySearch.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+
+using std::size_t;
+
+std::mt19937_64 rng(2026);
+
+template <class T> T random_key(T range) { return T(rng() % range); }
+template <class T> pair<T, T> random_key(pair<T, T> range) {
+  return pair<T, T>(random_key(range.first), random_key(range.second));
+}
+
+/**
+ * @brief n sorted keys, with runs of equal firsts for pairs (a small range)
+ */
+template <class Key> void fill(Key *a, size_t n, Key range) {
+  for (size_t i = 0; i < n; i++)
+    a[i] = random_key(range);
+  for (size_t i = 1; i < n; i++) // insertion sort
+    for (size_t j = i; j && key_less(a[j], a[j - 1]); j--)
+      std::swap(a[j], a[j - 1]);
+}
+
+template <class Key> bool check(const char *name, Key range) {
+  constexpr size_t N = 512;
+  static Key a[N];
+  for (size_t n = 0; n <= N; n++) {
+    fill(a, n, range);
+    for (size_t q = 0; q < 64; q++) {
+      Key x = q & 1 || !n ? random_key(range) : a[rng() % n];
+      if (KeySearch<Key>::lower_bound(a, n, x) !=
+              BinarySearch<Key>::lower_bound(a, n, x) ||
+          KeySearch<Key>::upper_bound(a, n, x) !=
+              BinarySearch<Key>::upper_bound(a, n, x)) {
+        printf("%s: wrong result for n = %zu\n", name, n);
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+/**
+ * @brief ns per lower_bound over NODES nodes of n keys (more than L1 holds)
+ */
+template <class Search, class Key>
+double time_search(const Key *a, size_t n, const Key *xs, size_t rounds) {
+  constexpr size_t NODES = 256, QUERIES = 1 << 12;
+  size_t sum = 0;
+  auto t0 = std::chrono::steady_clock::now();
+  for (size_t r = 0; r < rounds; r++)
+    for (size_t q = 0; q < QUERIES; q++)
+      sum += Search::lower_bound(a + q % NODES * n, n, xs[q]);
+  auto t1 = std::chrono::steady_clock::now();
+  if (sum == size_t(-1))
+    puts(""); // keeps sum alive
+  return std::chrono::duration<double, std::nano>(t1 - t0).count() / rounds /
+         QUERIES;
+}
+
+template <class Key>
+void bench(const char *name, size_t n, Key range, size_t rounds) {
+  constexpr size_t NODES = 256, QUERIES = 1 << 12;
+  Key *a = new Key[NODES * n], *xs = new Key[QUERIES];
+  for (size_t i = 0; i < NODES; i++)
+    fill(a + i * n, n, range);
+  for (size_t q = 0; q < QUERIES; q++)
+    xs[q] = random_key(range);
+  double bin = time_search<BinarySearch<Key>>(a, n, xs, rounds),
+         key = time_search<KeySearch<Key>>(a, n, xs, rounds);
+  printf("%-22s n = %3zu: binary %5.1f ns, KeySearch %5.1f ns (%.2fx)\n", name,
+         n, bin, key, bin / key);
+  delete[] a, delete[] xs;
+}
+
+int main(int argc, char **argv) {
+  size_t rounds = argc > 1 ? strtoull(argv[1], nullptr, 10) : 200;
+  bool ok = check<size_t>("size_t", 1 << 20);
+  ok = check<pair<size_t, size_t>>("pair<size_t, size_t>", {64, 1 << 20}) &&
+       ok;
+  ok = check<int>("int", 1 << 20) && ok;
+  ok = check<pair<int, int>>("pair<int, int>", {64, 1 << 20}) && ok;
+#ifdef KEY_SEARCH_AVX2
+  printf("avx2: %s\n", has_avx2 ? "yes" : "no");
+#endif
+  if (ok && rounds) {
+    // full nodes of BPT<Key, int> (see BPT::szleaf), and half-full ones
+    for (size_t n : {332, 166})
+      bench<size_t>("size_t", n, 1 << 30, rounds);
+    for (size_t n : {199, 100})
+      bench<pair<size_t, size_t>>("pair<size_t, size_t>", n, {1 << 10, 1 << 20},
+                                  rounds);
+    for (size_t n : {499, 250})
+      bench<int>("int", n, 1 << 30, rounds);
+    for (size_t n : {332, 166})
+      bench<pair<int, int>>("pair<int, int>", n, {1 << 10, 1 << 20}, rounds);
+  }
+  puts(ok ? "keysearch: ok" : "keysearch: failed");
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,120 @@
+/**
+ * @brief test of LSM (the store of orders): random inserts, sets and erases
+ * through a small memtable, so that runs are written out and merged all
+ * along, with snapshots taken, restored and dropped; after each restore the
+ * store must hold what it held when the snapshot was taken, in a scan from
+ * begin(), in find()s and in lower_bound()s
+ * then the store is reopened (its lists of runs are read back), every
+ * snapshot is dropped and the store vacuumed: its runs must be no larger
+ * than those of a store that only ever held the same elements
+ */
+#include "LSM.hpp"
+#include <cstdio>
+#include <map>
+#include <random>
+
+constexpr size_t KEYS = 1 << 12, STEPS = 1 << 15;
+using Map = std::map<size_t, size_t>; // key -> gen of its value
+using Store = LSM<size_t, size_t, 1 << 12>; // about 170 records a memtable
+
+bool same(Store &st, const Map &m) {
+  auto at = m.begin();
+  for (auto it = st.begin(); it; ++it, ++at)
+    if (at == m.end() || it.key() != at->first || it.value() != at->second)
+      return false;
+  if (at != m.end())
+    return false;
+  for (size_t key = 0; key < KEYS; key += 7) {
+    auto x = m.find(key), lb = m.lower_bound(key);
+    auto it = st.find(key), jt = st.lower_bound(key);
+    if (x == m.end() ? bool(it) : !it || it.value() != x->second)
+      return false;
+    if (lb == m.end() ? bool(jt) : !jt || jt.key() != lb->first)
+      return false;
+  }
+  return true;
+}
+
+/**
+ * @return bytes in the runs of store name (which must be closed: an open run
+ * is mapped in extents)
+ */
+size_t run_bytes(const char *name) {
+  string prefix = string("LSM_") + name + "_run";
+  size_t n = 0;
+  for (auto &f : std::filesystem::directory_iterator("./bin"))
+    if (f.path().filename().string().rfind(prefix, 0) == 0)
+      n += f.file_size();
+  return n;
+}
+
+bool run(const char *name, Storage storage) {
+  bool ok = true;
+  std::mt19937_64 rng(7);
+  Map live;
+  std::map<int, Map> snaps;
+  int next_id = 1;
+  Store *st = new Store(name, false, storage);
+  for (size_t step = 1; step <= STEPS && ok; step++) {
+    size_t key = rng() % KEYS, r = rng() % 1024;
+    if (r < 4) { // snapshot
+      st->snapshot(next_id), snaps[next_id++] = live;
+    } else if (r < 6 && !snaps.empty()) { // restore, then compare
+      auto s = snaps.begin();
+      std::advance(s, rng() % snaps.size());
+      st->restore(s->first), live = s->second;
+      ok = same(*st, live);
+    } else if (r < 8 && !snaps.empty()) { // drop
+      auto s = snaps.begin();
+      std::advance(s, rng() % snaps.size());
+      st->drop_snapshot(s->first), snaps.erase(s);
+    } else if (!live.count(key)) {
+      st->insert(key, step), live[key] = step;
+    } else if (r % 3) {
+      st->set(key, step), live[key] = step;
+    } else {
+      st->erase(key), live.erase(key);
+    }
+  }
+  ok = ok && same(*st, live);
+  size_t before = 0; // bytes in the runs while the snapshots exist
+  if (storage != Storage::MEMORY) {
+    delete st;
+    before = run_bytes(name);
+    st = new Store(name, true, storage);
+    ok = ok && same(*st, live);
+  }
+  for (auto &s : snaps) // every snapshot still holds what it held
+    if (ok) {
+      st->restore(s.first), live = s.second;
+      ok = same(*st, live);
+    }
+  for (auto &s : snaps)
+    st->drop_snapshot(s.first);
+  ok = ok && same(*st, live);
+  st->vacuum();
+  ok = ok && same(*st, live);
+  delete st;
+  // a store that held the same elements, and nothing else
+  string fresh_name = string(name) + "_fresh";
+  {
+    Store fresh(fresh_name, false, storage);
+    for (auto &x : live)
+      fresh.insert(x.first, x.second);
+    fresh.vacuum();
+  }
+  size_t used = run_bytes(name), least = run_bytes(fresh_name.c_str());
+  if (storage != Storage::MEMORY && (used > least || used >= before))
+    ok = false;
+  printf("%s: %zu snapshots, %zu keys, %zu bytes (%zu before, %zu fresh): "
+         "%s\n",
+         name, snaps.size(), live.size(), used, before, least,
+         ok ? "ok" : "failed");
+  return ok;
+}
+
+int main() {
+  bool ok = run("lsm_mapped", Storage::MAPPED);
+  ok = run("lsm_memory", Storage::MEMORY) && ok;
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,208 @@
+/**
+ * @brief test of LZ and PackedFile: pages of zeros, of random bytes
+ * (incompressible), of repeated records and of long runs (lengths spilling
+ * into several bytes), and random mixtures of them, must come back as they
+ * were; truncated data must be rejected, and corrupted data either rejected
+ * or decoded without writing past the page
+ * then pages are written to a PackedFile, in memory and in files, rewritten
+ * with other contents (so that blobs move and are reused), read back across
+ * page boundaries and after reopening; a blob cut off by a truncated file
+ * must be rejected
+ */
+#include "PackedFile.hpp"
+#include <cstdio>
+#include <random>
+#include <sstream>
+
+constexpr size_t PAGE = 4096;
+std::mt19937_64 rng(2026);
+
+/**
+ * @brief a page of kind k: zeros, random bytes, a repeated 64-byte record
+ * (mostly padding), a byte repeated, a 3-byte pattern, or a random mixture
+ * of literals, zero runs and copies of earlier bytes
+ */
+string page_of(int k) {
+  string s(PAGE, '\0');
+  if (k == 1) {
+    for (auto &c : s)
+      c = (char)rng();
+  } else if (k == 2) {
+    for (size_t i = 0; i < PAGE; i += 64)
+      s[i] = (char)(i / 64), s[i + 1] = 'x';
+  } else if (k == 3) {
+    s.assign(PAGE, 'a');
+  } else if (k == 4) {
+    for (size_t i = 0; i < PAGE; i++)
+      s[i] = "abc"[i % 3];
+  } else if (k == 5) {
+    for (size_t i = 0, n; i < PAGE; i += n) {
+      n = std::min(PAGE - i, size_t(rng() % 700 + 1));
+      size_t how = rng() % 3, off = i ? rng() % i + 1 : 0;
+      for (size_t j = i; j < i + n; j++)
+        s[j] = how == 0 ? (char)rng() : how == 1 || !off ? 0 : s[j - off];
+    }
+  }
+  return s;
+}
+
+/**
+ * @brief compresses src and decompresses it again
+ * @return whether it came back, within LZ::bound() bytes
+ */
+bool round_trip(const string &src) {
+  string packed(LZ::bound(src.size()), '\0'), out(src.size(), '\1');
+  size_t n = LZ::compress(src.data(), src.size(), &packed[0]);
+  if (n > packed.size())
+    return false;
+  packed.resize(n);
+  LZ::decompress(packed.data(), n, &out[0], out.size());
+  return out == src;
+}
+
+/**
+ * @brief decompresses packed into a page followed by guard bytes
+ * @return false if it was rejected, true if it was decoded (into a page of
+ * any contents)
+ * @throws if the guard was overwritten, either way
+ */
+bool decode(const string &packed) {
+  constexpr size_t GUARD = 1 << 16;
+  string out(PAGE + GUARD, '\x5a');
+  bool decoded = true;
+  try {
+    LZ::decompress(packed.data(), packed.size(), &out[0], PAGE);
+  } catch (const char *) {
+    decoded = false;
+  }
+  for (size_t i = PAGE; i < out.size(); i++)
+    if (out[i] != '\x5a')
+      throw "decompress() wrote past the page";
+  return decoded;
+}
+
+bool codec() {
+  bool ok = true;
+  size_t zeros = 0;
+  for (int k = 0; k < 6; k++)
+    for (int t = 0; t < (k == 5 ? 1000 : 4); t++)
+      ok = round_trip(page_of(k)) && ok;
+  for (size_t n = 0; n <= 64; n++) // short inputs, with no room for a match
+    ok = round_trip(string(n, '\0')) && round_trip(page_of(1).substr(0, n)) &&
+         ok;
+  { // a page of zeros takes a few bytes: one match with a long length
+    string src = page_of(0), packed(LZ::bound(PAGE), '\0');
+    zeros = LZ::compress(src.data(), PAGE, &packed[0]);
+    ok = ok && zeros < 32;
+  }
+  size_t rejected = 0, decoded = 0;
+  for (int k : {0, 2, 5}) {
+    string src = page_of(k), packed(LZ::bound(PAGE), '\0');
+    packed.resize(LZ::compress(src.data(), PAGE, &packed[0]));
+    for (size_t n = 0; n < packed.size(); n++) // every truncation
+      if (decode(packed.substr(0, n)))
+        ok = false;
+    for (size_t i = 0; i < packed.size(); i++) // every byte, corrupted
+      for (int bit : {0x01, 0x10, 0x80}) {
+        string bad = packed;
+        bad[i] ^= bit;
+        decode(bad) ? decoded++ : rejected++;
+      }
+  }
+  printf("codec: %zu bytes for a page of zeros, %zu corruptions rejected, "
+         "%zu decoded: %s\n",
+         zeros, rejected, decoded, ok ? "ok" : "failed");
+  return ok;
+}
+
+/**
+ * @brief writes random pages (some across page boundaries) to f, rewrites
+ * them with other kinds, and checks every byte against image
+ */
+bool fill(PackedFile &f, string &image, size_t pages) {
+  f.append(pages * PAGE - f.size());
+  image.resize(pages * PAGE, '\0');
+  for (size_t t = 0; t < pages * 8; t++) {
+    size_t pos = rng() % (pages * PAGE), n = rng() % (2 * PAGE) + 1;
+    n = std::min(n, pages * PAGE - pos);
+    string src = page_of(rng() % 6).substr(0, std::min(n, PAGE));
+    src.resize(n, '\0');
+    f.write(src.data(), n, pos);
+    image.replace(pos, n, src);
+  }
+  string out(image.size(), '\1');
+  f.read(&out[0], out.size(), 0);
+  if (out != image)
+    return false;
+  for (size_t t = 0; t < 256; t++) { // unaligned reads
+    size_t pos = rng() % image.size(), n = rng() % (image.size() - pos) + 1;
+    string part(n, '\1');
+    f.read(&part[0], n, pos);
+    if (part != image.substr(pos, n))
+      return false;
+  }
+  return true;
+}
+
+bool packed() {
+  constexpr size_t PAGES = 64;
+  bool ok = true;
+  string image;
+  {
+    PackedFile f;
+    f.open(PAGE);
+    ok = fill(f, image, PAGES);
+  }
+  std::filesystem::create_directory("./bin");
+  string data = "./bin/lz_data.bin", table = "./bin/lz_table.bin", state;
+  {
+    PackedFile f;
+    f.open(PAGE, data, table, true);
+    string zeros(PAGES * PAGE, '\1');
+    f.append(PAGES * PAGE);
+    f.read(&zeros[0], zeros.size(), 0); // never written: zeros
+    ok = ok && zeros == string(PAGES * PAGE, '\0');
+    image.clear();
+    ok = ok && fill(f, image, PAGES);
+    state = f.state(true);
+  }
+  size_t bytes = std::filesystem::file_size(data);
+  {
+    PackedFile f;
+    f.open(PAGE, data, table);
+    std::istringstream fs(state);
+    f.restore(fs);
+    string out(image.size(), '\1');
+    f.read(&out[0], out.size(), 0);
+    ok = ok && f.size() == image.size() && out == image;
+    ok = ok && fill(f, image, PAGES);
+  }
+  std::filesystem::resize_file(data, bytes / 2);
+  size_t damaged = 0;
+  {
+    PackedFile f;
+    f.open(PAGE, data, table);
+    string out(PAGE, '\0');
+    for (size_t k = 0; k < PAGES; k++)
+      try {
+        f.read(&out[0], PAGE, k * PAGE);
+      } catch (const char *) {
+        damaged++;
+      }
+  }
+  ok = ok && damaged > 0;
+  printf("packed: %zu pages in %zu bytes, %zu damaged after truncation: %s\n",
+         PAGES, bytes, damaged, ok ? "ok" : "failed");
+  return ok;
+}
+
+int main() {
+  bool ok = false;
+  try {
+    ok = codec();
+    ok = packed() && ok;
+  } catch (const char *e) {
+    printf("%s\n", e);
+  }
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,256 @@
+/**
+ * @brief test of copy-on-write snapshots: random inserts, sets and erases,
+ * with snapshots taken, restored and dropped along the way; after each
+ * restore the tree must hold what it held when the snapshot was taken, and
+ * scans in both directions must match a std::map
+ * then every snapshot is dropped and the tree vacuumed: its files must be no
+ * larger than those of a tree that only ever held the same elements
+ * hashed tables (Index::HASH) are tested the same way, and grown from empty
+ * under snapshots, so that their directories double over several pages
+ */
+#include "CachedBPT.hpp"
+#include <cstdio>
+#include <map>
+#include <random>
+#include <vector>
+
+/**
+ * @brief a value too large to be inlined (see BPT::INLINE), so that values
+ * are shared with snapshots through their reference counts too
+ */
+struct Big {
+  size_t gen;
+  char pad[100 - sizeof(size_t)];
+
+  Big(size_t gen_ = 0) : gen(gen_) { memset(pad, (int)gen, sizeof(pad)); }
+  bool whole() const {
+    for (size_t i = 0; i < sizeof(pad); i++)
+      if (pad[i] != (char)gen)
+        return false;
+    return true;
+  }
+};
+size_t gen_of(size_t val) { return val; }
+size_t gen_of(const Big &val) { return val.whole() ? val.gen : size_t(-1); }
+
+constexpr size_t KEYS = 1 << 13, STEPS = 1 << 15;
+using Map = std::map<size_t, size_t>; // key -> gen of its value
+
+/**
+ * @brief compares the tree with m: count() of every key below keys (which
+ * goes through the Bloom filter, if any), a forward scan (in the order of
+ * keys if ordered), a backward scan from end(), and a few lower_bound()s
+ * (backward scans and bounds only if ordered)
+ */
+template <class Tree>
+bool same(Tree &tr, const Map &m, bool ordered, size_t keys = KEYS) {
+  for (size_t key = 0; key < keys; key++)
+    if (tr.count(key) != (bool)m.count(key))
+      return false;
+  auto at = m.begin();
+  size_t n = 0;
+  for (auto it = tr.begin(); it; ++it, ++n) {
+    auto x = ordered ? at++ : m.find(it.key());
+    if (x == m.end() || it.key() != x->first ||
+        gen_of(it.value()) != x->second)
+      return false;
+  }
+  if (n != m.size())
+    return false;
+  if (!ordered)
+    return true;
+  auto rat = m.rbegin();
+  auto it = tr.end();
+  for (size_t i = 0; i < m.size(); i++, ++rat) {
+    --it;
+    if (!it || it.key() != rat->first)
+      return false;
+  }
+  for (size_t key = 0; key < KEYS; key += KEYS / 16) {
+    auto lb = m.lower_bound(key);
+    auto it = tr.lower_bound(key);
+    if (lb == m.end() ? bool(it) : !it || it.key() != lb->first)
+      return false;
+  }
+  return true;
+}
+
+/**
+ * @return bytes in the node and value files of tree name
+ */
+size_t file_bytes(const char *name) {
+  size_t n = 0;
+  for (const char *f : {"_node.bin", "_value.bin"}) {
+    string path = string("./bin/BPT_") + name + f;
+    if (std::filesystem::exists(path))
+      n += std::filesystem::file_size(path);
+  }
+  return n;
+}
+
+/**
+ * @param bloom_bits > 0: the tree keeps a Bloom filter; before the snapshots
+ * are restored for the last time, it is reopened with its filter file removed
+ * (so that the filter is rebuilt from the live tree only, and the keys of the
+ * snapshots come from their saved filters), and with the files of these
+ * removed too if lose_snaps (so that they come from the trees of snapshots)
+ */
+template <class T>
+bool run(const char *name, Storage storage, Index index = Index::TREE,
+         bool concurrent = false, size_t bloom_bits = 0,
+         bool lose_snaps = false) {
+  using Tree = CachedBPT<size_t, T>;
+  bool ordered = index == Index::TREE, ok = true;
+  std::mt19937_64 rng(7);
+  Map live;
+  std::map<int, Map> snaps;
+  int next_id = 1;
+  size_t before; // bytes in the files while the snapshots exist
+  {
+    Tree *tr = new Tree(name, false, storage, concurrent, bloom_bits, index);
+    for (size_t step = 1; step <= STEPS && ok; step++) {
+      size_t key = rng() % KEYS, r = rng() % 1024;
+      if (r < 4) { // snapshot
+        tr->snapshot(next_id), snaps[next_id++] = live;
+      } else if (r < 6 && !snaps.empty()) { // restore, then compare
+        auto s = snaps.begin();
+        std::advance(s, rng() % snaps.size());
+        tr->restore(s->first), live = s->second;
+        ok = same(*tr, live, ordered);
+      } else if (r < 8 && !snaps.empty()) { // drop
+        auto s = snaps.begin();
+        std::advance(s, rng() % snaps.size());
+        tr->drop_snapshot(s->first), snaps.erase(s);
+      } else if (!live.count(key)) {
+        tr->insert(key, T(step)), live[key] = step;
+      } else if (r % 3) {
+        tr->set(key, T(step)), live[key] = step;
+      } else {
+        tr->erase(key), live.erase(key);
+      }
+    }
+    ok = ok && same(*tr, live, ordered);
+    if (bloom_bits) {
+      delete tr;
+      string prefix = string("./bin/BPT_") + name;
+      std::filesystem::remove(prefix + "_bloom.bin");
+      if (lose_snaps)
+        std::filesystem::remove(prefix + "_snap_bloom.bin");
+      tr = new Tree(name, true, storage, concurrent, bloom_bits, index);
+    }
+    for (auto &s : snaps) // every snapshot still holds what it held
+      if (ok) {
+        tr->restore(s.first), live = s.second;
+        ok = same(*tr, live, ordered);
+      }
+    before = file_bytes(name);
+    for (auto &s : snaps)
+      tr->drop_snapshot(s.first);
+    ok = ok && same(*tr, live, ordered);
+    tr->vacuum();
+    ok = ok && same(*tr, live, ordered);
+    delete tr;
+  }
+  // a tree that held the same elements, and nothing else
+  string fresh_name = string(name) + "_fresh";
+  {
+    Tree fresh(fresh_name, false, storage, false, 0, index);
+    for (auto &x : live)
+      fresh.insert(x.first, T(x.second));
+    fresh.vacuum();
+  }
+  size_t used = file_bytes(name), least = file_bytes(fresh_name.c_str());
+  if (storage != Storage::MEMORY && (used > least || used >= before))
+    ok = false;
+  printf("%s: %zu snapshots, %zu keys, %zu bytes (%zu before, %zu fresh): "
+         "%s\n",
+         name, snaps.size(), live.size(), used, before, least,
+         ok ? "ok" : "failed");
+  return ok;
+}
+
+constexpr size_t GROW_KEYS = 1 << 17, GROW_SNAPS = 8;
+
+/**
+ * @brief grows a hashed table from empty to GROW_KEYS keys, so that its
+ * buckets split and its directory doubles over several pages while shared
+ * with snapshots (one every GROW_KEYS / GROW_SNAPS inserts); then erases the
+ * keys of the first quarter of the hashes but a few, so that its buckets
+ * merge into one filling a page, and inserts GROW_KEYS keys elsewhere, so
+ * that the directory doubles again (and that bucket is halved)
+ * finally each snapshot is restored and compared, then grown by new keys
+ * (which reuse the nodes freed, so that a node freed too early is caught) and
+ * compared again; all are dropped at last
+ */
+bool grow(const char *name, Storage storage) {
+  using Tree = CachedBPT<size_t, size_t>;
+  constexpr size_t range = GROW_KEYS * 4, quarter = size_t(1) << 62,
+                   every = GROW_KEYS / GROW_SNAPS;
+  std::mt19937_64 rng(7);
+  Map live;
+  std::vector<std::vector<pair<size_t, size_t>>> snaps; // sorted elements
+  size_t step = 0;
+  bool ok = true;
+  Tree tr(name, false, storage, false, 0, Index::HASH);
+  // inserts a new key (in the first quarter too if low), after a snapshot
+  // every every inserts if snap
+  auto insert = [&](bool low, bool snap) {
+    size_t key;
+    do
+      key = rng() % range;
+    while (live.count(key) || (!low && BloomHash<size_t>::of(key) < quarter));
+    if (step++ % every == 0 && snap) {
+      tr.snapshot(snaps.size() + 1);
+      snaps.push_back(std::vector<pair<size_t, size_t>>(live.begin(),
+                                                        live.end()));
+    }
+    tr.insert(key, step), live[key] = step;
+  };
+  while (live.size() < GROW_KEYS)
+    insert(true, true);
+  size_t kept = 0;
+  for (auto it = live.begin(); it != live.end();) {
+    if (BloomHash<size_t>::of(it->first) < quarter && kept++ >= 16)
+      tr.erase(it->first), it = live.erase(it);
+    else
+      ++it;
+  }
+  for (size_t i = 0; i < GROW_KEYS; i++)
+    insert(false, true);
+  ok = same(tr, live, false, range);
+  for (size_t i = snaps.size(); i-- && ok;) {
+    tr.restore(i + 1);
+    live = Map(snaps[i].begin(), snaps[i].end());
+    ok = same(tr, live, false, range);
+    for (size_t j = 0; j < every && ok; j++)
+      insert(true, false);
+    ok = ok && same(tr, live, false, range);
+  }
+  for (size_t i = 0; i < snaps.size(); i++)
+    tr.drop_snapshot(i + 1);
+  ok = ok && same(tr, live, false, range);
+  printf("%s: %zu snapshots, %zu steps: %s\n", name, snaps.size(), step,
+         ok ? "ok" : "failed");
+  return ok;
+}
+
+int main() {
+  bool ok = run<size_t>("snap_inline", Storage::MAPPED);
+  ok = run<Big>("snap_mapped", Storage::MAPPED) && ok;
+  ok = run<Big>("snap_fstream", Storage::FSTREAM) && ok;
+  ok = run<Big>("snap_direct", Storage::DIRECT) && ok;
+  ok = run<Big>("snap_memory", Storage::MEMORY) && ok;
+  ok = run<Big>("snap_concurrent", Storage::MAPPED, Index::TREE, true) && ok;
+  // the filter of each snapshot is saved with it, and reloaded on restore
+  ok = run<Big>("snap_bloom", Storage::MAPPED, Index::TREE, false, 1 << 16) &&
+       ok;
+  ok = run<Big>("snap_bloom_lost", Storage::FSTREAM, Index::TREE, false,
+                1 << 16, true) &&
+       ok;
+  // a page of a hash directory is shared like a node, and holds a reference
+  // to each bucket in it
+  ok = run<size_t>("snap_hash_inline", Storage::MAPPED, Index::HASH) && ok;
+  ok = run<Big>("snap_hash", Storage::FSTREAM, Index::HASH) && ok;
+  ok = grow("snap_hash_grow", Storage::MAPPED) && ok;
+  return ok ? 0 : 1;
+}
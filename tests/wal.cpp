@@ -0,0 +1,216 @@
+/**
+ * @brief crash test of the WAL: a child process runs a random sequence of
+ * commands on a tree, one writing command each, and is killed with SIGKILL in
+ * the middle of a group (after a command that is not committed); after
+ * recovery, the tree must hold the state after some prefix of the sequence,
+ * no shorter than the commands the log had made durable
+ * the cases cover a crash within the first group commits, one after a
+ * checkpoint (the log passing WAL::CHECKPOINT), and a log with a torn or
+ * corrupted last command appended, which recovery must drop (FNV checksum)
+ */
+#include "CachedBPT.hpp"
+#include <cstdio>
+#include <random>
+#include <signal.h>
+#include <sys/wait.h>
+
+/**
+ * @brief a value too large to be inlined (see BPT::INLINE), whose writes
+ * wait in memory until their log group is durable
+ */
+struct Val {
+  size_t key, gen;
+  char pad[96 - 2 * sizeof(size_t)];
+
+  Val(size_t key_ = 0, size_t gen_ = 0) : key(key_), gen(gen_) {
+    memset(pad, (int)(key ^ gen), sizeof(pad));
+  }
+  bool whole() const {
+    for (size_t i = 0; i < sizeof(pad); i++)
+      if (pad[i] != (char)(key ^ gen))
+        return false;
+    return true;
+  }
+};
+
+constexpr size_t KEYS = 1 << 12, NONE = size_t(-1);
+
+/**
+ * @brief the sequence of commands: command gen inserts key with gen as its
+ * value, or else sets or erases it; state[key] = gen of its value, or NONE
+ */
+struct Commands {
+  std::mt19937_64 rng{2026};
+  size_t state[KEYS];
+  size_t gen = 0, old = NONE; // old: state[key] before the last command
+
+  Commands() {
+    for (size_t i = 0; i < KEYS; i++)
+      state[i] = NONE;
+  }
+  /**
+   * @brief the next command: does it in state, and returns its key
+   */
+  size_t next() {
+    size_t key = rng() % KEYS;
+    old = state[key], ++gen;
+    if (old == NONE || rng() % 3)
+      state[key] = gen;
+    else
+      state[key] = NONE;
+    return key;
+  }
+};
+
+struct Report {
+  size_t cmd, durable, checkpoints;
+};
+
+using Tree = CachedBPT<size_t, Val>;
+
+/**
+ * @brief the child: runs commands until at least min_cmd are committed and
+ * the log has been checkpointed min_cps times, then runs one more command
+ * without committing it and kills itself, at least 16 commands after the
+ * last fsync of the log
+ */
+[[noreturn]] void child(int out, Storage storage, size_t min_cmd,
+                        size_t min_cps) {
+  WAL wal;
+  Database db;
+  BufferPool<> pool(1 << 18, true, true); // evictions write back
+  Tree tr("wal", false, storage);
+  Commands cmds;
+  Report r{0, 0, 0};
+  size_t log_size = 0;
+  while (true) {
+    size_t key = cmds.next();
+    if (cmds.state[key] == NONE)
+      tr.erase(key);
+    else if (cmds.old != NONE)
+      tr.set(key, Val(key, cmds.gen));
+    else
+      tr.insert(key, Val(key, cmds.gen));
+    if (r.cmd >= min_cmd && r.checkpoints >= min_cps &&
+        r.cmd - r.durable >= 16)
+      raise(SIGKILL); // in the middle of a command, and of a group
+    wal.commit();
+    size_t size = std::filesystem::file_size("./bin/wal.log");
+    if (size < log_size)
+      r.checkpoints++; // the log was emptied
+    log_size = size;
+    r.cmd = cmds.gen, r.durable = wal.durable();
+    if (write(out, &r, sizeof(r)) != sizeof(r))
+      _exit(2);
+  }
+}
+
+/**
+ * @brief appends the last command in the log again, cut short (torn) or with
+ * a byte of its data flipped (corrupted); neither may be replayed
+ */
+void tear_log(bool corrupt) {
+  struct Record { // see WAL::Record
+    int kind, file;
+    size_t pos;
+    int len, pad;
+  };
+  FILE *f = fopen("./bin/wal.log", "r+b");
+  string log;
+  char buf[1 << 16];
+  for (size_t n; (n = fread(buf, 1, sizeof(buf), f));)
+    log.append(buf, n);
+  size_t beg = 0; // of the last command: after the previous commit record
+  for (size_t at = 0, last = 0; at + sizeof(Record) <= log.size();) {
+    Record rec;
+    memcpy(&rec, &log[at], sizeof(rec));
+    at += sizeof(rec) + rec.len;
+    if (rec.kind != 1) // FILE or COMMIT
+      beg = last, last = at;
+  }
+  string cmd = log.substr(beg);
+  if (corrupt)
+    cmd[sizeof(Record) + 8] ^= 1; // in the data of the first record
+  else
+    cmd.resize(cmd.size() - 1 - std::mt19937(7)() % (cmd.size() - 1));
+  fseek(f, 0, SEEK_END);
+  fwrite(cmd.data(), 1, cmd.size(), f);
+  fclose(f);
+}
+
+/**
+ * @brief recovers the tree and finds the prefix of the commands whose state it
+ * holds, which must lie in [r.durable, r.cmd + 1)
+ */
+bool recover(const char *name, Storage storage, const Report &r) {
+  WAL wal;
+  Database db;
+  BufferPool<> pool(1 << 18, true, true);
+  Tree tr("wal", true, storage);
+  static size_t got[KEYS];
+  for (size_t i = 0; i < KEYS; i++)
+    got[i] = NONE;
+  bool ok = true;
+  for (auto it = tr.begin(); it; ++it) {
+    Val val = it.value();
+    if (it.key() >= KEYS || val.key != it.key() || !val.whole())
+      ok = false;
+    else
+      got[it.key()] = val.gen;
+  }
+  // replays the commands, counting the keys whose state differs from got
+  Commands cmds;
+  size_t diff = 0, found = NONE;
+  for (size_t i = 0; i < KEYS; i++)
+    diff += got[i] != NONE;
+  for (size_t n = 0; ok && n <= r.cmd; n++) {
+    if (n >= r.durable && !diff) {
+      found = n;
+      break;
+    }
+    size_t key = cmds.next();
+    diff += (got[key] != cmds.state[key]) - (got[key] != cmds.old);
+  }
+  ok = ok && found != NONE;
+  printf("%s: %zu commands, %zu durable, %zu checkpoints, recovered %zu: %s\n",
+         name, r.cmd, r.durable, r.checkpoints, found, ok ? "ok" : "failed");
+  return ok;
+}
+
+bool crash(const char *name, Storage storage, size_t min_cmd, size_t min_cps,
+           int tear = -1) {
+  char dir[] = "/tmp/wal_test_XXXXXX";
+  if (!mkdtemp(dir) || chdir(dir) != 0)
+    return false;
+  int fds[2];
+  if (pipe(fds) != 0)
+    return false;
+  pid_t pid = fork();
+  if (!pid) {
+    close(fds[0]);
+    child(fds[1], storage, min_cmd, min_cps);
+  }
+  close(fds[1]);
+  Report r{0, 0, 0}, last;
+  while (read(fds[0], &last, sizeof(last)) == sizeof(last))
+    r = last;
+  close(fds[0]);
+  int status;
+  waitpid(pid, &status, 0);
+  bool ok = WIFSIGNALED(status) && WTERMSIG(status) == SIGKILL;
+  if (ok && tear != -1)
+    tear_log(tear);
+  ok = ok && recover(name, storage, r);
+  if (chdir("/tmp") == 0)
+    std::filesystem::remove_all(dir);
+  return ok;
+}
+
+int main() {
+  bool ok = crash("group", Storage::MAPPED, 1000, 0);
+  ok = crash("group_fstream", Storage::FSTREAM, 1000, 0) && ok;
+  ok = crash("torn", Storage::MAPPED, 1000, 0, false) && ok;
+  ok = crash("corrupt", Storage::MAPPED, 1000, 0, true) && ok;
+  ok = crash("checkpoint", Storage::MAPPED, 0, 1) && ok;
+  return ok ? 0 : 1;
+}